@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "disasm/disasm.h"
+#include "demo/demo.h"
+
+static char *
+read_all(FILE *fp, size_t *size)
+{
+	size_t capacity = 4096;
+	char *buf = malloc(capacity);
+	*size = 0;
+
+	for (;;) {
+		*size += fread(buf + *size, 1, capacity - *size - 1, fp);
+
+		if (*size < capacity - 1)
+			break;
+
+		capacity *= 2;
+		buf = realloc(buf, capacity);
+	}
+
+	buf[*size] = '\0';
+	return buf;
+}
+
+static FILE *
+open_file(const char *path, const char *mode)
+{
+	if (!strcmp(path, "-"))
+		return strchr(mode, 'r') ? stdin : stdout;
+
+	FILE *fp = fopen(path, mode);
+	if (!fp)
+		err(2, "%s", path);
+
+	return fp;
+}
+
+/* Check every shader the scanner finds in each file round trips */
+
+static int
+roundtrip(int nr_files, char **paths)
+{
+	unsigned total = 0, failed = 0;
+
+	for (int i = 0; i < nr_files; ++i) {
+		size_t size;
+		FILE *fp = open_file(paths[i], "rb");
+		uint8_t *data = (uint8_t *) read_all(fp, &size);
+		fclose(fp);
+
+		struct agx_shader_range *shaders;
+		size_t count = agx_scan_shaders(data, size, &shaders);
+
+		for (size_t j = 0; j < count; ++j, ++total) {
+			if (!agx_check_roundtrip(data + shaders[j].offset, shaders[j].size)) {
+				printf("%s %zx+%zx doesn't round trip\n", paths[i],
+						shaders[j].offset, shaders[j].size);
+				failed++;
+			}
+		}
+
+		free(shaders);
+		free(data);
+	}
+
+	printf("%u shaders, %u failed\n", total, failed);
+	return failed ? 1 : 0;
+}
+
+/* Check the demo's hand encoded shaders, which the demo can only run on
+ * the hardware, still round trip */
+
+static int
+roundtrip_demo(void)
+{
+	unsigned failed = 0;
+
+	for (unsigned i = 0; i < demo_nr_shaders; ++i) {
+		const struct demo_shader *s = &demo_shaders[i];
+
+		if (!agx_check_roundtrip(s->code, s->size)) {
+			printf("%s doesn't round trip\n", s->label);
+			failed++;
+		}
+	}
+
+	printf("%u demo shaders, %u failed\n", demo_nr_shaders, failed);
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 3 && !strcmp(argv[1], "-r"))
+		return roundtrip(argc - 2, argv + 2);
+	else if (argc == 2 && !strcmp(argv[1], "-d"))
+		return roundtrip_demo();
+
+	if (argc != 2 && argc != 3) {
+		errx(1, "usage: asm-bin IN.s [OUT.bin]\n"
+			"       asm-bin -r FILE...\n"
+			"       asm-bin -d");
+	}
+
+	size_t size;
+	FILE *in = open_file(argv[1], "r");
+	char *text = read_all(in, &size);
+	fclose(in);
+
+	struct agx_assembly out = agx_assemble(text);
+
+	if (out.error)
+		errx(1, "%s:%u: %s", argv[1], out.line, out.error);
+
+	FILE *fp = open_file(argc == 3 ? argv[2] : "-", "wb");
+	fwrite(out.code, 1, out.size, fp);
+	fclose(fp);
+
+	free(out.code);
+	free(text);
+	return 0;
+}
@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Correctness checks and throughput numbers for the capture side of lib/:
+ * LZ4, the blob archive and the trace rings. None of it needs a Mac.
+ *
+ * 	capture-bench check [iterations]
+ * 	capture-bench bench
+ *
+ * Checks round trip LZ4 over data of every kind, rebuild every version of
+ * randomly edited buffers from an archive, with some writes failing, open
+ * archives whose index footer points outside them, and push records through
+ * a small ring from another thread. Archives are written to TMPDIR, or
+ * /tmp. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+#include "lz4.h"
+#include "store.h"
+#include "ring.h"
+
+/* Deterministic across platforms, unlike rand() */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 16;
+}
+
+static unsigned
+rng_range(unsigned lo, unsigned hi)
+{
+	return lo + (rng() % (hi - lo));
+}
+
+static double
+now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + (tp.tv_nsec / 1e9);
+}
+
+static unsigned failures = 0;
+
+static void
+fail(const char *what, unsigned a, unsigned b)
+{
+	fprintf(stderr, "FAIL %s (%u, %u)\n", what, a, b);
+	failures++;
+}
+
+/* Data like buffer captures: random, runs, structs repeated with a counter,
+ * and text from a small alphabet, so every LZ4 path is taken */
+
+enum kind {
+	KIND_RANDOM,
+	KIND_RUNS,
+	KIND_STRUCTS,
+	KIND_TEXT,
+	NUM_KINDS,
+};
+
+static const char *kinds[NUM_KINDS] = { "random", "runs", "structs", "text" };
+
+static void
+fill(uint8_t *buf, size_t size, enum kind kind)
+{
+	switch (kind) {
+	case KIND_RANDOM:
+		for (size_t i = 0; i < size; ++i)
+			buf[i] = rng();
+		break;
+
+	case KIND_RUNS:
+		for (size_t i = 0; i < size;) {
+			size_t len = rng_range(1, 300);
+			memset(buf + i, rng(), len < size - i ? len : size - i);
+			i += len;
+		}
+		break;
+
+	case KIND_STRUCTS:
+		for (size_t i = 0; i < size; ++i)
+			buf[i] = (i % 48 == 0) ? (uint8_t) (i / 48) : (uint8_t) (i % 48);
+		break;
+
+	case KIND_TEXT:
+		for (size_t i = 0; i < size; ++i)
+			buf[i] = "agx_ "[rng() % 5];
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void
+check_lz4(unsigned i)
+{
+	/* Mostly small, to hit the edges around the last literals */
+	size_t size = (i % 4) ? rng_range(0, 64) : rng_range(0, 1 << 20);
+	enum kind kind = i % NUM_KINDS;
+	size_t bound = agx_lz4_bound(size);
+
+	uint8_t *data = malloc(size + 1);
+	uint8_t *compressed = malloc(bound);
+	uint8_t *back = malloc(size + 1);
+	fill(data, size, kind);
+
+	size_t compressed_size = agx_lz4_compress(data, size, compressed, bound);
+
+	if (!compressed_size || compressed_size > bound)
+		fail("lz4 compress", kind, size);
+	else if (!agx_lz4_decompress(compressed, compressed_size, back, size) ||
+		 memcmp(back, data, size))
+		fail("lz4 round trip", kind, size);
+	else if (size && agx_lz4_decompress(compressed, compressed_size, back, size - 1))
+		fail("lz4 decompressed into too small a buffer", kind, size);
+	else if (agx_lz4_decompress(compressed, compressed_size, back, size + 1))
+		fail("lz4 decompressed to the wrong size", kind, size);
+	else if (compressed_size > 1 &&
+		 agx_lz4_decompress(compressed, compressed_size - 1, back, size))
+		fail("lz4 decompressed truncated input", kind, size);
+
+	free(data);
+	free(compressed);
+	free(back);
+}
+
+/* Buffers are edited at random, sometimes resized or rewritten, and stored
+ * after each round, through agx_store_put_bo or with up to a few versions
+ * diffed ahead of being put, as the dump thread does. Some puts fail. Every
+ * version that was stored must rebuild exactly, with the index and without. */
+
+#define NR_BOS 3
+#define NR_VERSIONS 60
+
+struct version {
+	struct agx_hash128 hash;
+	bool delta, stored;
+	uint8_t *data;
+	size_t size;
+};
+
+static void
+check_versions(struct agx_store *store, struct version *versions, unsigned count,
+		unsigned interval, const char *what)
+{
+	for (unsigned v = 0; v < count; ++v) {
+		if (!versions[v].stored)
+			continue;
+
+		size_t size;
+		uint8_t *data = agx_store_get_bo(store, versions[v].hash,
+				versions[v].delta, &size);
+
+		if (!data || size != versions[v].size || memcmp(data, versions[v].data, size))
+			fail(what, interval, v);
+
+		free(data);
+	}
+}
+
+static void
+check_delta(unsigned i)
+{
+	static const unsigned intervals[] = { 0, 1, 4, 16 };
+	unsigned interval = intervals[i % 4];
+	bool pipelined = (i / 4) & 1;
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s/capture-bench-XXXXXX", getenv("TMPDIR") ?: "/tmp");
+	int tmp = mkstemp(path);
+	if (tmp < 0)
+		err(1, "%s", path);
+
+	close(tmp);
+	unlink(path);
+
+	struct agx_store *store = agx_store_open(path, true);
+	if (!store)
+		err(1, "%s", path);
+
+	struct agx_store_bo bos[NR_BOS] = { 0 };
+	struct version *versions = calloc(NR_BOS * NR_VERSIONS, sizeof(*versions));
+	size_t sizes[NR_BOS] = { 1 << 18, 10000, 3 * AGX_STORE_PAGE + 17 };
+	uint8_t *bufs[NR_BOS];
+	unsigned count = 0;
+
+	for (unsigned b = 0; b < NR_BOS; ++b) {
+		bufs[b] = calloc(1, 1 << 19);
+		fill(bufs[b], sizes[b], b % NUM_KINDS);
+	}
+
+	/* Blobs diffed and not yet put, oldest first */
+	struct { struct agx_store_blob blob; unsigned bo, version; } queue[8];
+	unsigned queued = 0;
+
+	for (unsigned round = 0; round < NR_VERSIONS; ++round) {
+		for (unsigned b = 0; b < NR_BOS; ++b) {
+			if (round == NR_VERSIONS / 2 && b == 1)
+				sizes[b] = 20000;
+
+			for (unsigned e = rng_range(0, 4); e > 0; --e) {
+				size_t at = rng_range(0, sizes[b]);
+				size_t len = rng_range(1, 200);
+				fill(bufs[b] + at, len < sizes[b] - at ? len : sizes[b] - at, KIND_RANDOM);
+			}
+
+			if (rng_range(0, 20) == 0)
+				fill(bufs[b], sizes[b], rng() % NUM_KINDS);
+
+			struct version *v = &versions[count];
+			v->data = malloc(sizes[b]);
+			v->size = sizes[b];
+			memcpy(v->data, bufs[b], sizes[b]);
+
+			/* Writes fail with no file to write to */
+			int fd = store->fd;
+
+			if (!pipelined) {
+				bool failing = rng_range(0, 8) == 0;
+				store->fd = failing ? -1 : fd;
+				enum agx_store_status status = agx_store_put_bo(store,
+						&bos[b], bufs[b], sizes[b], interval);
+				store->fd = fd;
+
+				v->stored = status != AGX_STORE_FAILED;
+				v->hash = bos[b].hash;
+				v->delta = bos[b].delta;
+
+				if (status == AGX_STORE_FAILED && !failing)
+					fail("put failed", interval, count);
+
+				count++;
+				continue;
+			}
+
+			/* An unchanged version is the one before it */
+			struct agx_store_blob blob;
+			if (agx_store_diff_bo(&bos[b], bufs[b], sizes[b], interval, &blob)) {
+				queue[queued].blob = blob;
+				queue[queued].bo = b;
+				queue[queued++].version = count;
+			} else {
+				uint8_t *copy = v->data;
+				*v = versions[count - NR_BOS];
+				v->data = copy;
+
+				/* Unless that is still queued */
+				for (unsigned q = 0; q < queued; ++q)
+					v->stored &= queue[q].bo != b;
+			}
+
+			count++;
+
+			if (queued < 6 && round < NR_VERSIONS - 1)
+				continue;
+
+			for (unsigned q = 0; q < queued; ++q) {
+				struct agx_store_bo *bo = &bos[queue[q].bo];
+				struct version *put = &versions[queue[q].version];
+
+				store->fd = rng_range(0, 8) ? fd : -1;
+				enum agx_store_status status =
+					agx_store_put_blob(store, bo, &queue[q].blob);
+				store->fd = fd;
+
+				put->stored = status != AGX_STORE_FAILED;
+				put->hash = bo->hash;
+				put->delta = bo->delta;
+
+				if (status == AGX_STORE_FAILED)
+					agx_store_bo_keyframe(bo);
+			}
+
+			queued = 0;
+		}
+	}
+
+	uint64_t end = store->end;
+	agx_store_close(store);
+
+	store = agx_store_open(path, false);
+	check_versions(store, versions, count, interval, "rebuild");
+	agx_store_close(store);
+
+	/* As if the application had crashed before writing the index */
+	if (truncate(path, end) < 0)
+		err(1, "%s", path);
+
+	store = agx_store_open(path, false);
+	check_versions(store, versions, count, interval, "rebuild without index");
+	agx_store_close(store);
+	unlink(path);
+
+	for (unsigned v = 0; v < count; ++v)
+		free(versions[v].data);
+
+	for (unsigned b = 0; b < NR_BOS; ++b) {
+		agx_store_bo_fini(&bos[b]);
+		free(bufs[b]);
+	}
+
+	free(versions);
+}
+
+/* Footers that agree with the archive's size only once their index offset
+ * wraps around, so the index would start before the archive. They must be
+ * ignored, and whatever the chunks give instead stay within the archive. */
+
+static void
+check_footer(unsigned i)
+{
+	unsigned count = i ? rng_range(1, 8) : 1;
+	size_t n = i ? (rng_range(0, count * 3 + 4) * 8) : 0;
+	size_t size = 8 + n + sizeof(struct agx_store_footer);
+	uint8_t *archive = malloc(size);
+
+	struct agx_store_footer footer = {
+		.index_offset = 8 + n - count * (uint64_t) sizeof(struct agx_store_entry),
+		.count = count,
+		.magic = AGX_STORE_INDEX_MAGIC,
+	};
+
+	memcpy(archive, AGX_STORE_MAGIC, 8);
+	fill(archive + 8, n, KIND_RANDOM);
+	memcpy(archive + 8 + n, &footer, sizeof(footer));
+
+	struct agx_store *store = agx_store_open_memory(archive, size);
+
+	if (!store) {
+		fail("footer open", count, (unsigned) n);
+	} else {
+		for (size_t e = 0; e < store->capacity; ++e) {
+			if (store->entries[e].offset > size - sizeof(struct agx_store_chunk))
+				fail("footer entry", count, (unsigned) n);
+		}
+
+		agx_store_close(store);
+	}
+
+	free(archive);
+}
+
+/* A producer pushes numbered records of every size, in pieces, through a
+ * ring much smaller than it pushes, so every record wraps around sooner or
+ * later. The consumer must see exactly the records pushed, in order, and the
+ * drop counters the rest. */
+
+#define RING_RECORDS 200000
+
+struct ring_check {
+	struct agx_ring ring;
+	uint64_t pushed;
+	atomic_bool finished;
+};
+
+static void *
+ring_producer(void *data)
+{
+	struct ring_check *c = data;
+	uint8_t payload[256];
+
+	for (uint32_t seq = 0; seq < RING_RECORDS; ++seq) {
+		uint32_t size = 8 + (seq * 7) % 200;
+
+		for (uint32_t i = 0; i < size - 8; ++i)
+			payload[i] = seq + i;
+
+		struct iovec iov[] = {
+			{ &seq, sizeof(seq) },
+			{ &size, sizeof(size) },
+			{ payload, size - 8 },
+		};
+
+		c->pushed += agx_ring_pushv(&c->ring, iov, 3);
+	}
+
+	atomic_store(&c->finished, true);
+	return NULL;
+}
+
+static void
+check_ring(void)
+{
+	/* Full, empty and wrapped by hand first */
+	struct agx_ring ring;
+	agx_ring_init(&ring, 64);
+
+	uint8_t in[64], out[64];
+	for (unsigned i = 0; i < 64; ++i)
+		in[i] = i;
+
+	const uint8_t *first, *second;
+	size_t first_size, second_size;
+
+	if (!agx_ring_push(&ring, in, 40) || agx_ring_push(&ring, in, 40) ||
+	    atomic_load(&ring.dropped) != 1 || atomic_load(&ring.dropped_bytes) != 40)
+		fail("ring full", 40, 40);
+
+	agx_ring_consume(&ring, 40);
+
+	if (!agx_ring_push(&ring, in, 40) ||
+	    agx_ring_peek(&ring, &first, &first_size, &second, &second_size) != 40 ||
+	    first_size != 24 || second_size != 16)
+		fail("ring wrap", (unsigned) first_size, (unsigned) second_size);
+
+	memcpy(out, first, first_size);
+	memcpy(out + first_size, second, second_size);
+
+	if (memcmp(in, out, 40))
+		fail("ring wrapped contents", 0, 40);
+
+	agx_ring_fini(&ring);
+
+	/* Then against another thread */
+	struct ring_check c = { 0 };
+	agx_ring_init(&c.ring, 256);
+
+	pthread_t producer;
+	if (pthread_create(&producer, NULL, ring_producer, &c))
+		errx(1, "can't create a thread");
+
+	uint8_t record[256];
+	uint64_t received = 0;
+	uint32_t last = 0;
+	bool done = false;
+
+	while (!done) {
+		/* Stop only after the producer has, with nothing left */
+		done = atomic_load(&c.finished);
+		size_t used;
+
+		while ((used = agx_ring_peek(&c.ring, &first, &first_size,
+						&second, &second_size)) >= 8) {
+			uint32_t header[2];
+			memcpy(record, first, first_size < 8 ? first_size : 8);
+			memcpy(record + first_size, second, first_size < 8 ? 8 - first_size : 0);
+			memcpy(header, record, 8);
+
+			if (header[1] < 8 || header[1] > used || (received && header[0] <= last)) {
+				fail("ring record", header[0], header[1]);
+				done = true;
+				break;
+			}
+
+			size_t n = header[1] < first_size ? header[1] : first_size;
+			memcpy(record, first, n);
+			memcpy(record + n, second, header[1] - n);
+
+			for (uint32_t i = 0; i < header[1] - 8; ++i) {
+				if (record[8 + i] != (uint8_t) (header[0] + i)) {
+					fail("ring payload", header[0], i);
+					break;
+				}
+			}
+
+			agx_ring_consume(&c.ring, header[1]);
+			last = header[0];
+			received++;
+		}
+	}
+
+	pthread_join(producer, NULL);
+
+	if (received != c.pushed || c.pushed + atomic_load(&c.ring.dropped) != RING_RECORDS)
+		fail("ring count", (unsigned) received, (unsigned) c.pushed);
+
+	agx_ring_fini(&c.ring);
+}
+
+static int
+check(unsigned iterations)
+{
+	for (unsigned i = 0; i < iterations; ++i) {
+		check_lz4(i);
+
+		if ((i % 4) == 0)
+			check_delta(i / 4);
+
+		check_footer(i);
+
+		if ((i % 16) == 0)
+			check_ring();
+	}
+
+	printf("%u iterations, %u failures\n", iterations, failures);
+	return failures ? 1 : 0;
+}
+
+/* Throughput, in GB/s of uncompressed data, over 16 MiB of each kind */
+
+#define BENCH_SIZE (16 << 20)
+
+static int
+bench(void)
+{
+	uint8_t *data = malloc(BENCH_SIZE);
+	uint8_t *compressed = malloc(agx_lz4_bound(BENCH_SIZE));
+	uint8_t *back = malloc(BENCH_SIZE);
+
+	printf("%-8s %8s %10s %10s %8s\n", "kind", "ratio", "compress", "decompress", "diff");
+
+	for (unsigned k = 0; k < NUM_KINDS; ++k) {
+		fill(data, BENCH_SIZE, k);
+
+		size_t compressed_size = 0;
+		unsigned iterations = 0;
+		double begin = now(), compress, decompress, diff;
+
+		do {
+			compressed_size = agx_lz4_compress(data, BENCH_SIZE, compressed,
+					agx_lz4_bound(BENCH_SIZE));
+			iterations++;
+		} while ((compress = now() - begin) < 0.2);
+
+		compress = (double) BENCH_SIZE * iterations / compress / 1e9;
+		iterations = 0;
+		begin = now();
+
+		do {
+			agx_lz4_decompress(compressed, compressed_size, back, BENCH_SIZE);
+			iterations++;
+		} while ((decompress = now() - begin) < 0.2);
+
+		decompress = (double) BENCH_SIZE * iterations / decompress / 1e9;
+
+		/* Diffing an unchanged buffer is what most submits cost */
+		struct agx_store_bo bo = { 0 };
+		struct agx_store_blob blob;
+
+		if (agx_store_diff_bo(&bo, data, BENCH_SIZE, 8, &blob))
+			free(blob.data);
+
+		iterations = 0;
+		begin = now();
+
+		do {
+			agx_store_diff_bo(&bo, data, BENCH_SIZE, 8, &blob);
+			iterations++;
+		} while ((diff = now() - begin) < 0.2);
+
+		diff = (double) BENCH_SIZE * iterations / diff / 1e9;
+		agx_store_bo_fini(&bo);
+
+		printf("%-8s %8.2f %10.2f %10.2f %8.2f\n", kinds[k],
+				(double) BENCH_SIZE / compressed_size, compress,
+				decompress, diff);
+	}
+
+	free(data);
+	free(compressed);
+	free(back);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && !strcmp(argv[1], "check"))
+		return check(argc >= 3 ? strtoul(argv[2], NULL, 0) : 500);
+	else if (argc == 2 && !strcmp(argv[1], "bench"))
+		return bench();
+	else
+		errx(1, "usage: capture-bench check [iterations] | bench");
+}
@@ -659,6 +659,27 @@ demo_mem_map(void *map, struct agx_allocation *allocs, unsigned count, unsigned
 	};
 }
 
+/* Uncached reads from write-combined memory are slow, so read each tile of
+ * those exactly once rather than once per scanline */
+
+static void
+demo_readback(struct agx_allocation *framebuffer, struct ash_layout *layout,
+		uint32_t *linear, unsigned linear_pitch)
+{
+	void *tiled = (uint8_t *) framebuffer->map + ash_layout_offset(layout, 0, 0);
+	unsigned width = layout->level[0].width, height = layout->level[0].height;
+
+	if (framebuffer->write_combine) {
+		ash_detile_streaming(tiled, linear,
+				width, layout->bpp, linear_pitch,
+				0, 0, width, height);
+	} else {
+		ash_detile_parallel(tiled, linear,
+				width, layout->bpp, linear_pitch,
+				0, 0, width, height);
+	}
+}
+
 void demo(mach_port_t connection, bool offscreen)
 {
 	struct agx_command_queue command_queue = agx_create_command_queue(connection);
@@ -677,7 +698,8 @@ void demo(mach_port_t connection, bool offscreen)
 
 	struct agx_allocation vsbuf = agx_alloc_mem(connection, 0x8000, AGX_MEMORY_TYPE_CMDBUF_32, false);
 	struct agx_allocation fsbuf = agx_alloc_mem(connection, 0x8000, AGX_MEMORY_TYPE_CMDBUF_32, false);
-	struct agx_allocation framebuffer = agx_alloc_mem(connection, 1024 * 1024 * 4, AGX_MEMORY_TYPE_FRAMEBUFFER, false);
+	struct ash_layout fb_layout = ash_layout_create(true, 800, 600, 32, 1, 1);
+	struct agx_allocation framebuffer = agx_alloc_mem(connection, fb_layout.size, AGX_MEMORY_TYPE_FRAMEBUFFER, false);
 
 	struct agx_allocation cmdbuf = agx_alloc_cmdbuf(connection, 0x4000, true);
 
@@ -695,10 +717,14 @@ void demo(mach_port_t connection, bool offscreen)
 
 	demo_mem_map(memmap.map, allocs, sizeof(allocs) / sizeof(allocs[0]), unk6 + 1);
 
-	uint32_t *linear = malloc(800 * 600 * 4);
+	/* Cache line aligned for the non-temporal stores in ash_detile_streaming */
+	struct ash_layout linear_layout = ash_layout_create(false, 800, 600, 32, 1, 1);
+	uint32_t *linear = aligned_alloc(64, linear_layout.size);
+	unsigned linear_pitch = ash_layout_pitch(&linear_layout, 0);
+	unsigned linear_stride = linear_pitch * (linear_layout.bpp / 8);
 
 	if (!offscreen)
-		slowfb_init((uint8_t *) linear, 800, 600);
+		slowfb_init((uint8_t *) linear, 800, 600, linear_stride);
 
 	for (;;) {
 		demo_cmdbuf(cmdbuf.map, &allocator, &vsbuf, &fsbuf, &framebuffer, &shader_pool);
@@ -710,16 +736,19 @@ void demo(mach_port_t connection, bool offscreen)
 			ret = IODataQueueDequeue(command_queue.notif.queue, NULL, 0);
 
 		/* Dump the framebuffer */
-		ash_detile(framebuffer.map, linear,
-				800, 32, 800,
-				0, 0, 800, 600);
+		demo_readback(&framebuffer, &fb_layout, linear, linear_pitch);
 
 		shader_pool.offset = 0;
 		allocator.offset = 0;
 
 		if (offscreen) {
+			/* Rows are padded to the layout's pitch, but written
+			 * tightly packed */
 			FILE *fp = fopen("fb.bin", "wb");
-			fwrite(linear, 1, 800 * 600 * 4, fp);
+
+			for (unsigned y = 0; y < 600; ++y)
+				fwrite((uint8_t *) linear + y * linear_stride, 1, 800 * 4, fp);
+
 			fclose(fp);
 
 			break;
@@ -2,6 +2,7 @@
 #define __DEMO_H
 
 #include <assert.h>
+#include <string.h>
 #include "io.h"
 #include "cmdstream.h"
 
@@ -51,7 +52,19 @@ uint32_t demo_frag_aux2(struct agx_allocator *allocator);
 uint32_t demo_frag_aux3(struct agx_allocator *allocator);
 uint32_t demo_frag_aux4(struct agx_allocator *allocator);
 
-void slowfb_init(uint8_t *framebuffer, int width, int height);
+/* Every hand encoded shader, for asm-bin -d to check against the
+ * (dis)assembler */
+
+struct demo_shader {
+	const char *label;
+	const uint8_t *code;
+	size_t size;
+};
+
+extern const struct demo_shader demo_shaders[];
+extern const unsigned demo_nr_shaders;
+
+void slowfb_init(uint8_t *framebuffer, int width, int height, int stride);
 void slowfb_update(int width, int height);
 
 #endif
@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include "demo.h"
-
-void agx_disassemble(void *_code, size_t maxlen, FILE *fp);
+#include "../disasm/disasm.h"
 
 #define AGX_STOP \
 	0x88, 0x00, 0x08, 0x00, 0x08, 0x00, 0x08, 0x00, 0x08, \
@@ -141,6 +140,22 @@ uint8_t unk_aux0[] = {
 	0x02, 0x01, 0x00, 0x00, 0x08, 0x01, 0x00, 0x00,
 };
 
+#define DEMO_SHADER(label, code) { label, code, sizeof(code) }
+
+const struct demo_shader demo_shaders[] = {
+	DEMO_SHADER("vs", vertex_shader),
+	DEMO_SHADER("fs", fragment_shader),
+	DEMO_SHADER("unk", unk_aux0),
+	DEMO_SHADER("vert_aux0", vert_aux0),
+	DEMO_SHADER("frag_aux0", frag_aux0),
+	DEMO_SHADER("frag_aux1", frag_aux1),
+	DEMO_SHADER("frag_aux2", frag_aux2),
+	DEMO_SHADER("frag_aux3", frag_aux3),
+	DEMO_SHADER("frag_aux4", frag_aux4),
+};
+
+const unsigned demo_nr_shaders = sizeof(demo_shaders) / sizeof(demo_shaders[0]);
+
 uint32_t
 demo_upload_shader(const char *label, struct agx_allocator *allocator, uint8_t *code, size_t sz)
 {
@@ -31,7 +31,7 @@ Window w;
 XImage *image;
 GC gc;
 
-void slowfb_init(uint8_t *framebuffer, int width, int height) {
+void slowfb_init(uint8_t *framebuffer, int width, int height, int stride) {
 	d = XOpenDisplay(NULL);
 	assert(d != NULL);
 	int black = BlackPixel(d, DefaultScreen(d));
@@ -44,7 +44,7 @@ void slowfb_init(uint8_t *framebuffer, int width, int height) {
 		XNextEvent(d, &e);
 		if (e.type == MapNotify) break;
 	}
-	image = XCreateImage(d, DefaultVisual(d, 0), 24, ZPixmap, 0, (void *) framebuffer, width, height, 32, 0);
+	image = XCreateImage(d, DefaultVisual(d, 0), 24, ZPixmap, 0, (void *) framebuffer, width, height, 32, stride);
 }
 
 void slowfb_update(int width, int height) {
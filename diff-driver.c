@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "disasm/disasm.h"
+
+/* Diffs two streams of disassembly records (disasm-bin -j or -b), aligning on
+ * instructions rather than text lines: two instructions are the same if their
+ * bytes are. Changes are printed like a unified diff with a few instructions
+ * of context, and the exit status is 1 if there are any, as with diff(1). */
+
+#define CONTEXT 3
+
+static struct agx_record *
+read_file(const char *path, size_t *count)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(2, "%s", path);
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		err(2, "%s", path);
+
+	struct agx_record *records = NULL;
+	*count = 0;
+
+	if (st.st_size) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			err(2, "%s", path);
+
+		*count = agx_read_records(map, st.st_size, &records);
+		munmap(map, st.st_size);
+	}
+
+	close(fd);
+	return records;
+}
+
+/* Instructions are compared by a hash of their bytes first */
+
+static uint64_t
+hash_record(const struct agx_record *r)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ r->I.size;
+
+	for (unsigned i = 0; i < r->I.size; ++i)
+		h = (h ^ r->I.bytes[i]) * 0x100000001b3ull;
+
+	return h;
+}
+
+struct seq {
+	const struct agx_record *records;
+	uint64_t *hashes;
+	size_t count;
+};
+
+static bool
+same(const struct seq *a, size_t i, const struct seq *b, size_t j)
+{
+	return a->hashes[i] == b->hashes[j] &&
+		a->records[i].I.size == b->records[j].I.size &&
+		!memcmp(a->records[i].I.bytes, b->records[j].I.bytes,
+				a->records[i].I.size);
+}
+
+enum edit { KEEP, DEL, INS };
+
+static void *
+xmalloc(size_t size)
+{
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		errx(2, "out of memory");
+
+	return p;
+}
+
+/* Myers' O(ND) diff in linear space: find the middle snake of the edit graph
+ * by searching from both ends at once, then diff either side of it, writing
+ * the script into out as we go. v holds both searches' furthest reaching x
+ * per diagonal, sized for the largest problem. */
+
+struct diff {
+	const struct seq *a, *b;
+	long *vf, *vb, off;
+	enum edit *out;
+	size_t pos;
+};
+
+struct snake {
+	long x0, y0, x1, y1, d;
+};
+
+static struct snake
+middle_snake(struct diff *df, long a0, long n, long b0, long m)
+{
+	long *vf = df->vf + df->off, *vb = df->vb + df->off;
+	long delta = n - m, max = (n + m + 1) / 2;
+	bool odd = delta & 1;
+
+	vf[1] = vb[1] = 0;
+
+	for (long d = 0; d <= max; ++d) {
+		/* Forward, overlapping the reverse search from the last round */
+		for (long k = -d; k <= d; k += 2) {
+			long x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ?
+				vf[k + 1] : vf[k - 1] + 1;
+			long y = x - k, sx = x, sy = y;
+
+			while (x < n && y < m && same(df->a, a0 + x, df->b, b0 + y)) {
+				x++;
+				y++;
+			}
+
+			vf[k] = x;
+
+			if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 &&
+			    x + vb[delta - k] >= n)
+				return (struct snake) { sx, sy, x, y, 2 * d - 1 };
+		}
+
+		/* Backward, in x' = n - x from the end, on diagonal delta - k */
+		for (long k = -d; k <= d; k += 2) {
+			long x = (k == -d || (k != d && vb[k - 1] < vb[k + 1])) ?
+				vb[k + 1] : vb[k - 1] + 1;
+			long y = x - k, sx = x, sy = y;
+
+			while (x < n && y < m &&
+			       same(df->a, a0 + n - 1 - x, df->b, b0 + m - 1 - y)) {
+				x++;
+				y++;
+			}
+
+			vb[k] = x;
+
+			if (!odd && delta - k >= -d && delta - k <= d &&
+			    x + vf[delta - k] >= n)
+				return (struct snake) { n - x, m - y, n - sx, m - sy, 2 * d };
+		}
+	}
+
+	assert(!"no middle snake");
+	return (struct snake) { 0 };
+}
+
+static void
+emit_edits(struct diff *df, enum edit edit, long count)
+{
+	for (long i = 0; i < count; ++i)
+		df->out[df->pos++] = edit;
+}
+
+static void
+diff_range(struct diff *df, long a0, long n, long b0, long m)
+{
+	if (!n || !m) {
+		emit_edits(df, DEL, n);
+		emit_edits(df, INS, m);
+		return;
+	}
+
+	struct snake s = middle_snake(df, a0, n, b0, m);
+
+	if (s.d > 1) {
+		diff_range(df, a0, s.x0, b0, s.y0);
+		emit_edits(df, KEEP, s.x1 - s.x0);
+		diff_range(df, a0 + s.x1, n - s.x1, b0 + s.y1, m - s.y1);
+	} else {
+		/* At most one edit: the common prefix, it, then the rest */
+		long i = 0;
+
+		while (i < n && i < m && same(df->a, a0 + i, df->b, b0 + i))
+			i++;
+
+		emit_edits(df, KEEP, i);
+		emit_edits(df, n > m ? DEL : INS, n - m > 0 ? n - m : m - n);
+		emit_edits(df, KEEP, (n < m ? n : m) - i);
+	}
+}
+
+/* Diffs a[a0..a0+n) against b[b0..b0+m), returning the edit script length */
+
+static size_t
+myers(const struct seq *a, size_t a0, size_t n,
+		const struct seq *b, size_t b0, size_t m, enum edit **script)
+{
+	long max = (n + m + 1) / 2;
+	struct diff df = {
+		.a = a,
+		.b = b,
+		.vf = xmalloc((2 * max + 3) * sizeof(long)),
+		.vb = xmalloc((2 * max + 3) * sizeof(long)),
+		.off = max + 1,
+		.out = xmalloc((n + m) * sizeof(enum edit)),
+	};
+
+	diff_range(&df, a0, n, b0, m);
+
+	free(df.vf);
+	free(df.vb);
+
+	*script = df.out;
+	return df.pos;
+}
+
+static void
+print_line(struct agx_emitter *e, char prefix, const struct agx_record *r)
+{
+	agx_emit_char(e, prefix);
+	agx_emit_char(e, ' ');
+	agx_emit_hex(e, r->shader, 0, false);
+	agx_emit_char(e, '+');
+	agx_emit_hex(e, r->offset, 0, false);
+	agx_emit_char(e, '\t');
+	agx_emit_asm(e, &r->I);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		errx(2, "usage: disasm-diff OLD NEW");
+
+	struct seq a = { 0 }, b = { 0 };
+	struct agx_record *ra = read_file(argv[1], &a.count);
+	struct agx_record *rb = read_file(argv[2], &b.count);
+	a.records = ra;
+	b.records = rb;
+
+	a.hashes = xmalloc(a.count * sizeof(uint64_t));
+	b.hashes = xmalloc(b.count * sizeof(uint64_t));
+
+	for (size_t i = 0; i < a.count; ++i)
+		a.hashes[i] = hash_record(&ra[i]);
+
+	for (size_t i = 0; i < b.count; ++i)
+		b.hashes[i] = hash_record(&rb[i]);
+
+	/* Common prefix and suffix are the usual case, and cheap */
+	size_t prefix = 0, suffix = 0;
+
+	while (prefix < a.count && prefix < b.count && same(&a, prefix, &b, prefix))
+		prefix++;
+
+	while (suffix < a.count - prefix && suffix < b.count - prefix &&
+	       same(&a, a.count - 1 - suffix, &b, b.count - 1 - suffix))
+		suffix++;
+
+	enum edit *middle;
+	size_t nr_middle = myers(&a, prefix, a.count - prefix - suffix,
+			&b, prefix, b.count - prefix - suffix, &middle);
+
+	/* The whole script, to print with context */
+	size_t length = prefix + nr_middle + suffix;
+	enum edit *script = xmalloc(length * sizeof(enum edit));
+
+	for (size_t i = 0; i < length; ++i) {
+		if (i < prefix || i >= prefix + nr_middle)
+			script[i] = KEEP;
+		else
+			script[i] = middle[i - prefix];
+	}
+
+	struct agx_emitter e = { .fp = stdout };
+	size_t i = 0, j = 0, last = 0;
+	bool changed = false, printed = false;
+
+	agx_emit_str(&e, "--- ");
+	agx_emit_str(&e, argv[1]);
+	agx_emit_str(&e, "\n+++ ");
+	agx_emit_str(&e, argv[2]);
+	agx_emit_char(&e, '\n');
+
+	for (size_t s = 0; s < length; ++s) {
+		if (script[s] == KEEP) {
+			/* Only near a change */
+			bool near = false;
+
+			for (size_t t = (s > CONTEXT ? s - CONTEXT : 0);
+			     t < length && t <= s + CONTEXT; ++t)
+				near |= (script[t] != KEEP);
+
+			if (near) {
+				if (printed && last + 1 != s)
+					agx_emit_str(&e, "@@\n");
+
+				print_line(&e, ' ', &ra[i]);
+				last = s;
+				printed = true;
+			}
+
+			i++;
+			j++;
+		} else {
+			if (printed && last + 1 != s)
+				agx_emit_str(&e, "@@\n");
+
+			if (script[s] == DEL)
+				print_line(&e, '-', &ra[i++]);
+			else
+				print_line(&e, '+', &rb[j++]);
+
+			last = s;
+			printed = changed = true;
+		}
+	}
+
+	agx_emit_finish(&e);
+
+	free(script);
+	free(middle);
+	free(a.hashes);
+	free(b.hashes);
+	free(ra);
+	free(rb);
+	return changed ? 1 : 0;
+}
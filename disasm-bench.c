@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Throughput numbers for the decoder and printer, in instructions per second,
+ * over a fixed random corpus and over the shaders found in any dumps given:
+ *
+ * 	disasm-bench [DUMP...]
+ *
+ * The random corpus is decoded back to back ignoring stops, so it exercises
+ * every opcode including unknown ones. Real shaders are the ranges found by
+ * agx_scan_shaders, e.g. in the BOs dumped by wrap. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include "disasm/disasm.h"
+
+#define RANDOM_CORPUS_SIZE (4 << 20)
+
+/* Deterministic across platforms, unlike rand() */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 16;
+}
+
+static double
+now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + (tp.tv_nsec / 1e9);
+}
+
+struct corpus {
+	const uint8_t *data;
+	struct agx_shader_range *shaders;
+	size_t count;
+};
+
+/* One pass over the corpus, returning the number of instructions. With an
+ * emitter, each shader is printed into it too, then thrown away. Corpora are
+ * padded so instructions can be decoded in place right up to the end */
+
+static size_t
+run(const struct corpus *c, struct agx_emitter *e, bool stops)
+{
+	size_t instrs = 0;
+
+	for (size_t i = 0; i < c->count; ++i) {
+		const uint8_t *code = c->data + c->shaders[i].offset;
+		size_t size = c->shaders[i].size, bytes = 0;
+		bool stop = false;
+
+		while (bytes < size && !stop) {
+			struct agx_instr I = agx_decode_instr(code + bytes);
+
+			if (e)
+				agx_emit_instr(e, &I, false);
+
+			stop = stops && I.stop;
+			bytes += I.size;
+			instrs++;
+		}
+
+		if (e)
+			e->size = 0;
+	}
+
+	return instrs;
+}
+
+/* Instructions per second, running for at least 200ms after a warm up */
+
+static double
+time_corpus(const struct corpus *c, struct agx_emitter *e, bool stops)
+{
+	size_t instrs = 0;
+	double begin, elapsed;
+
+	run(c, e, stops);
+	begin = now();
+
+	do {
+		instrs += run(c, e, stops);
+		elapsed = now() - begin;
+	} while (elapsed < 0.2);
+
+	return instrs / elapsed;
+}
+
+static void
+report(const char *name, const struct corpus *c, bool stops)
+{
+	struct agx_emitter e = { 0 };
+
+	printf("%-10s %8zu %12zu %12.2f %12.2f\n", name, c->count,
+			run(c, NULL, stops),
+			time_corpus(c, NULL, stops) / 1e6,
+			time_corpus(c, &e, stops) / 1e6);
+
+	agx_emit_finish(&e);
+}
+
+static uint8_t *
+read_file(const char *path, size_t *size)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		err(1, "%s", path);
+
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	uint8_t *data = calloc(*size + AGX_MAX_INSTR_BYTES, 1);
+	if (fread(data, 1, *size, fp) != *size)
+		err(1, "%s", path);
+
+	fclose(fp);
+	return data;
+}
+
+int main(int argc, char **argv)
+{
+	printf("%-10s %8s %12s %12s %12s\n", "corpus", "shaders", "instrs",
+			"Mdecode/s", "Mprint/s");
+
+	/* The random corpus is a single "shader" covering all of it */
+	uint8_t *random = calloc(RANDOM_CORPUS_SIZE + AGX_MAX_INSTR_BYTES, 1);
+	for (size_t i = 0; i < RANDOM_CORPUS_SIZE; ++i)
+		random[i] = rng();
+
+	struct agx_shader_range whole = { .size = RANDOM_CORPUS_SIZE };
+	struct corpus c = { random, &whole, 1 };
+	report("random", &c, false);
+	free(random);
+
+	for (int i = 1; i < argc; ++i) {
+		size_t size;
+		uint8_t *data = read_file(argv[i], &size);
+
+		c = (struct corpus) { .data = data };
+		c.count = agx_scan_shaders(data, size, &c.shaders);
+
+		if (c.count)
+			report(argv[i], &c, true);
+		else
+			warnx("%s: no shaders found", argv[i]);
+
+		free(c.shaders);
+		free(data);
+	}
+
+	return 0;
+}
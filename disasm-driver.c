@@ -1,29 +1,284 @@
-
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "disasm/disasm.h"
+
+/* Maps a whole file read-only, returning NULL (with a warning) on failure or
+ * for an empty file */
+
+static uint8_t *
+map_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s", path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		warn("%s", path);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return map;
+}
+
+/* Scan mode: find shaders in many dump files at once, one file per thread at
+ * a time. Results are printed in argument order as ranges for disasm-bin, or
+ * disassembled. Disassembly is cached by content, in ASAHI_DISASM_CACHE too
+ * if set, since captures are full of the same shaders */
+
+struct scan_file {
+	const char *path;
+	size_t count;
+	struct agx_shader_range *shaders;
+};
+
+struct scan_job {
+	struct scan_file *files;
+	unsigned count;
+	atomic_uint next;
+};
+
+static void *
+scan_worker(void *data)
+{
+	struct scan_job *job = data;
+	unsigned i;
+
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+		struct scan_file *f = &job->files[i];
+		size_t size;
+		uint8_t *map = map_file(f->path, &size);
+
+		if (map) {
+			f->count = agx_scan_shaders(map, size, &f->shaders);
+			munmap(map, size);
+		}
+	}
+
+	return NULL;
+}
+
+/* With disassemble, every shader found is disassembled through a cache, and
+ * repeats of one already printed just refer back to it */
+
+static void
+disassemble_found(struct agx_disasm_cache *cache, struct scan_file *f)
+{
+	size_t size;
+	uint8_t *map = map_file(f->path, &size);
+	if (!map)
+		return;
+
+	for (size_t j = 0; j < f->count; ++j) {
+		struct agx_shader_range *r = &f->shaders[j];
+		struct agx_disasm_cache_entry *e =
+			agx_disasm_cache_get(cache, map + r->offset, r->size);
+
+		printf("// %s at 0x%zx", f->path, r->offset);
+
+		if (e->data) {
+			printf(": same as %s\n", (char *) e->data);
+		} else {
+			size_t len = strlen(f->path) + 32;
+			e->data = malloc(len);
+			snprintf(e->data, len, "%s at 0x%zx", f->path, r->offset);
+			printf("\n");
+			fwrite(e->text, 1, e->text_size, stdout);
+		}
+	}
+
+	munmap(map, size);
+}
+
+static int
+scan(int nr_files, char **paths, bool disassemble)
+{
+	struct scan_job job = {
+		.files = calloc(nr_files, sizeof(struct scan_file)),
+		.count = nr_files,
+	};
+
+	for (int i = 0; i < nr_files; ++i)
+		job.files[i].path = paths[i];
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nr_threads = ncpu > 1 ? ncpu : 1;
+	if (nr_threads > (unsigned) nr_files)
+		nr_threads = nr_files;
+
+	pthread_t *threads = calloc(nr_threads, sizeof(pthread_t));
+
+	/* Files are handed out as workers ask, so if a thread can't be started
+	 * the others just take its share, this one included */
+	unsigned started = 1;
 
-extern void
-agx_disassemble(void *_code, size_t maxlen, FILE *fp);
+	while (started < nr_threads &&
+	       pthread_create(&threads[started], NULL, scan_worker, &job) == 0)
+		++started;
+
+	scan_worker(&job);
+
+	for (unsigned i = 1; i < started; ++i)
+		pthread_join(threads[i], NULL);
+
+	struct agx_disasm_cache *cache =
+		agx_disasm_cache_create(getenv("ASAHI_DISASM_CACHE"));
+
+	for (int i = 0; i < nr_files; ++i) {
+		struct scan_file *f = &job.files[i];
+
+		if (disassemble) {
+			disassemble_found(cache, f);
+		} else {
+			for (size_t j = 0; j < f->count; ++j) {
+				printf("%s %zx+%zx // %u instructions\n", f->path,
+						f->shaders[j].offset, f->shaders[j].size,
+						f->shaders[j].instrs);
+			}
+		}
+
+		free(f->shaders);
+	}
+
+	if (disassemble) {
+		fprintf(stderr, "%zu shaders, %zu unique, %zu from disk\n",
+				cache->stats.hits + cache->stats.disk_hits + cache->stats.misses,
+				cache->stats.entries, cache->stats.disk_hits);
+	}
+
+	for (size_t i = 0; i < cache->capacity; ++i)
+		free(cache->entries[i].data);
+
+	agx_disasm_cache_destroy(cache);
+
+	free(threads);
+	free(job.files);
+	return 0;
+}
+
+/* Ranges are hex, as OFFSET (to the end of the file), OFFSET-END or
+ * OFFSET+LENGTH */
+
+static bool
+parse_range(const char *arg, size_t file_size, size_t *start, size_t *end)
+{
+	char *rest;
+	*start = strtoull(arg, &rest, 16);
+	*end = file_size;
+
+	if (*rest == '-')
+		*end = strtoull(rest + 1, &rest, 16);
+	else if (*rest == '+')
+		*end = *start + strtoull(rest + 1, &rest, 16);
+
+	if (rest == arg || *rest != '\0') {
+		warnx("bad range %s", arg);
+		return false;
+	} else if (*start >= file_size || *end > file_size || *end <= *start) {
+		warnx("range %s outside of file (size %zx)", arg, file_size);
+		return false;
+	}
+
+	return true;
+}
 
 int main(int argc, char **argv)
 {
 	--argc;
 	++argv;
-	if (argc != 2)
-		errx(1, "usage: disasm-bin FILE hex-offset");	
+	if (argc >= 2 && !strcmp(argv[0], "-s"))
+		return scan(argc - 1, argv + 1, false);
+	else if (argc >= 2 && !strcmp(argv[0], "-a"))
+		return scan(argc - 1, argv + 1, true);
 
-	FILE *f = fopen(argv[0], "rb");
-	if (!f)
-		err(2, "input file");
+	/* Instead of the disassembly: cost and register reports, or structured
+	 * records as JSON Lines or binary */
+	enum { TEXT, COST, JSON, BINARY } mode = TEXT;
 
-	off_t offset = strtol(argv[1], NULL, 16);
-	fseek(f, offset, SEEK_SET);
+	if (argc >= 1 && !strcmp(argv[0], "-c"))
+		mode = COST;
+	else if (argc >= 1 && !strcmp(argv[0], "-j"))
+		mode = JSON;
+	else if (argc >= 1 && !strcmp(argv[0], "-b"))
+		mode = BINARY;
 
-	char buf[4096];
-	int n = fread(buf, 1, sizeof(buf), f);
-	fclose(f);
+	if (mode != TEXT) {
+		--argc;
+		++argv;
+	}
 
-	agx_disassemble(buf, n, stdout);
-	return 0;
+	if (argc < 2) {
+		errx(1, "usage: disasm-bin [-c|-j|-b] FILE hex-offset[-end|+length]...\n"
+			"       disasm-bin -s FILE...\n"
+			"       disasm-bin -a FILE...");
+	}
+
+	size_t size;
+	uint8_t *map = map_file(argv[0], &size);
+	if (!map)
+		errx(2, "can't map input file");
+
+	int ret = 0;
+	struct agx_emitter records = { .fp = stdout };
+	struct agx_disasm_cache *cache =
+		agx_disasm_cache_create(getenv("ASAHI_DISASM_CACHE"));
+
+	if (mode == BINARY)
+		agx_emit_record_header(&records, AGX_RECORD_BINARY);
+
+	for (int i = 1; i < argc; ++i) {
+		size_t start, end;
+
+		if (!parse_range(argv[i], size, &start, &end)) {
+			ret = 1;
+			continue;
+		}
+
+		if (argc > 2 && (mode == TEXT || mode == COST))
+			printf("// %s at 0x%zx\n", argv[0], start);
+
+		if (mode == COST) {
+			struct agx_shader_info info =
+				agx_analyze_shader(map + start, end - start);
+
+			agx_print_shader_info(stdout, &info);
+			agx_shader_info_free(&info);
+
+			struct agx_reg_info regs =
+				agx_analyze_regs(map + start, end - start);
+
+			agx_print_reg_info(stdout, &regs);
+		} else if (mode == TEXT) {
+			agx_disassemble_cached(cache, map + start, end - start, stdout);
+		} else {
+			agx_emit_records(&records,
+					mode == JSON ? AGX_RECORD_JSON : AGX_RECORD_BINARY,
+					map + start, end - start, start);
+			agx_emit_flush(&records);
+		}
+	}
+
+	agx_emit_finish(&records);
+	agx_disasm_cache_destroy(cache);
+	munmap(map, size);
+	return ret;
 }
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Fuzz target for the decoder, printer, cache, scanner, analyses, records
+ * and assembler, and for the capture formats read back off the Mac: LZ4
+ * blocks, blob archives and trace records. Built with -fsanitize=fuzzer (make disasm-fuzz) this is a
+ * libFuzzer target, seeded from any corpus directory, such as the BOs dumped
+ * by wrap:
+ *
+ * 	disasm-fuzz CORPUS_DIR
+ *
+ * Built without libFuzzer (make disasm-fuzz-replay) it runs the same checks
+ * over the files given, to reproduce crashes, or over random inputs:
+ *
+ * 	disasm-fuzz-replay FILE...
+ * 	disasm-fuzz-replay -n [iterations]
+ *
+ * Every input is copied to an allocation of exactly its size, so the
+ * sanitizers catch any read past the end of a shader. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+#include "disasm/disasm.h"
+#include "lib/lz4.h"
+#include "lib/store.h"
+#include "lib/trace.h"
+
+#define fuzz_assert(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s\n", #cond); abort(); } } while (0)
+
+static void
+fuzz_disasm(const uint8_t *data, size_t size)
+{
+	struct agx_emitter text = { 0 };
+	agx_disassemble_to(&text, data, size);
+	agx_emit_finish(&text);
+
+	/* The size lookup must agree with a full decode */
+	if (size >= AGX_MAX_INSTR_BYTES) {
+		unsigned bytes = agx_instr_size(data);
+		fuzz_assert(!bytes || bytes == agx_decode_instr(data).size);
+	}
+
+	fuzz_assert(agx_check_roundtrip(data, size));
+}
+
+/* The cache keys on less than the whole range, which mustn't change the
+ * output, including for a prefix of the range */
+
+static void
+fuzz_cache(const uint8_t *data, size_t size)
+{
+	struct agx_disasm_cache *cache = agx_disasm_cache_create(NULL);
+	struct agx_emitter text = { 0 };
+	agx_disassemble_to(&text, data, size);
+
+	for (unsigned i = 0; i < 2; ++i) {
+		struct agx_disasm_cache_entry *e = agx_disasm_cache_get(cache, data, size);
+		fuzz_assert(e->text_size == text.size && !memcmp(e->text, text.data, text.size));
+		fuzz_assert(e->refs == i + 1);
+	}
+
+	size_t prefix = size / 2;
+	text.size = 0;
+	agx_disassemble_to(&text, data, prefix);
+
+	struct agx_disasm_cache_entry *e = agx_disasm_cache_get(cache, data, prefix);
+	fuzz_assert(e->text_size == text.size && !memcmp(e->text, text.data, text.size));
+
+	agx_emit_finish(&text);
+	agx_disasm_cache_destroy(cache);
+}
+
+static void
+fuzz_scan(const uint8_t *data, size_t size)
+{
+	struct agx_shader_range *shaders = NULL;
+	size_t count = agx_scan_shaders(data, size, &shaders);
+
+	for (size_t i = 0; i < count; ++i) {
+		fuzz_assert(shaders[i].offset + shaders[i].size <= size);
+		fuzz_assert(!i || shaders[i].offset >= shaders[i - 1].offset + shaders[i - 1].size);
+	}
+
+	free(shaders);
+}
+
+static void
+fuzz_cfg(const uint8_t *data, size_t size)
+{
+	struct agx_shader_info info = agx_analyze_shader(data, size);
+	unsigned instrs = 0;
+	size_t bytes = 0;
+
+	for (unsigned b = 0; b < info.nr_blocks; ++b) {
+		fuzz_assert(info.blocks[b].offset == bytes);
+		instrs += info.blocks[b].instrs;
+		bytes += info.blocks[b].size;
+
+		for (unsigned s = 0; s < info.blocks[b].nr_succs; ++s)
+			fuzz_assert(info.blocks[b].succs[s] < info.nr_blocks);
+	}
+
+	fuzz_assert(instrs == info.instrs && bytes == info.bytes && bytes <= size);
+	fuzz_assert(info.loops || info.longest_path <= info.instrs);
+	agx_shader_info_free(&info);
+
+	struct agx_reg_info regs = agx_analyze_regs(data, size);
+	fuzz_assert(regs.instrs == info.instrs);
+	fuzz_assert(regs.max_live <= regs.halves && regs.halves <= AGX_NUM_HALVES);
+
+	for (unsigned h = 0; h < AGX_NUM_HALVES; ++h)
+		fuzz_assert(regs.live[h].start <= regs.live[h].end);
+}
+
+/* Both record formats read back to the same instructions, and reading
+ * arbitrary input as records must not crash */
+
+static void
+fuzz_records(const uint8_t *data, size_t size)
+{
+	struct agx_record *json, *binary, *garbage;
+	struct agx_emitter e = { 0 };
+
+	agx_emit_records(&e, AGX_RECORD_JSON, data, size, 0);
+	size_t nr_json = agx_read_records(e.data, e.size, &json);
+	e.size = 0;
+
+	agx_emit_record_header(&e, AGX_RECORD_BINARY);
+	agx_emit_records(&e, AGX_RECORD_BINARY, data, size, 0);
+	size_t nr_binary = agx_read_records(e.data, e.size, &binary);
+
+	fuzz_assert(nr_json == nr_binary);
+
+	for (size_t i = 0; i < nr_json; ++i) {
+		fuzz_assert(json[i].offset == binary[i].offset);
+		fuzz_assert(json[i].I.size == binary[i].I.size);
+		fuzz_assert(!memcmp(json[i].I.bytes, binary[i].I.bytes, json[i].I.size));
+		fuzz_assert(!memcmp(json[i].I.bytes, data + json[i].offset, json[i].I.size));
+	}
+
+	agx_read_records(data, size, &garbage);
+	free(garbage);
+	free(json);
+	free(binary);
+	agx_emit_finish(&e);
+}
+
+/* Assembling arbitrary text must fail cleanly rather than crash */
+
+static void
+fuzz_asm(const uint8_t *data, size_t size)
+{
+	char *text = malloc(size + 1);
+	memcpy(text, data, size);
+	text[size] = '\0';
+
+	struct agx_assembly out = agx_assemble(text);
+	fuzz_assert(out.error ? !out.code : (out.code || !out.size));
+
+	free(out.code);
+	free(text);
+}
+
+/* Decompressing arbitrary input must stay in bounds, with the first two bytes
+ * as the size to decompress to, and the input itself must round trip */
+
+static void
+fuzz_lz4(const uint8_t *data, size_t size)
+{
+	size_t out_size = size >= 2 ? (data[0] | (data[1] << 8)) : 0;
+	uint8_t *out = malloc(out_size ? out_size : 1);
+	agx_lz4_decompress(data + (size >= 2 ? 2 : 0), size - (size >= 2 ? 2 : 0),
+			out, out_size);
+	free(out);
+
+	size_t bound = agx_lz4_bound(size);
+	uint8_t *compressed = malloc(bound);
+	uint8_t *back = malloc(size ? size : 1);
+	size_t compressed_size = agx_lz4_compress(data, size, compressed, bound);
+
+	fuzz_assert(compressed_size);
+	fuzz_assert(agx_lz4_decompress(compressed, compressed_size, back, size));
+	fuzz_assert(!memcmp(back, data, size));
+	fuzz_assert(!size || !agx_lz4_decompress(compressed, compressed_size, back, size - 1));
+
+	free(back);
+	free(compressed);
+}
+
+/* The input is read as the chunks of an archive, unless it is a whole one
+ * already, again with the end of it as an index footer, and again followed by
+ * a footer whose index ends where it should but may start before the archive.
+ * Then every blob it lists is read back, whole and as a delta. */
+
+static void
+fuzz_store_archive(const uint8_t *archive, size_t size)
+{
+	struct agx_store *store = agx_store_open_memory(archive, size);
+	fuzz_assert(store != NULL);
+
+	for (size_t i = 0; i < store->capacity; ++i) {
+		struct agx_hash128 hash = store->entries[i].hash;
+		size_t blob_size;
+
+		for (unsigned delta = 0; delta < 2; ++delta) {
+			void *blob = agx_store_get_bo(store, hash, delta, &blob_size);
+			fuzz_assert(!blob || !delta || blob_size);
+			free(blob);
+		}
+	}
+
+	agx_store_close(store);
+}
+
+static void
+fuzz_store(const uint8_t *data, size_t size)
+{
+	size_t magic = (size >= 8 && !memcmp(data, AGX_STORE_MAGIC, 8)) ? 0 : 8;
+	size_t archive_size = magic + size + 8;
+	uint8_t *archive = malloc(archive_size);
+
+	memcpy(archive, AGX_STORE_MAGIC, 8);
+	memcpy(archive + magic, data, size);
+	fuzz_store_archive(archive, magic + size);
+
+	memcpy(archive + magic + size, AGX_STORE_INDEX_MAGIC, 8);
+	fuzz_store_archive(archive, archive_size);
+
+	uint64_t count = size ? data[size - 1] % 8 : 1;
+	struct agx_store_footer footer = {
+		.index_offset = magic + size - count * sizeof(struct agx_store_entry),
+		.count = count,
+		.magic = AGX_STORE_INDEX_MAGIC,
+	};
+
+	archive_size = magic + size + sizeof(footer);
+	archive = realloc(archive, archive_size);
+	memcpy(archive + magic + size, &footer, sizeof(footer));
+	fuzz_store_archive(archive, archive_size);
+
+	free(archive);
+}
+
+/* Records read from arbitrary input, or a trace, must lie within it and print */
+
+static void
+fuzz_trace(const uint8_t *data, size_t size)
+{
+	struct agx_emitter text = { 0 };
+	const struct agx_trace_record *r;
+	size_t start = 0;
+
+	if (size >= sizeof(struct agx_trace_header) && !memcmp(data, AGX_TRACE_MAGIC, 8))
+		start = sizeof(struct agx_trace_header);
+
+	for (size_t offset = start; (r = agx_trace_record_at(data, size, offset)); offset += r->size) {
+		fuzz_assert(r->size >= sizeof(*r) && r->size <= size - offset);
+		agx_trace_print(&text, r);
+	}
+
+	agx_emit_finish(&text);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	uint8_t *copy = malloc(size ? size : 1);
+	memcpy(copy, data, size);
+
+	fuzz_disasm(copy, size);
+	fuzz_cache(copy, size);
+	fuzz_scan(copy, size);
+	fuzz_cfg(copy, size);
+	fuzz_records(copy, size);
+	fuzz_asm(copy, size);
+	fuzz_lz4(copy, size);
+	fuzz_store(copy, size);
+	fuzz_trace(copy, size);
+
+	free(copy);
+	return 0;
+}
+
+#ifndef AGX_LIBFUZZER
+
+/* Deterministic across platforms, unlike rand() */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 16;
+}
+
+static int
+replay_random(unsigned iterations)
+{
+	uint8_t buf[256];
+
+	for (unsigned i = 0; i < iterations; ++i) {
+		size_t size = rng() % sizeof(buf);
+
+		for (size_t j = 0; j < size; ++j)
+			buf[j] = rng();
+
+		LLVMFuzzerTestOneInput(buf, size);
+	}
+
+	printf("%u inputs ok\n", iterations);
+	return 0;
+}
+
+static int
+replay_files(int nr_files, char **paths)
+{
+	for (int i = 0; i < nr_files; ++i) {
+		FILE *fp = fopen(paths[i], "rb");
+		if (!fp)
+			err(1, "%s", paths[i]);
+
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+
+		uint8_t *data = malloc(size ? size : 1);
+		if (fread(data, 1, size, fp) != (size_t) size)
+			err(1, "%s", paths[i]);
+
+		fclose(fp);
+
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+
+	printf("%d inputs ok\n", nr_files);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && !strcmp(argv[1], "-n"))
+		return replay_random(argc >= 3 ? strtoul(argv[2], NULL, 0) : 100000);
+	else if (argc >= 2)
+		return replay_files(argc - 1, argv + 1);
+	else
+		errx(1, "usage: disasm-fuzz-replay FILE... | -n [iterations]");
+}
+
+#endif
@@ -0,0 +1,696 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "disasm.h"
+
+/* The inverse of agx_print_instr. Each operand parser consumes exactly what
+ * the printer would have printed for it, and the encoders undo the bit
+ * shuffling of the decoders in disasm.c. Whatever the encoders don't know
+ * about is left zero, so every encoded instruction is printed again and
+ * compared against the input to catch anything lost along the way. */
+
+static bool
+eat(const char **p, const char *s)
+{
+	size_t n = strlen(s);
+
+	if (strncmp(*p, s, n))
+		return false;
+
+	*p += n;
+	return true;
+}
+
+static bool
+eat_uint(const char **p, int base, unsigned *v)
+{
+	char *end;
+
+	if (!isxdigit((unsigned char) **p))
+		return false;
+
+	*v = strtoul(*p, &end, base);
+
+	if (end == *p)
+		return false;
+
+	*p = end;
+	return true;
+}
+
+/* Float sources, as printed by agx_print_src */
+
+static bool
+agx_parse_src(const char **p, struct agx_src *s)
+{
+	const char *types[] = { "#", "unk1:", "const_" };
+	*s = (struct agx_src) { .type = AGX_SRC_REG };
+
+	if (eat(p, "w"))
+		s->size32 = true;
+	else if (!eat(p, "h"))
+		return false;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		if (eat(p, types[i]))
+			s->type = i;
+	}
+
+	if (!eat_uint(p, 10, &s->value))
+		return false;
+
+	s->abs = eat(p, ".abs");
+	s->neg = eat(p, ".neg");
+	s->unk = eat(p, ".unk");
+	return true;
+}
+
+static uint16_t
+agx_pack_float_src(struct agx_src s)
+{
+	return (s.value & 0x3F) | (s.type << 6) | (s.unk << 8) |
+		(s.size32 << 9) | (s.abs << 10) | (s.neg << 11);
+}
+
+/* Half sources of the fadd.16 family, as printed by agx_print_fp16_src */
+
+static bool
+agx_parse_fp16_src(const char **p, struct agx_src *s)
+{
+	*s = (struct agx_src) { 0 };
+
+	if (eat(p, "#")) {
+		size_t len = strspn(*p, "-0123456789.");
+		char want[32], got[32];
+
+		if (!len || len >= sizeof(want) || (*p)[len] != 'f')
+			return false;
+
+		memcpy(want, *p, len);
+		want[len] = '\0';
+		*p += len + 1;
+
+		/* The printed value is rounded, so search for the immediate
+		 * that prints the same */
+		for (unsigned i = 0; i < 256; ++i) {
+			snprintf(got, sizeof(got), "%f", agx_decode_float_imm8(i));
+
+			if (!strcmp(got, want)) {
+				s->type = AGX_SRC_FLOAT_IMM;
+				s->value = i;
+				break;
+			}
+		}
+
+		if (s->type != AGX_SRC_FLOAT_IMM)
+			return false;
+	} else if (eat(p, "h")) {
+		s->type = AGX_SRC_REG;
+
+		if (!eat_uint(p, 10, &s->value))
+			return false;
+	} else if (eat(p, "const_")) {
+		s->type = AGX_SRC_CONST;
+
+		if (!eat_uint(p, 10, &s->value))
+			return false;
+	} else if (eat(p, "unk_")) {
+		s->type = AGX_SRC_UNKNOWN;
+
+		if (!eat_uint(p, 16, &s->raw_type) || !eat(p, ":") ||
+				!eat_uint(p, 16, &s->value))
+			return false;
+	} else {
+		return false;
+	}
+
+	s->abs = eat(p, ".abs");
+	s->neg = eat(p, ".neg");
+	return true;
+}
+
+/* Returns the 8-bit value and sets the 6-bit type */
+
+static unsigned
+agx_pack_fp16_src(struct agx_src s, unsigned *type)
+{
+	switch (s.type) {
+	case AGX_SRC_REG:
+		*type = 0x1;
+		break;
+	case AGX_SRC_CONST:
+		*type = 0x4 | ((s.value >> 8) & 1);
+		break;
+	case AGX_SRC_UNKNOWN:
+		*type = s.raw_type;
+		break;
+	default:
+		*type = 0;
+		break;
+	}
+
+	*type |= (s.abs ? 0x8 : 0) | (s.neg ? 0x10 : 0);
+	return s.value & 0xFF;
+}
+
+/* Bitop sources, as printed by agx_print_bitop_src */
+
+static bool
+agx_parse_bitop_src(const char **p, struct agx_src *s)
+{
+	*s = (struct agx_src) { .type = AGX_SRC_REG };
+
+	if (eat(p, "#0x"))
+		s->type = AGX_SRC_IMM;
+	else if (eat(p, "unk_"))
+		s->type = AGX_SRC_UNKNOWN;
+	else if (eat(p, "w"))
+		s->size32 = true;
+	else if (!eat(p, "h"))
+		return false;
+
+	return eat_uint(p, (s->type == AGX_SRC_REG) ? 10 : 16, &s->value);
+}
+
+static uint16_t
+agx_pack_bitop_src(struct agx_src s)
+{
+	unsigned mode, v = s.value;
+
+	if (s.type == AGX_SRC_UNKNOWN)
+		return s.value;
+	else if (s.type == AGX_SRC_IMM)
+		mode = 0x0;
+	else if (s.size32)
+		mode = 0xb, v <<= 1;
+	else
+		mode = 0x3;
+
+	return (v & 0x3f) | (mode << 6) | ((v & 0xc0) << 4);
+}
+
+static const struct {
+	unsigned selector;
+	const char *name;
+} agx_sysvals[] = {
+	{ 0x00, "[threadgroup_position_in_grid]" },
+	{ 0x0c, "[thread_position_in_threadgroup]" },
+	{ 0x0d, "[thread_position_in_simdgroup]" },
+	{ 0x104, "[thread_position_in_grid]" },
+};
+
+static bool
+agx_parse_sysval(const char **p, struct agx_src *s)
+{
+	*s = (struct agx_src) { .type = AGX_SRC_SYSVAL };
+	bool found = false;
+
+	for (unsigned i = 0; i < sizeof(agx_sysvals) / sizeof(agx_sysvals[0]); ++i) {
+		if (eat(p, agx_sysvals[i].name)) {
+			s->value = agx_sysvals[i].selector;
+			found = true;
+			break;
+		}
+	}
+
+	if (!found && !(eat(p, "[unk_") && eat_uint(p, 16, &s->value) && eat(p, "]")))
+		return false;
+
+	const char *c;
+	if (!eat(p, ".") || !**p || !(c = strchr("xyzw", **p)))
+		return false;
+
+	s->component = c - "xyzw";
+	++*p;
+	return true;
+}
+
+/* Comparison suffixes of icsel/fcsel */
+
+static const char *agx_icsel_modes[16] = {
+	[0x1] = "eq", [0x2] = "imin", [0x3] = "ult", [0x4] = "imax", [0x5] = "ugt",
+};
+
+static const char *agx_fcsel_modes[16] = {
+	[0x6] = "fmin", [0xE] = "fmax",
+};
+
+static bool
+agx_parse_opcode(const char *name, size_t len, unsigned *opc, unsigned *mode)
+{
+	int o = agx_opcode_from_name(name, len);
+
+	if (o >= 0) {
+		*opc = o;
+		return true;
+	}
+
+	if (len > 3 && !strncmp(name, "op_", 3)) {
+		const char *p = name + 3;
+		return eat_uint(&p, 16, opc) && p == name + len && *opc < 256;
+	}
+
+	/* Otherwise maybe a select with its comparison */
+	const char *dot = memchr(name, '.', len);
+	if (!dot)
+		return false;
+
+	o = agx_opcode_from_name(name, dot - name);
+	if (o != OPC_ICSEL && o != OPC_FCSEL)
+		return false;
+
+	*opc = o;
+
+	const char **modes = (o == OPC_ICSEL) ? agx_icsel_modes : agx_fcsel_modes;
+	size_t mode_len = len - (dot - name) - 1;
+
+	for (unsigned i = 0; i < 16; ++i) {
+		if (modes[i] && strlen(modes[i]) == mode_len &&
+				!strncmp(dot + 1, modes[i], mode_len)) {
+			*mode = i;
+			return true;
+		}
+	}
+
+	const char *p = dot + 1;
+	return eat(&p, "unk") && eat_uint(&p, 16, mode) &&
+		p == name + len && *mode < 16;
+}
+
+/* Encodes one instruction line into code, which must be zeroed and
+ * AGX_MAX_INSTR_BYTES long. Returns an error message or NULL */
+
+static const char *
+agx_encode_instr(const char *line, uint8_t *code)
+{
+	const char *p = line;
+	bool unk80;
+
+	if (eat(&p, "+"))
+		unk80 = true;
+	else if (eat(&p, "-"))
+		unk80 = false;
+	else
+		return "expected + or - before the opcode";
+
+	size_t len = strcspn(p, " ");
+	unsigned opc, mode = 0;
+
+	if (!agx_parse_opcode(p, len, &opc, &mode))
+		return "unknown opcode";
+
+	p += len;
+
+	unsigned dest;
+	bool dest_32, dest_unk = false;
+
+	if (eat(&p, " w"))
+		dest_32 = true;
+	else if (eat(&p, " h"))
+		dest_32 = false;
+	else
+		return "expected destination";
+
+	if (!eat_uint(&p, 10, &dest) || dest >= 64)
+		return "bad destination";
+
+	/* st_var's dest size is inverted, the printed .unk is the same bit */
+	if (opc == OPC_ST_VAR) {
+		dest_unk = eat(&p, ".unk");
+		dest_32 = !dest_32;
+
+		if (dest_unk != dest_32)
+			return "st_var .unk must match the register size";
+	}
+
+	code[0] = (opc & 0x7F) | (unk80 ? 0x80 : 0);
+	code[1] = (opc & 0x80) | (dest << 1) | (dest_32 ? 1 : 0);
+
+	if (opc == OPC_ICSEL || opc == OPC_FCSEL)
+		code[7] = mode << 4;
+
+	unsigned size = agx_decode_instr(code).size;
+	struct agx_src src[AGX_MAX_SRCS];
+	unsigned nr_srcs = 0;
+
+	switch (opc) {
+	case OPC_ST_VAR: {
+		unsigned index, unk2 = 0x8, unk3 = 0x80;
+
+		if (!eat(&p, ", index:") || !eat_uint(&p, 10, &index))
+			return "expected index";
+
+		if (eat(&p, ", unk2=") && !eat_uint(&p, 16, &unk2))
+			return "bad unk2";
+
+		if (eat(&p, ", unk3=") && !eat_uint(&p, 16, &unk3))
+			return "bad unk3";
+
+		code[2] = (index & 0xF) | (unk2 << 4);
+		code[3] = unk3;
+		break;
+	}
+
+	case OPC_LD_COMPUTE:
+		if (!eat(&p, ", ") || !agx_parse_sysval(&p, &src[0]))
+			return "expected special register";
+
+		code[2] = (src[0].component | (src[0].value << 2)) & 0xFF;
+		code[3] = src[0].value >> 6;
+		break;
+
+	case OPC_BITOP: {
+		unsigned control;
+
+		if (!eat(&p, ", #0x") || !eat_uint(&p, 16, &control) || !eat(&p, ", ") ||
+				!agx_parse_bitop_src(&p, &src[0]) || !eat(&p, ", ") ||
+				!agx_parse_bitop_src(&p, &src[1]))
+			return "expected bitop operands";
+
+		uint16_t a = agx_pack_bitop_src(src[0]);
+		uint16_t b = agx_pack_bitop_src(src[1]);
+
+		code[2] = a & 0xFF;
+		code[3] = ((a >> 8) & 0x3) | ((control & 0x3) << 2) | ((b & 0xF) << 4);
+		code[4] = ((b >> 4) & 0x3F) | ((control & 0xC) << 4);
+		code[5] = ((a >> 8) & 0xC) | ((b >> 10) & 0x3);
+		break;
+	}
+
+	case OPC_FADD_16:
+	case OPC_FADD_SAT_16:
+	case OPC_FMUL_16:
+	case OPC_FMUL_SAT_16: {
+		if (!eat(&p, ", ") || !agx_parse_fp16_src(&p, &src[0]) ||
+				!eat(&p, ", ") || !agx_parse_fp16_src(&p, &src[1]))
+			return "expected half sources";
+
+		unsigned type1, type2;
+		unsigned src1 = agx_pack_fp16_src(src[0], &type1);
+		unsigned src2 = agx_pack_fp16_src(src[1], &type2);
+
+		code[2] = (src1 & 0x3F) | ((type1 & 0x3) << 6);
+		code[3] = ((type1 >> 2) & 0xF) | ((src2 & 0xF) << 4);
+		code[4] = ((src2 >> 4) & 0x3) | ((type2 & 0x3F) << 2);
+		code[5] = ((src1 >> 4) & 0x0C) | ((src2 >> 6) & 0x3);
+		break;
+	}
+
+	case OPC_MOVI: {
+		unsigned imm;
+
+		if (!eat(&p, ", #0x") || !eat_uint(&p, 16, &imm))
+			return "expected immediate";
+
+		code[2] = imm & 0xFF;
+		code[3] = (imm >> 8) & 0xFF;
+
+		if (dest_32) {
+			code[4] = (imm >> 16) & 0xFF;
+			code[5] = (imm >> 24) & 0xFF;
+		}
+
+		break;
+	}
+
+	default: {
+		unsigned unk5 = 0;
+
+		while (nr_srcs < AGX_MAX_SRCS && eat(&p, ", ")) {
+			if (!agx_parse_src(&p, &src[nr_srcs++]))
+				return "bad source";
+		}
+
+		if (eat(&p, " /* unk5 = ") && !(eat_uint(&p, 16, &unk5) && eat(&p, " */")))
+			return "bad unk5";
+
+		if (opc == OPC_FADD_32 || opc == OPC_FADD_SAT_32 ||
+				opc == OPC_FMUL_32 || opc == OPC_FMUL_SAT_32) {
+			uint16_t a = nr_srcs > 0 ? agx_pack_float_src(src[0]) : 0;
+			uint16_t b = nr_srcs > 1 ? agx_pack_float_src(src[1]) : 0;
+
+			code[2] = a & 0xFF;
+			code[3] = (a >> 8) | ((b & 0xF) << 4);
+			code[4] = b >> 4;
+			code[5] = unk5;
+			break;
+		}
+
+		/* The guessed layout of agx_decode_guess */
+		bool iadd = opc == OPC_IADD;
+
+		if (nr_srcs > 0) {
+			code[2] |= (src[0].value & 0x3F) | (src[0].type << 6);
+			code[3] |= (src[0].size32 ? 0x20 : 0) | (src[0].abs ? 0x04 : 0) |
+				(src[0].neg ? 0x08 : 0);
+
+			if (iadd)
+				code[5] |= (src[0].value >> 4) & 0x0C;
+		}
+
+		if (nr_srcs > 1) {
+			code[3] |= (src[1].value & 0xF) << 4;
+			code[4] |= ((src[1].value >> 4) & 0x3) | (src[1].type << 2) |
+				(src[1].size32 ? 0x20 : 0) | (src[1].abs ? 0x40 : 0) |
+				(src[1].neg ? 0x80 : 0);
+			code[7] |= (src[1].value >> 6) & 0x3;
+		}
+
+		if (nr_srcs > 2) {
+			code[5] |= (src[2].value & 0x3F) | (src[2].type << 6);
+			code[6] |= (src[2].value & 0xC0) | (src[2].size32 ? 0x20 : 0) |
+				(src[2].abs ? 0x04 : 0) | (src[2].neg ? 0x08 : 0);
+		}
+
+		break;
+	}
+	}
+
+	if (*p)
+		return "unexpected characters after the operands";
+
+	/* Guessed layouts may reach past the end of the instruction, where
+	 * nothing can be encoded */
+	memset(code + size, 0, AGX_MAX_INSTR_BYTES - size);
+	return NULL;
+}
+
+/* Print an instruction (without hexdump) into buf */
+
+static void
+agx_print_to(char *buf, size_t size, const struct agx_instr *I)
+{
+	struct agx_emitter e = { 0 };
+	agx_emit_instr(&e, I, false);
+
+	/* Drop the hexdump line if it printed one, and the newline */
+	const char *line = agx_emit_string(&e);
+	if (line[0] == '#')
+		line = strchr(line, '\n') + 1;
+
+	snprintf(buf, size, "%.*s", (int) strcspn(line, "\n"), line);
+	agx_emit_finish(&e);
+}
+
+/* An instruction taken from its hexdump, checked once everything after it is
+ * assembled, as its operands may be decoded from the bytes that follow */
+
+struct agx_hex_instr {
+	size_t offset;
+	const char *text;
+	size_t len;
+	unsigned line;
+};
+
+struct agx_assembly
+agx_assemble(const char *text)
+{
+	struct agx_assembly out = { 0 };
+	size_t capacity = 0;
+
+	struct agx_hex_instr *hexed = NULL;
+	size_t nr_hexed = 0, hexed_capacity = 0;
+
+	uint8_t hex[AGX_MAX_INSTR_BYTES];
+	unsigned hex_bytes = 0;
+	bool have_hex = false;
+
+	for (const char *p = text; *p; ) {
+		const char *start = p;
+		size_t len = strcspn(p, "\n");
+		char line[512];
+		++out.line;
+
+		if (len >= sizeof(line)) {
+			out.error = "line too long";
+			goto fail;
+		}
+
+		memcpy(line, p, len);
+		line[len] = '\0';
+		p += len + (p[len] == '\n');
+
+		while (len && isspace((unsigned char) line[len - 1]))
+			line[--len] = '\0';
+
+		if (!len || !strncmp(line, "//", 2))
+			continue;
+
+		/* Hexdumps are raw bytes for the next instruction */
+		if (line[0] == '#') {
+			const char *q = line + 1;
+			unsigned byte;
+			hex_bytes = 0;
+
+			while (eat(&q, " ") && eat_uint(&q, 16, &byte) && byte < 256) {
+				if (hex_bytes == AGX_MAX_INSTR_BYTES) {
+					out.error = "hexdump too long";
+					goto fail;
+				}
+
+				hex[hex_bytes++] = byte;
+			}
+
+			if (*q || hex_bytes < 2) {
+				out.error = "bad hexdump";
+				goto fail;
+			}
+
+			have_hex = true;
+			continue;
+		}
+
+		uint8_t code[AGX_MAX_INSTR_BYTES] = { 0 };
+		char printed[512];
+		unsigned size;
+
+		if (have_hex) {
+			memcpy(code, hex, hex_bytes);
+			struct agx_instr I = agx_decode_instr(code);
+			size = I.size;
+
+			/* The operands are checked at the end, the opcode now */
+			agx_print_to(printed, sizeof(printed), &I);
+
+			if (size != hex_bytes ||
+					strcspn(printed, " ") != strcspn(line, " ") ||
+					strncmp(printed, line, strcspn(line, " "))) {
+				out.error = "hexdump doesn't match the instruction";
+				goto fail;
+			}
+
+			if (nr_hexed == hexed_capacity) {
+				hexed_capacity = hexed_capacity ? hexed_capacity * 2 : 64;
+				hexed = realloc(hexed, hexed_capacity * sizeof(*hexed));
+			}
+
+			hexed[nr_hexed++] = (struct agx_hex_instr) {
+				out.size, start, len, out.line
+			};
+
+			have_hex = false;
+		} else {
+			out.error = agx_encode_instr(line, code);
+
+			if (out.error)
+				goto fail;
+
+			struct agx_instr I = agx_decode_instr(code);
+			size = I.size;
+			agx_print_to(printed, sizeof(printed), &I);
+
+			if (strcmp(printed, line)) {
+				out.error = "can't encode exactly, prints back differently";
+				goto fail;
+			}
+		}
+
+		if (out.size + size > capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			out.code = realloc(out.code, capacity);
+		}
+
+		memcpy(out.code + out.size, code, size);
+		out.size += size;
+	}
+
+	if (have_hex) {
+		out.error = "hexdump without an instruction";
+		goto fail;
+	}
+
+	/* Decoded in place, as the disassembler did, each must print as
+	 * written. Edits to its operands would otherwise be lost */
+	for (size_t i = 0; i < nr_hexed; ++i) {
+		struct agx_instr I;
+		char printed[512];
+
+		agx_decode_at(out.code, out.size, hexed[i].offset, &I);
+		agx_print_to(printed, sizeof(printed), &I);
+
+		if (strlen(printed) != hexed[i].len ||
+				memcmp(printed, hexed[i].text, hexed[i].len)) {
+			out.error = "operands of an instruction with a hexdump "
+				"can't be edited, only its hexdump";
+			out.line = hexed[i].line;
+			goto fail;
+		}
+	}
+
+	free(hexed);
+	return out;
+
+fail:
+	free(hexed);
+	free(out.code);
+	out.code = NULL;
+	out.size = 0;
+	return out;
+}
+
+bool
+agx_check_roundtrip(const void *code, size_t size)
+{
+	/* Only the shader itself can round trip. Whatever follows its stop
+	 * could change how the last instructions print */
+	struct agx_instr I = { 0 };
+	size_t end = 0;
+
+	while (end < size && !I.stop && agx_decode_at(code, size, end, &I))
+		end += I.size;
+
+	struct agx_emitter text = { 0 };
+	agx_disassemble_to(&text, code, end);
+
+	struct agx_assembly out = agx_assemble(agx_emit_string(&text));
+	bool ok = !out.error && out.size <= size &&
+		(!out.size || !memcmp(out.code, code, out.size));
+
+	free(out.code);
+	agx_emit_finish(&text);
+	return ok;
+}
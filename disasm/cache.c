@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "disasm.h"
+#include "../lib/hash.h"
+
+/* Disassembly keyed by content, so a shader uploaded or dumped many times over
+ * a capture is only disassembled once. The key is the bytes the disassembly
+ * actually depends on: the shader up to its stop, plus the few bytes after
+ * that the decoder may peek at, clamped to the range given. Whatever follows
+ * in the BO doesn't matter, so the same shader in different BOs is one entry.
+ *
+ * Entries live in an open addressed table, and with a directory also on disk
+ * as one file per shader named by a 128-bit hash: a header, the key bytes to
+ * rule out collisions, then the text. The header has AGX_DISASM_VERSION, so
+ * text printed by another version is disassembled again. */
+
+#define AGX_CACHE_FILE_MAGIC "AGXDIS02"
+
+static size_t
+agx_cache_key_size(const uint8_t *code, size_t maxlen)
+{
+	size_t offset = 0;
+
+	while (offset + 2 <= maxlen) {
+		unsigned size = agx_instr_size(code + offset) ?: 2;
+		bool stop = code[offset] == (OPC_STOP | 0x80);
+
+		offset += size;
+
+		if (stop)
+			break;
+	}
+
+	offset += AGX_MAX_INSTR_BYTES;
+	return offset < maxlen ? offset : maxlen;
+}
+
+struct agx_disasm_cache *
+agx_disasm_cache_create(const char *dir)
+{
+	struct agx_disasm_cache *cache = calloc(1, sizeof(*cache));
+	cache->capacity = 256;
+	cache->entries = calloc(cache->capacity, sizeof(*cache->entries));
+	cache->verbose = getenv("ASAHI_VERBOSE") != NULL;
+
+	if (dir) {
+		mkdir(dir, 0755);
+		cache->dir = strdup(dir);
+	}
+
+	return cache;
+}
+
+void
+agx_disasm_cache_destroy(struct agx_disasm_cache *cache)
+{
+	for (size_t i = 0; i < cache->capacity; ++i) {
+		free(cache->entries[i].key);
+		free(cache->entries[i].text);
+	}
+
+	free(cache->entries);
+	free(cache->dir);
+	free(cache);
+}
+
+static struct agx_disasm_cache_entry *
+agx_cache_slot(struct agx_disasm_cache_entry *entries, size_t capacity,
+		uint64_t hash, const uint8_t *key, size_t key_size)
+{
+	for (size_t i = hash & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+		struct agx_disasm_cache_entry *e = &entries[i];
+
+		if (!e->text)
+			return e;
+
+		if (e->hash == hash && e->key_size == key_size &&
+		    !memcmp(e->key, key, key_size))
+			return e;
+	}
+}
+
+static void
+agx_cache_grow(struct agx_disasm_cache *cache)
+{
+	size_t capacity = cache->capacity * 2;
+	struct agx_disasm_cache_entry *entries = calloc(capacity, sizeof(*entries));
+
+	for (size_t i = 0; i < cache->capacity; ++i) {
+		struct agx_disasm_cache_entry *e = &cache->entries[i];
+
+		if (e->text)
+			*agx_cache_slot(entries, capacity, e->hash, e->key, e->key_size) = *e;
+	}
+
+	free(cache->entries);
+	cache->entries = entries;
+	cache->capacity = capacity;
+}
+
+static char *
+agx_cache_path(struct agx_disasm_cache *cache, const uint8_t *key,
+		size_t key_size)
+{
+	struct agx_hash128 h = agx_hash128(key, key_size);
+	size_t len = strlen(cache->dir) + 1 + 32 + 1 + 3 + 1;
+	char *path = malloc(len);
+
+	snprintf(path, len, "%s/%016llx%016llx.%s", cache->dir,
+			(unsigned long long) h.hi, (unsigned long long) h.lo,
+			cache->verbose ? "vtx" : "txt");
+	return path;
+}
+
+/* Header is the magic, then the version and the key and text sizes as 64-bit.
+ * The text must fit in the rest of the file */
+
+static bool
+agx_cache_read_file(struct agx_disasm_cache *cache,
+		struct agx_disasm_cache_entry *e, const uint8_t *key)
+{
+	char *path = agx_cache_path(cache, key, e->key_size);
+	FILE *fp = fopen(path, "rb");
+	free(path);
+
+	if (!fp)
+		return false;
+
+	char magic[8];
+	uint64_t header[3];
+	struct stat st;
+	bool ok = false;
+
+	if (fstat(fileno(fp), &st) == 0 &&
+	    fread(magic, 1, 8, fp) == 8 && !memcmp(magic, AGX_CACHE_FILE_MAGIC, 8) &&
+	    fread(header, sizeof(uint64_t), 3, fp) == 3 &&
+	    header[0] == AGX_DISASM_VERSION && header[1] == e->key_size &&
+	    sizeof(magic) + sizeof(header) + e->key_size <= (uint64_t) st.st_size &&
+	    header[2] <= st.st_size - sizeof(magic) - sizeof(header) - e->key_size) {
+		uint8_t *stored = malloc(e->key_size ? e->key_size : 1);
+		char *text = malloc(header[2] + 1);
+
+		if (fread(stored, 1, e->key_size, fp) == e->key_size &&
+		    !memcmp(stored, key, e->key_size) &&
+		    fread(text, 1, header[2], fp) == header[2]) {
+			text[header[2]] = '\0';
+			e->text = text;
+			e->text_size = header[2];
+			ok = true;
+		} else {
+			free(text);
+		}
+
+		free(stored);
+	}
+
+	fclose(fp);
+	return ok;
+}
+
+/* Written to a temporary then renamed, so concurrent tools never see half a
+ * file. Failure just means no disk entry */
+
+static void
+agx_cache_write_file(struct agx_disasm_cache *cache,
+		const struct agx_disasm_cache_entry *e)
+{
+	char *path = agx_cache_path(cache, e->key, e->key_size);
+	size_t len = strlen(path) + 32;
+	char *tmp = malloc(len);
+	snprintf(tmp, len, "%s.%ld.tmp", path, (long) getpid());
+
+	FILE *fp = fopen(tmp, "wb");
+
+	if (fp) {
+		uint64_t header[3] = { AGX_DISASM_VERSION, e->key_size, e->text_size };
+		bool ok = fwrite(AGX_CACHE_FILE_MAGIC, 1, 8, fp) == 8 &&
+			fwrite(header, sizeof(uint64_t), 3, fp) == 3 &&
+			fwrite(e->key, 1, e->key_size, fp) == e->key_size &&
+			fwrite(e->text, 1, e->text_size, fp) == e->text_size;
+
+		if (fclose(fp) == 0 && ok)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+
+	free(tmp);
+	free(path);
+}
+
+struct agx_disasm_cache_entry *
+agx_disasm_cache_get(struct agx_disasm_cache *cache, const void *_code,
+		size_t maxlen)
+{
+	const uint8_t *code = _code;
+	size_t key_size = agx_cache_key_size(code, maxlen);
+	uint64_t hash = agx_hash64(code, key_size, 0);
+
+	/* Grow first, so the entry returned stays put */
+	if ((cache->stats.entries + 1) * 2 > cache->capacity)
+		agx_cache_grow(cache);
+
+	struct agx_disasm_cache_entry *e =
+		agx_cache_slot(cache->entries, cache->capacity, hash, code, key_size);
+
+	if (e->text) {
+		cache->stats.hits++;
+		e->refs++;
+		return e;
+	}
+
+	/* New entry, filled in from disk or by disassembling */
+	e->hash = hash;
+	e->key_size = key_size;
+	e->key = malloc(key_size ? key_size : 1);
+	memcpy(e->key, code, key_size);
+	e->refs = 1;
+
+	if (cache->dir && agx_cache_read_file(cache, e, code)) {
+		cache->stats.disk_hits++;
+	} else {
+		/* Same output as the whole range, see agx_cache_key_size */
+		struct agx_emitter text = { 0 };
+		agx_disassemble_to(&text, code, key_size);
+
+		agx_emit_string(&text);
+		e->text = text.data;
+		e->text_size = text.size;
+		cache->stats.misses++;
+
+		if (cache->dir)
+			agx_cache_write_file(cache, e);
+	}
+
+	cache->stats.entries++;
+	cache->stats.bytes += key_size + e->text_size;
+	return e;
+}
+
+void
+agx_disassemble_cached(struct agx_disasm_cache *cache, const void *code,
+		size_t maxlen, FILE *fp)
+{
+	struct agx_disasm_cache_entry *e = agx_disasm_cache_get(cache, code, maxlen);
+	fwrite(e->text, 1, e->text_size, fp);
+}
@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disasm.h"
+
+/* Static analysis of a shader on top of the decoder: basic blocks, counts of
+ * each class of instruction and the longest path through the blocks, as a
+ * cost metric that can be compared across captures. */
+
+static const char *agx_class_names[AGX_NUM_CLASSES] = {
+	[AGX_CLASS_ALU] = "alu",
+	[AGX_CLASS_MEMORY] = "load/store",
+	[AGX_CLASS_VARYING] = "varying",
+	[AGX_CLASS_BLEND] = "blend",
+	[AGX_CLASS_CONTROL] = "control",
+	[AGX_CLASS_OTHER] = "other",
+};
+
+enum agx_instr_class
+agx_instr_class(uint8_t opcode)
+{
+	switch (opcode) {
+	case OPC_FFMA_CMPCT_16:
+	case OPC_FFMA_CMPCT_SAT_16:
+	case OPC_FMUL_16:
+	case OPC_FADD_16:
+	case OPC_FFMA_16:
+	case OPC_FMUL_SAT_16:
+	case OPC_FADD_SAT_16:
+	case OPC_FFMA_SAT_16:
+	case OPC_FROUND_32:
+	case OPC_FFMA_CMPCT_32:
+	case OPC_FFMA_CMPCT_SAT_32:
+	case OPC_FMUL_32:
+	case OPC_FADD_32:
+	case OPC_FFMA_32:
+	case OPC_FMUL_SAT_32:
+	case OPC_FADD_SAT_32:
+	case OPC_FFMA_SAT_32:
+	case OPC_IADD:
+	case OPC_IMAD:
+	case OPC_ISHL:
+	case OPC_IADDSAT:
+	case OPC_ISHR:
+	case OPC_I2F:
+	case OPC_FCSEL:
+	case OPC_ICSEL:
+	case OPC_MOVI:
+	case OPC_BITOP:
+		return AGX_CLASS_ALU;
+
+	case OPC_LOAD:
+	case OPC_STORE:
+	case OPC_LD_COMPUTE:
+		return AGX_CLASS_MEMORY;
+
+	case OPC_LD_VAR_NO_PERSPECTIVE:
+	case OPC_LD_VAR:
+	case OPC_ST_VAR:
+		return AGX_CLASS_VARYING;
+
+	case OPC_BLEND:
+	case OPC_UNK48:
+		return AGX_CLASS_BLEND;
+
+	case OPC_STOP:
+	case OPC_UNKD2:
+	case OPC_UNK42:
+	case OPC_UNK52:
+		return AGX_CLASS_CONTROL;
+
+	default:
+		return AGX_CLASS_OTHER;
+	}
+}
+
+static bool
+agx_is_branch(uint8_t opcode)
+{
+	return opcode == OPC_UNKD2 || opcode == OPC_UNK42 || opcode == OPC_UNK52;
+}
+
+/* Byte offset of a branch's target relative to the branch. The branch
+ * encodings aren't understood yet, so this always fails and branches only
+ * end their block, falling through. Once a target field is known, decoding it
+ * here is all it takes to get real edges. */
+
+static bool
+agx_branch_target(const struct agx_instr *I, int64_t *offset)
+{
+	(void) I;
+	(void) offset;
+	return false;
+}
+
+/* Decodes like agx_disassemble_to: in place while AGX_MAX_INSTR_BYTES remain,
+ * then from a zero padded copy, failing if the instruction doesn't fit */
+
+bool
+agx_decode_at(const uint8_t *code, size_t size, size_t offset,
+		struct agx_instr *I)
+{
+	if (offset + AGX_MAX_INSTR_BYTES <= size) {
+		*I = agx_decode_instr(code + offset);
+		return true;
+	}
+
+	uint8_t tail[AGX_MAX_INSTR_BYTES] = { 0 };
+	memcpy(tail, code + offset, size - offset);
+	*I = agx_decode_instr(tail);
+
+	return I->size <= (size - offset);
+}
+
+static void
+agx_add_succ(struct agx_block *block, size_t offset)
+{
+	if (block->nr_succs < 2)
+		block->succs[block->nr_succs++] = offset;
+}
+
+struct agx_shader_info
+agx_analyze_shader(const void *_code, size_t size)
+{
+	const uint8_t *code = _code;
+	struct agx_shader_info info = { 0 };
+
+	/* First pass: find the end of the shader and the leaders, as a bitmap
+	 * over byte offsets */
+	uint8_t *leaders = calloc((size / 8) + 1, 1);
+	size_t end = 0;
+	bool stop = false;
+
+	#define SET_LEADER(o) leaders[(o) / 8] |= (1 << ((o) % 8))
+	#define IS_LEADER(o) (leaders[(o) / 8] & (1 << ((o) % 8)))
+
+	SET_LEADER(0);
+
+	while (end < size && !stop) {
+		struct agx_instr I;
+		if (!agx_decode_at(code, size, end, &I)) {
+			info.truncated = true;
+			break;
+		}
+
+		stop = I.stop;
+		end += I.size;
+
+		if (agx_is_branch(I.opcode)) {
+			int64_t offs;
+
+			if (agx_branch_target(&I, &offs)) {
+				int64_t target = (int64_t) (end - I.size) + offs;
+
+				if (target >= 0 && (size_t) target < size)
+					SET_LEADER(target);
+			}
+
+			if (end < size)
+				SET_LEADER(end);
+		}
+	}
+
+	info.truncated |= !stop;
+
+	/* Second pass: fill in the blocks, with successors as offsets for now */
+	size_t capacity = 0;
+
+	for (size_t offset = 0; offset < end; ) {
+		if (IS_LEADER(offset)) {
+			if (info.nr_blocks == capacity) {
+				capacity = capacity ? capacity * 2 : 8;
+				info.blocks = realloc(info.blocks, capacity * sizeof(*info.blocks));
+			}
+
+			if (info.nr_blocks)
+				agx_add_succ(&info.blocks[info.nr_blocks - 1], offset);
+
+			info.blocks[info.nr_blocks++] = (struct agx_block) {
+				.offset = offset,
+			};
+		}
+
+		struct agx_block *block = &info.blocks[info.nr_blocks - 1];
+		struct agx_instr I;
+		agx_decode_at(code, size, offset, &I);
+
+		enum agx_instr_class class = agx_instr_class(I.opcode);
+		block->counts[class]++;
+		block->instrs++;
+		block->size += I.size;
+
+		info.counts[class]++;
+		info.instrs++;
+
+		if (agx_is_branch(I.opcode)) {
+			int64_t offs;
+
+			if (agx_branch_target(&I, &offs))
+				agx_add_succ(block, offset + offs);
+			else
+				block->unknown_target = true;
+		}
+
+		offset += I.size;
+
+		/* A stop ends the shader, so doesn't fall through */
+		if (I.stop)
+			block->stopped = true;
+	}
+
+	info.bytes = end;
+	free(leaders);
+
+	#undef SET_LEADER
+	#undef IS_LEADER
+
+	/* Resolve successor offsets to block indices, dropping fallthroughs
+	 * out of a stopped block and targets that aren't a block */
+	for (unsigned b = 0; b < info.nr_blocks; ++b) {
+		struct agx_block *block = &info.blocks[b];
+		unsigned nr = 0;
+
+		for (unsigned s = 0; s < block->nr_succs; ++s) {
+			size_t target = block->succs[s];
+
+			if (block->stopped && target == block->offset + block->size)
+				continue;
+
+			for (unsigned t = 0; t < info.nr_blocks; ++t) {
+				if (info.blocks[t].offset == target) {
+					block->succs[nr++] = t;
+					break;
+				}
+			}
+		}
+
+		block->nr_succs = nr;
+	}
+
+	/* Longest path from the entry, in instructions. Blocks are in address
+	 * order, so every edge to a block at or before its source is a back
+	 * edge: those mean a loop, and are left out so the rest is a DAG */
+	unsigned *longest = calloc(info.nr_blocks + 1, sizeof(unsigned));
+
+	for (unsigned b = info.nr_blocks; b-- > 0; ) {
+		struct agx_block *block = &info.blocks[b];
+		unsigned best = 0;
+
+		for (unsigned s = 0; s < block->nr_succs; ++s) {
+			unsigned t = block->succs[s];
+
+			if (t <= b)
+				info.loops = true;
+			else if (longest[t] > best)
+				best = longest[t];
+		}
+
+		longest[b] = block->instrs + best;
+	}
+
+	info.longest_path = info.nr_blocks ? longest[0] : 0;
+	free(longest);
+
+	return info;
+}
+
+void
+agx_shader_info_free(struct agx_shader_info *info)
+{
+	free(info->blocks);
+	info->blocks = NULL;
+	info->nr_blocks = 0;
+}
+
+static void
+agx_emit_counts(struct agx_emitter *e, const unsigned *counts)
+{
+	for (unsigned c = 0; c < AGX_NUM_CLASSES; ++c) {
+		if (c)
+			agx_emit_str(e, ", ");
+
+		agx_emit_str(e, agx_class_names[c]);
+		agx_emit_char(e, ' ');
+		agx_emit_uint(e, counts[c]);
+	}
+
+	agx_emit_char(e, '\n');
+}
+
+void
+agx_print_shader_info(FILE *fp, const struct agx_shader_info *info)
+{
+	struct agx_emitter e = { .fp = fp };
+
+	agx_emit_str(&e, "// ");
+	agx_emit_uint(&e, info->instrs);
+	agx_emit_str(&e, " instructions, ");
+	agx_emit_uint(&e, info->bytes);
+	agx_emit_str(&e, " bytes, ");
+	agx_emit_uint(&e, info->nr_blocks);
+	agx_emit_str(&e, " blocks, longest path ");
+	agx_emit_uint(&e, info->longest_path);
+	agx_emit_str(&e, info->loops ? " (excluding loops)" : "");
+	agx_emit_str(&e, info->truncated ? " (truncated)\n" : "\n");
+
+	agx_emit_str(&e, "// ");
+	agx_emit_counts(&e, info->counts);
+
+	for (unsigned b = 0; b < info->nr_blocks; ++b) {
+		const struct agx_block *block = &info->blocks[b];
+
+		agx_emit_str(&e, "// block ");
+		agx_emit_uint(&e, b);
+		agx_emit_str(&e, " at 0x");
+		agx_emit_hex(&e, block->offset, 0, false);
+		agx_emit_str(&e, ": ");
+		agx_emit_uint(&e, block->instrs);
+		agx_emit_str(&e, " instructions, ");
+		agx_emit_uint(&e, block->size);
+		agx_emit_str(&e, " bytes");
+
+		if (block->nr_succs || block->unknown_target)
+			agx_emit_str(&e, " ->");
+
+		for (unsigned s = 0; s < block->nr_succs; ++s) {
+			agx_emit_char(&e, ' ');
+			agx_emit_uint(&e, block->succs[s]);
+		}
+
+		if (block->unknown_target)
+			agx_emit_str(&e, " ?");
+
+		agx_emit_char(&e, '\n');
+	}
+
+	agx_emit_finish(&e);
+}
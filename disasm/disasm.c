@@ -25,67 +25,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
-
-/* Opcode table? Speculative since I don't know the opcode size yet, but this
- * should help bootstrap... These opcodes correspond to the bottom 7-bits of
- * the first byte, with the 8th bit from the 8th bit of the *second* byte. This
- * is still a guess. */
-
-enum agx_opcodes {
-	OPC_FFMA_CMPCT_16 = 0x36,
-	OPC_FFMA_CMPCT_SAT_16 = 0x76,
-	OPC_FMUL_16 = 0x96,
-	OPC_FADD_16 = 0xA6,
-	OPC_FFMA_16 = 0xB6,
-	OPC_FMUL_SAT_16 = 0xD6,
-	OPC_FADD_SAT_16 = 0xE6,
-	OPC_FFMA_SAT_16 = 0xF6,
-
-	OPC_FROUND_32 = 0x0A,
-	OPC_FFMA_CMPCT_32 = 0x3A,
-	OPC_FFMA_CMPCT_SAT_32 = 0x7A,
-	OPC_FMUL_32 = 0x9A,
-	OPC_FADD_32 = 0xAA,
-	OPC_FFMA_32 = 0xBA,
-	OPC_FMUL_SAT_32 = 0xDA,
-	OPC_FADD_SAT_32 = 0xEA,
-	OPC_FFMA_SAT_32 = 0xFA,
-
-	OPC_IADD = 0x0E,
-	OPC_IMAD = 0x1E,
-	OPC_ISHL = 0x2E,
-	/* 0x3e seen with reverse_bits, and used in clz */
-	OPC_IADDSAT = 0x4E,
-	OPC_ISHR = 0xAE,
-	OPC_I2F = 0xBE,
-
-	OPC_LOAD = 0x05, // todo
-	OPC_STORE = 0x45, // todo
-	OPC_FCSEL = 0x02,
-	OPC_ICSEL = 0x12,
-	OPC_MOVI = 0x62,
-	OPC_LD_COMPUTE = 0x72,
-	OPC_BITOP = 0x7E,
-	OPC_UNK38 = 0x38, // seen after loads?
-	OPC_STOP = 0x08,
-
-	OPC_LD_VAR_NO_PERSPECTIVE = 0xA1,
-	OPC_LD_VAR = 0xE1, // perspective
-	OPC_ST_VAR = 0x11,
-	OPC_UNKB1 = 0xB1, // seen in aux frag shader
-	OPC_UNK48 = 0x48, // seen before blending
-	OPC_BLEND = 0x09,
-
-	// branching instructions, not understood
-	OPC_UNKD2 = 0xD2,
-	OPC_UNK42 = 0x42,
-	OPC_UNK52 = 0x52,
-
-	// not sure what this does, but appears to be 4 bytes
-	OPC_UNK80 = 0x80,
-};
+#include "disasm.h"
 
 #define I 0
 #define C 1
@@ -156,39 +99,47 @@ agx_instr_bytes(uint8_t opc, uint8_t reg)
 		return agx_opcode_table[opc].size ?: 2;
 }
 
-/* Print float src, including modifiers */
+/* Name of an opcode, or NULL if unknown, and whether its decoding is
+ * complete, meaning the text says everything the bytes do */
 
-struct agx_src {
-	unsigned type : 2;
-	unsigned reg;
-	bool size32;
-	bool abs;
-	bool neg;
-	unsigned unk;
-};
+const char *
+agx_opcode_name(uint8_t opc)
+{
+	return agx_opcode_table[opc].name;
+}
 
-static void
-agx_print_src(FILE *fp, struct agx_src s)
+bool
+agx_opcode_complete(uint8_t opc)
 {
-	/* Known source types: immediates (8-bit only?), constant memory
-	 * (indexing 64-bits at a time from preloaded memory), and general
-	 * purpose registers */
-	const char *types[] = { "#", "unk1:", "const_", "" };
+	return agx_opcode_table[opc].complete;
+}
 
-	fprintf(fp, ", %s%s%u%s%s%s", s.size32 ? "w" : "h",
-			types[s.type], s.reg,
-			s.abs ? ".abs" : "", s.neg ? ".neg" : "",
-			s.unk ? ".unk" : "");
+/* Inverse of the opcode table, for the assembler. Returns -1 if unknown */
+
+int
+agx_opcode_from_name(const char *name, size_t len)
+{
+	for (unsigned i = 0; i < 256; ++i) {
+		const char *n = agx_opcode_table[i].name;
+
+		if (n && strlen(n) == len && !memcmp(n, name, len))
+			return i;
+	}
+
+	return -1;
 }
 
-static void
-agx_print_float_src(FILE *fp, unsigned type, unsigned reg, bool size32, bool abs, bool neg)
+/* Size of the instruction at code, or 0 if the opcode isn't one we know */
+
+unsigned
+agx_instr_size(const uint8_t *code)
 {
-	assert(type <= 3);
-	agx_print_src(fp, (struct agx_src) {
-			.type = type, .reg = reg, .size32 = size32,
-			.abs = abs, .neg = neg
-		});
+	uint8_t opc = (code[0] & 0x7F) | (code[1] & 0x80);
+
+	if (!agx_opcode_table[opc].name)
+		return 0;
+
+	return agx_instr_bytes(opc, code[1]);
 }
 
 /* Decode 12-bit packed float source */
@@ -196,7 +147,7 @@ static struct agx_src
 agx_decode_float_src(uint16_t packed)
 {
 	return (struct agx_src) {
-		.reg = (packed & 0x3F),
+		.value = (packed & 0x3F),
 		.type = (packed & 0xC0) >> 6,
 		.unk = (packed & 0x100),
 		.size32 = (packed & 0x200),
@@ -206,7 +157,7 @@ agx_decode_float_src(uint16_t packed)
 }
 
 /* When we know more how the encodings relate to each other, these
- * per-instruction prints will hopefully disappear, assuming things are
+ * per-instruction decodes will hopefully disappear, assuming things are
  * sufficiently regular.
  *
  * fadd.f32 is 6 bytes. First two bytes are used for opcode/destination, so we
@@ -222,50 +173,29 @@ agx_decode_float_src(uint16_t packed)
  */
 
 static void
-agx_print_fadd_f32(FILE *fp, uint8_t *code)
+agx_decode_fadd_f32(const uint8_t *code, struct agx_instr *I)
 {
-	agx_print_src(fp, agx_decode_float_src(code[2] | ((code[3] & 0xF) << 8)));
-	agx_print_src(fp, agx_decode_float_src((code[3] >> 4) | (code[4] << 4)));
-
-	if (code[5])
-		fprintf(fp, " /* unk5 = %02X */", code[5]);
+	I->src[I->nr_srcs++] = agx_decode_float_src(code[2] | ((code[3] & 0xF) << 8));
+	I->src[I->nr_srcs++] = agx_decode_float_src((code[3] >> 4) | (code[4] << 4));
+	I->unk_bytes[0] = code[5];
 }
 
 static void
-agx_print_ld_compute(uint8_t *code, FILE *fp)
+agx_decode_ld_compute(const uint8_t *code, struct agx_instr *I)
 {
 	/* 4 bytes, first 2 used for opcode and dest reg, next few bits for the
 	 * component, the rest is a selector for what to load */
 	uint16_t arg = code[2] | (code[3] << 8);
 
-	unsigned component = arg & 0x3;
-	uint16_t selector = arg >> 2;
-
-	fprintf(fp, ", ");
-
-	switch (selector) {
-	case 0x00:
-		fprintf(fp, "[threadgroup_position_in_grid]");
-		break;
-	case 0x0c:
-		fprintf(fp, "[thread_position_in_threadgroup]");
-		break;
-	case 0x0d:
-		fprintf(fp, "[thread_position_in_simdgroup]");
-		break;
-	case 0x104:
-		fprintf(fp, "[thread_position_in_grid]");
-		break;
-	default:
-		fprintf(fp, "[unk_%X]", selector);
-		break;
-	}
-
-	fprintf(fp, ".%c", "xyzw"[component]);
+	I->src[I->nr_srcs++] = (struct agx_src) {
+		.type = AGX_SRC_SYSVAL,
+		.value = arg >> 2,
+		.component = arg & 0x3,
+	};
 }
 
-static void
-agx_print_bitop_src(uint16_t value, FILE *fp)
+static struct agx_src
+agx_decode_bitop_src(uint16_t value)
 {
 	/* different encoding from float srcs -- slightly smaller */
 	uint16_t mode = (value >> 6) & 0x0f;
@@ -274,25 +204,26 @@ agx_print_bitop_src(uint16_t value, FILE *fp)
 	switch (mode) {
 	case 0x0:
 		// 8-bit immediate
-		fprintf(fp, "#0x%x", v);
-		break;
+		return (struct agx_src) { .type = AGX_SRC_IMM, .value = v };
 	case 0x3:
 		// 16b register
-		fprintf(fp, "h%d", v);
-		break;
+		return (struct agx_src) { .type = AGX_SRC_REG, .value = v };
 	case 0xb:
-		// 32b register
-		assert((v&1) == 0);
-		fprintf(fp, "w%d", v >> 1);
-		break;
-	default:
-		fprintf(fp, "unk_%x", value);
+		// 32b register, must be aligned
+		if ((v & 1) == 0) {
+			return (struct agx_src) {
+				.type = AGX_SRC_REG, .value = v >> 1, .size32 = true
+			};
+		}
+
 		break;
 	}
+
+	return (struct agx_src) { .type = AGX_SRC_UNKNOWN, .value = value };
 }
 
 static void
-agx_print_bitop(uint8_t *code, FILE *fp)
+agx_decode_bitop(const uint8_t *code, struct agx_instr *I)
 {
 	/* 6 bytes */
 	/* Universal bitop instruction. Control bits express operation as
@@ -302,21 +233,19 @@ agx_print_bitop(uint8_t *code, FILE *fp)
 	 * in common code before this point */
 	/* XXX: disassemble to "friendly" pseudoop ? */
 
-	uint8_t control = (code[3] >> 2) & 0x3;
-	control |= (code[4] >> 4) & 0xc; 
-	fprintf(fp, ", #0x%x, ", control);
+	I->mode = (code[3] >> 2) & 0x3;
+	I->mode |= (code[4] >> 4) & 0xc;
 
 	uint16_t src1_bits = code[2] | ((uint16_t)(code[3]&3) << 8) |
 		((uint16_t)code[5]&0xc)<<8;
 	uint16_t src2_bits = (code[3] >> 4) | (((uint16_t)code[4]&0x3f)<<4) |
 		(((uint16_t)code[5]&0x3)<<10);
 
-	agx_print_bitop_src(src1_bits, fp);
-	fprintf(fp, ", ");
-	agx_print_bitop_src(src2_bits, fp);
+	I->src[I->nr_srcs++] = agx_decode_bitop_src(src1_bits);
+	I->src[I->nr_srcs++] = agx_decode_bitop_src(src2_bits);
 }
 
-static float
+float
 agx_decode_float_imm8(uint16_t src)
 {
 	float sign = (src & 0x80) ? -1.0f : 1.0f;
@@ -331,40 +260,43 @@ agx_decode_float_imm8(uint16_t src)
 	}
 }
 
-static void
-agx_print_fp16_src(uint16_t src, uint16_t type, FILE *fp)
+static struct agx_src
+agx_decode_fp16_src(uint16_t src, uint16_t type)
 {
 	/* XXX: type&2 bit may be something odd like code[0]&0x80 */
+	struct agx_src s = {
+		.value = src,
+		.abs = type & 0x8,
+		.neg = type & 0x10,
+	};
 
 	switch (type & 5) {
 	case 0x0:
 		/* packed float8 immediate */
-		fprintf(fp, "#%ff", agx_decode_float_imm8(src));
+		s.type = AGX_SRC_FLOAT_IMM;
 		break;
 	case 0x1:
 		/* half register */
-		fprintf(fp, "h%d", src);
+		s.type = AGX_SRC_REG;
 		break;
 	case 0x4:
 	case 0x5:
 		/* constant space; extra bit packed in
 		 * bottom bit of type */
-		fprintf(fp, "const_%d", ((type&1)<<8) | src);
+		s.type = AGX_SRC_CONST;
+		s.value |= (type & 1) << 8;
 		break;
 	default:
-		fprintf(fp, "unk_%x:%x", type, src);
+		s.type = AGX_SRC_UNKNOWN;
+		s.raw_type = type;
 		break;
 	}
 
-	if (type & 0x8)
-		fprintf(fp, ".abs");
-	if (type & 0x10)
-		fprintf(fp, ".neg");
-
+	return s;
 }
 
 static void
-agx_print_fadd16(uint8_t *code, FILE *fp)
+agx_decode_fadd16(const uint8_t *code, struct agx_instr *I)
 {
 	/* 6 bytes */
 	uint16_t src1 = (code[2] & 0x3f) | ((code[5] & 0x0c)<<4);
@@ -373,187 +305,420 @@ agx_print_fadd16(uint8_t *code, FILE *fp)
 	uint16_t src2 = (code[3] >> 4) | ((code[4] & 0x3)<<4) | ((code[5] & 0x3)<<6);
 	uint16_t type2 = (code[4] >> 2);
 
-	fprintf(fp, ", ");
-	agx_print_fp16_src(src1, type1, fp);
-	fprintf(fp, ", ");
-	agx_print_fp16_src(src2, type2, fp);
+	I->src[I->nr_srcs++] = agx_decode_fp16_src(src1, type1);
+	I->src[I->nr_srcs++] = agx_decode_fp16_src(src2, type2);
 }
 
 static void
-agx_print_st_var(uint8_t *code, FILE *fp)
+agx_decode_st_var(const uint8_t *code, struct agx_instr *I)
 {
 	/* 4 bytes, first for opcode. Second for source register  third
 	 * indicates the destination, fourth unknown */
-	if (code[1] & 0x1)
-		fprintf(fp, ".unk");
+	I->unk = code[1] & 0x1;
+	I->imm = code[2] & 0xF;
+	I->unk_bytes[0] = code[2] >> 4;
+	I->unk_bytes[1] = code[3];
+}
 
-	fprintf(fp, ", index:%u", code[2] & 0xF);
+/* Guess at the common float source encoding, for everything else */
 
-	if ((code[2] & 0xF0) != 0x80)
-		fprintf(fp, ", unk2=%X", code[2] >> 4);
+static void
+agx_decode_guess(const uint8_t *code, struct agx_instr *I)
+{
+	bool iadd = I->opcode == OPC_IADD;
+
+	if (I->size > 2) {
+		I->src[I->nr_srcs++] = (struct agx_src) {
+			.type = (code[2] & 0xC0) >> 6,
+			.value = (code[2] & 0x3F) |
+				(iadd ? ((code[5] & 0x0C) << 4) : 0),
+				// TODO: why overlap?
+			.size32 = code[3] & 0x20,
+			.abs = code[3] & 0x04,
+			.neg = code[3] & 0x08,
+		};
+
+		I->src[I->nr_srcs++] = (struct agx_src) {
+			.type = (code[4] & 0x0C) >> 2,
+			.value = ((code[3] >> 4) & 0xF) | ((code[4] & 0x3) << 4) | ((code[7] & 0x3) << 6),
+			.size32 = code[4] & 0x20,
+			.abs = code[4] & 0x40,
+			.neg = code[4] & 0x80,
+		};
+	}
 
-	if (code[3] != 0x80)
-		fprintf(fp, ", unk3=%X", code[3]);
+	if (I->size > 6 && !iadd) {
+		I->src[I->nr_srcs++] = (struct agx_src) {
+			.type = (code[5] & 0xC0) >> 6,
+			.value = (code[5] & 0x3F) | (code[6] & 0xC0),
+			.size32 = code[6] & 0x20,
+			.abs = code[6] & 0x04,
+			.neg = code[6] & 0x08,
+		};
+	}
 }
 
-/* Disassembles a single instruction */
+/* Decodes a single instruction */
 
-unsigned
-agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
+struct agx_instr
+agx_decode_instr(const uint8_t *code)
 {
 	/* Decode the opcode first, requires 2 bytes */
 	uint8_t opc = (code[0] & 0x7F) | (code[1] & 0x80);
 
-	/* Guess the size */
-	unsigned bytes = agx_instr_bytes(opc, code[1]);
+	struct agx_instr I = {
+		.opcode = opc,
 
-	/* Hexdump the instruction */
+		/* Guess the size */
+		.size = agx_instr_bytes(opc, code[1]),
 
-	if (verbose || !agx_opcode_table[opc].complete) {
-		fprintf(fp, "#");
-		for (unsigned i = 0; i < bytes; ++i)
-			fprintf(fp, " %02X", code[i]);
-		fprintf(fp, "\n");
-	}
+		.unk80 = code[0] & 0x80, /* XXX: what is this? */
+		.stop = code[0] == (OPC_STOP | 0x80),
+	};
 
-	unsigned op_unk80 = code[0] & 0x80; /* XXX: what is this? */
-	fprintf(fp, "%c", op_unk80 ? '+' : '-'); /* Stay concise.. */
+	memcpy(I.bytes, code, I.size);
 
-	if (agx_opcode_table[opc].name)
-		fputs(agx_opcode_table[opc].name, fp);
-	else
-		fprintf(fp, "op_%02X", opc);
-
-	if (opc == OPC_ICSEL) {
-		unsigned mode = (code[7] & 0xF0) >> 4;
-		if (mode == 0x1)
-			fprintf(fp, ".eq"); // output 16-bit bool
-		else if (mode == 0x2)
-			fprintf(fp, ".imin");
-		else if (mode == 0x3)
-			fprintf(fp, ".ult"); // output 16-bit bool
-		else if (mode == 0x4)
-			fprintf(fp, ".imax");
-		else if (mode == 0x5)
-			fprintf(fp, ".ugt"); // output 16-bit bool
-		else
-			fprintf(fp, ".unk%X", mode);
-	} else if (opc == OPC_FCSEL) {
-		unsigned mode = (code[7] & 0xF0) >> 4;
-
-		if (mode == 0x6)
-			fprintf(fp, ".fmin");
-		else if (mode == 0xE)
-			fprintf(fp, ".fmax");
-		else
-			fprintf(fp, ".unk%X", mode);
-	}
+	if (opc == OPC_ICSEL || opc == OPC_FCSEL)
+		I.mode = (code[7] & 0xF0) >> 4;
 
 	/* Decode destination register, common to all ALUs (and maybe more?) */
 	uint8_t dest = code[1];
-	bool dest_32 = dest & 0x1; /* clear for 16-bit */
-	unsigned dest_reg = (dest >> 1) & 0x3F;
+	I.dest_32 = dest & 0x1; /* clear for 16-bit */
+	I.dest = (dest >> 1) & 0x3F;
 
 	/* Maybe it's a 32-bit opcode */
 	if (opc == OPC_ST_VAR)
-		dest_32 = !dest_32;
-
-	fprintf(fp, " %s%u",
-			dest_32 ? "w" : "h",
-			dest_reg);
+		I.dest_32 = !I.dest_32;
 
 	/* Decode other stuff, TODO */
 	switch (opc) {
 	case OPC_ST_VAR:
-		agx_print_st_var(code, fp);
+		agx_decode_st_var(code, &I);
 		break;
 	case OPC_LD_COMPUTE:
-		agx_print_ld_compute(code, fp);
+		agx_decode_ld_compute(code, &I);
 		break;
 	case OPC_BITOP:
-		agx_print_bitop(code, fp);
+		agx_decode_bitop(code, &I);
 		break;
 	case OPC_FADD_16:
 	case OPC_FADD_SAT_16:
 	case OPC_FMUL_16:
 	case OPC_FMUL_SAT_16:
-		agx_print_fadd16(code, fp);
+		agx_decode_fadd16(code, &I);
 		break;
-	case OPC_MOVI: {
-		uint32_t imm = code[2] | (code[3] << 8);
+	case OPC_MOVI:
+		I.imm = code[2] | (code[3] << 8);
 
-		if (dest_32)
-			imm |= (code[4] << 16) | (code[5] << 24);
+		if (I.dest_32)
+			I.imm |= (code[4] << 16) | ((uint32_t) code[5] << 24);
 
-		fprintf(fp, ", #0x%X", imm);
 		break;
-	}
 	case OPC_FADD_32:
 	case OPC_FADD_SAT_32:
 	case OPC_FMUL_32:
 	case OPC_FMUL_SAT_32:
-		agx_print_fadd_f32(fp, code);
+		agx_decode_fadd_f32(code, &I);
 		break;
-	default: {
+	default:
 		/* Make some guesses */
-		bool iadd = opc == OPC_IADD;
-
-		if (bytes > 2) {
-			agx_print_float_src(fp,
-				(code[2] & 0xC0) >> 6,
-				(code[2] & 0x3F) |
-					(iadd ? ((code[5] & 0x0C) << 4) : 0),
-				       	// TODO: why overlap?
-				code[3] & 0x20,
-				code[3] & 0x04,
-				code[3] & 0x08);
-
-			agx_print_float_src(fp,
-				(code[4] & 0x0C) >> 2,
-				((code[3] >> 4) & 0xF) | ((code[4] & 0x3) << 4) | ((code[7] & 0x3) << 6),
-				code[4] & 0x20,
-				code[4] & 0x40,
-				code[4] & 0x80);
+		agx_decode_guess(code, &I);
+		break;
+	}
+
+	return I;
+}
+
+/* Print float src, including modifiers */
+
+static void
+agx_print_src(struct agx_emitter *e, struct agx_src s)
+{
+	/* Known source types: immediates (8-bit only?), constant memory
+	 * (indexing 64-bits at a time from preloaded memory), and general
+	 * purpose registers */
+	const char *types[] = { "#", "unk1:", "const_", "" };
+	assert(s.type <= AGX_SRC_REG);
+
+	agx_emit_str(e, s.size32 ? ", w" : ", h");
+	agx_emit_str(e, types[s.type]);
+	agx_emit_uint(e, s.value);
+
+	if (s.abs)
+		agx_emit_str(e, ".abs");
+	if (s.neg)
+		agx_emit_str(e, ".neg");
+	if (s.unk)
+		agx_emit_str(e, ".unk");
+}
+
+static void
+agx_print_ld_compute(struct agx_emitter *e, struct agx_src s)
+{
+	agx_emit_str(e, ", ");
+
+	switch (s.value) {
+	case 0x00:
+		agx_emit_str(e, "[threadgroup_position_in_grid]");
+		break;
+	case 0x0c:
+		agx_emit_str(e, "[thread_position_in_threadgroup]");
+		break;
+	case 0x0d:
+		agx_emit_str(e, "[thread_position_in_simdgroup]");
+		break;
+	case 0x104:
+		agx_emit_str(e, "[thread_position_in_grid]");
+		break;
+	default:
+		agx_emit_str(e, "[unk_");
+		agx_emit_hex(e, s.value, 0, true);
+		agx_emit_char(e, ']');
+		break;
+	}
+
+	agx_emit_char(e, '.');
+	agx_emit_char(e, "xyzw"[s.component]);
+}
+
+static void
+agx_print_bitop_src(struct agx_emitter *e, struct agx_src s)
+{
+	if (s.type == AGX_SRC_IMM) {
+		agx_emit_str(e, "#0x");
+		agx_emit_hex(e, s.value, 0, false);
+	} else if (s.type == AGX_SRC_REG) {
+		agx_emit_char(e, s.size32 ? 'w' : 'h');
+		agx_emit_uint(e, s.value);
+	} else {
+		agx_emit_str(e, "unk_");
+		agx_emit_hex(e, s.value, 0, false);
+	}
+}
+
+static void
+agx_print_fp16_src(struct agx_emitter *e, struct agx_src s)
+{
+	switch (s.type) {
+	case AGX_SRC_FLOAT_IMM:
+		agx_emit_printf(e, "#%ff", agx_decode_float_imm8(s.value));
+		break;
+	case AGX_SRC_REG:
+		agx_emit_char(e, 'h');
+		agx_emit_uint(e, s.value);
+		break;
+	case AGX_SRC_CONST:
+		agx_emit_str(e, "const_");
+		agx_emit_uint(e, s.value);
+		break;
+	default:
+		agx_emit_str(e, "unk_");
+		agx_emit_hex(e, s.raw_type, 0, false);
+		agx_emit_char(e, ':');
+		agx_emit_hex(e, s.value, 0, false);
+		break;
+	}
+
+	if (s.abs)
+		agx_emit_str(e, ".abs");
+	if (s.neg)
+		agx_emit_str(e, ".neg");
+}
+
+static void
+agx_print_st_var(struct agx_emitter *e, const struct agx_instr *I)
+{
+	if (I->unk)
+		agx_emit_str(e, ".unk");
+
+	agx_emit_str(e, ", index:");
+	agx_emit_uint(e, I->imm);
+
+	if (I->unk_bytes[0] != 0x8) {
+		agx_emit_str(e, ", unk2=");
+		agx_emit_hex(e, I->unk_bytes[0], 0, true);
+	}
+
+	if (I->unk_bytes[1] != 0x80) {
+		agx_emit_str(e, ", unk3=");
+		agx_emit_hex(e, I->unk_bytes[1], 0, true);
+	}
+}
+
+static const char *agx_icsel_modes[16] = {
+	[0x1] = ".eq", // output 16-bit bool
+	[0x2] = ".imin",
+	[0x3] = ".ult", // output 16-bit bool
+	[0x4] = ".imax",
+	[0x5] = ".ugt", // output 16-bit bool
+};
+
+static const char *agx_fcsel_modes[16] = {
+	[0x6] = ".fmin",
+	[0xE] = ".fmax",
+};
+
+/* The instruction itself, without the hexdump */
+
+void
+agx_emit_asm(struct agx_emitter *e, const struct agx_instr *I)
+{
+	uint8_t opc = I->opcode;
+
+	agx_emit_char(e, I->unk80 ? '+' : '-'); /* Stay concise.. */
+
+	if (agx_opcode_table[opc].name) {
+		agx_emit_str(e, agx_opcode_table[opc].name);
+	} else {
+		agx_emit_str(e, "op_");
+		agx_emit_hex8(e, opc, true);
+	}
+
+	if (opc == OPC_ICSEL || opc == OPC_FCSEL) {
+		const char **modes = (opc == OPC_ICSEL) ? agx_icsel_modes : agx_fcsel_modes;
+
+		if (modes[I->mode]) {
+			agx_emit_str(e, modes[I->mode]);
+		} else {
+			agx_emit_str(e, ".unk");
+			agx_emit_hex(e, I->mode, 0, true);
 		}
+	}
+
+	agx_emit_str(e, I->dest_32 ? " w" : " h");
+	agx_emit_uint(e, I->dest);
 
-		if (bytes > 6 && !iadd) {
-			agx_print_float_src(fp,
-				(code[5] & 0xC0) >> 6,
-				(code[5] & 0x3F) | (code[6] & 0xC0),
-				code[6] & 0x20,
-				code[6] & 0x04,
-				code[6] & 0x08);
+	switch (opc) {
+	case OPC_ST_VAR:
+		agx_print_st_var(e, I);
+		break;
+	case OPC_LD_COMPUTE:
+		agx_print_ld_compute(e, I->src[0]);
+		break;
+	case OPC_BITOP:
+		agx_emit_str(e, ", #0x");
+		agx_emit_hex(e, I->mode, 0, false);
+		agx_emit_str(e, ", ");
+		agx_print_bitop_src(e, I->src[0]);
+		agx_emit_str(e, ", ");
+		agx_print_bitop_src(e, I->src[1]);
+		break;
+	case OPC_FADD_16:
+	case OPC_FADD_SAT_16:
+	case OPC_FMUL_16:
+	case OPC_FMUL_SAT_16:
+		for (unsigned i = 0; i < I->nr_srcs; ++i) {
+			agx_emit_str(e, ", ");
+			agx_print_fp16_src(e, I->src[i]);
+		}
+		break;
+	case OPC_MOVI:
+		agx_emit_str(e, ", #0x");
+		agx_emit_hex(e, I->imm, 0, true);
+		break;
+	default:
+		for (unsigned i = 0; i < I->nr_srcs; ++i)
+			agx_print_src(e, I->src[i]);
+
+		if (I->unk_bytes[0]) {
+			agx_emit_str(e, " /* unk5 = ");
+			agx_emit_hex8(e, I->unk_bytes[0], true);
+			agx_emit_str(e, " */");
 		}
 
 		break;
 	}
+
+	agx_emit_char(e, '\n');
+}
+
+void
+agx_emit_instr(struct agx_emitter *e, const struct agx_instr *I, bool verbose)
+{
+	/* Hexdump the instruction */
+
+	if (verbose || !agx_opcode_table[I->opcode].complete) {
+		agx_emit_char(e, '#');
+
+		for (unsigned i = 0; i < I->size; ++i) {
+			agx_emit_char(e, ' ');
+			agx_emit_hex8(e, I->bytes[i], true);
+		}
+
+		agx_emit_char(e, '\n');
 	}
 
-	fprintf(fp, "\n");
+	agx_emit_asm(e, I);
+}
 
-	if (code[0] == (OPC_STOP | 0x80))
+void
+agx_print_instr(FILE *fp, const struct agx_instr *I, bool verbose)
+{
+	struct agx_emitter e = { .fp = fp };
+	agx_emit_instr(&e, I, verbose);
+	agx_emit_finish(&e);
+}
+
+/* Disassembles a single instruction */
+
+unsigned
+agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp)
+{
+	struct agx_instr I = agx_decode_instr(code);
+	agx_print_instr(fp, &I, verbose);
+
+	if (I.stop)
 		*stop = true;
 
-	return bytes;
+	return I.size;
 }
 
-/* Disassembles a shader */
+/* Disassembles a shader, into the emitter without flushing */
 
 void
-agx_disassemble(void *_code, size_t maxlen, FILE *fp)
+agx_disassemble_to(struct agx_emitter *e, const void *_code, size_t maxlen)
 {
-	if (maxlen > 256)
-		maxlen = 256;
-
-	uint8_t *code = _code;
+	const uint8_t *code = _code;
 
 	bool stop = false;
-	unsigned bytes = 0;
+	size_t bytes = 0;
 	bool verbose = getenv("ASAHI_VERBOSE") != NULL;
 
-	while((bytes + 8) < maxlen && !stop)
-		bytes += agx_disassemble_instr(code + bytes, &stop, verbose, fp);
+	/* The decoder may look at up to AGX_MAX_INSTR_BYTES, so only decode in
+	 * place while that many remain */
+	while ((bytes + AGX_MAX_INSTR_BYTES) <= maxlen && !stop) {
+		struct agx_instr I = agx_decode_instr(code + bytes);
+		agx_emit_instr(e, &I, verbose);
+		stop = I.stop;
+		bytes += I.size;
+	}
+
+	/* Then from a zero padded copy of the tail, as long as the instruction
+	 * actually fits */
+	while (bytes < maxlen && !stop) {
+		uint8_t tail[AGX_MAX_INSTR_BYTES] = { 0 };
+		memcpy(tail, code + bytes, maxlen - bytes);
+
+		struct agx_instr I = agx_decode_instr(tail);
+
+		if (I.size > (maxlen - bytes)) {
+			agx_emit_str(e, "// error: truncated instruction\n");
+			return;
+		}
+
+		agx_emit_instr(e, &I, verbose);
+		stop = I.stop;
+		bytes += I.size;
+	}
 
 	if (!stop)
-		fprintf(fp, "// error: stop instruction not found\n");
+		agx_emit_str(e, "// error: stop instruction not found\n");
+}
+
+void
+agx_disassemble(void *_code, size_t maxlen, FILE *fp)
+{
+	struct agx_emitter e = { .fp = fp };
+	agx_disassemble_to(&e, _code, maxlen);
+	agx_emit_finish(&e);
 }
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_DISASM_H
+#define __AGX_DISASM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "../lib/emit.h"
+
+/* Opcode table? Speculative since I don't know the opcode size yet, but this
+ * should help bootstrap... These opcodes correspond to the bottom 7-bits of
+ * the first byte, with the 8th bit from the 8th bit of the *second* byte. This
+ * is still a guess. */
+
+enum agx_opcodes {
+	OPC_FFMA_CMPCT_16 = 0x36,
+	OPC_FFMA_CMPCT_SAT_16 = 0x76,
+	OPC_FMUL_16 = 0x96,
+	OPC_FADD_16 = 0xA6,
+	OPC_FFMA_16 = 0xB6,
+	OPC_FMUL_SAT_16 = 0xD6,
+	OPC_FADD_SAT_16 = 0xE6,
+	OPC_FFMA_SAT_16 = 0xF6,
+
+	OPC_FROUND_32 = 0x0A,
+	OPC_FFMA_CMPCT_32 = 0x3A,
+	OPC_FFMA_CMPCT_SAT_32 = 0x7A,
+	OPC_FMUL_32 = 0x9A,
+	OPC_FADD_32 = 0xAA,
+	OPC_FFMA_32 = 0xBA,
+	OPC_FMUL_SAT_32 = 0xDA,
+	OPC_FADD_SAT_32 = 0xEA,
+	OPC_FFMA_SAT_32 = 0xFA,
+
+	OPC_IADD = 0x0E,
+	OPC_IMAD = 0x1E,
+	OPC_ISHL = 0x2E,
+	/* 0x3e seen with reverse_bits, and used in clz */
+	OPC_IADDSAT = 0x4E,
+	OPC_ISHR = 0xAE,
+	OPC_I2F = 0xBE,
+
+	OPC_LOAD = 0x05, // todo
+	OPC_STORE = 0x45, // todo
+	OPC_FCSEL = 0x02,
+	OPC_ICSEL = 0x12,
+	OPC_MOVI = 0x62,
+	OPC_LD_COMPUTE = 0x72,
+	OPC_BITOP = 0x7E,
+	OPC_UNK38 = 0x38, // seen after loads?
+	OPC_STOP = 0x08,
+
+	OPC_LD_VAR_NO_PERSPECTIVE = 0xA1,
+	OPC_LD_VAR = 0xE1, // perspective
+	OPC_ST_VAR = 0x11,
+	OPC_UNKB1 = 0xB1, // seen in aux frag shader
+	OPC_UNK48 = 0x48, // seen before blending
+	OPC_BLEND = 0x09,
+
+	// branching instructions, not understood
+	OPC_UNKD2 = 0xD2,
+	OPC_UNK42 = 0x42,
+	OPC_UNK52 = 0x52,
+
+	// not sure what this does, but appears to be 4 bytes
+	OPC_UNK80 = 0x80,
+};
+
+/* Decoded form of an instruction, filled in by agx_decode_instr without
+ * touching any I/O, so analyses can skip the formatting and agx_print_instr
+ * can be used when text is wanted. */
+
+/* Source kinds. The first four match the 2-bit type field of float sources */
+enum agx_src_type {
+	AGX_SRC_IMM = 0,
+	AGX_SRC_UNK1 = 1,
+	AGX_SRC_CONST = 2,
+	AGX_SRC_REG = 3,
+
+	/* 8-bit packed float immediate, see agx_decode_float_imm8 */
+	AGX_SRC_FLOAT_IMM,
+
+	/* Special register for ld_compute, value is the selector */
+	AGX_SRC_SYSVAL,
+
+	/* Not understood, value and raw_type are the encoded bits */
+	AGX_SRC_UNKNOWN,
+};
+
+struct agx_src {
+	enum agx_src_type type;
+	unsigned value;
+	bool size32, abs, neg, unk;
+
+	/* Component of a sysval, or the undecoded type bits of an unknown */
+	unsigned component;
+	unsigned raw_type;
+};
+
+#define AGX_MAX_SRCS 3
+#define AGX_MAX_INSTR_BYTES 12
+
+struct agx_instr {
+	uint8_t opcode;
+	unsigned size;
+
+	/* Top bit of the first byte, not understood */
+	bool unk80;
+
+	/* Ends the shader */
+	bool stop;
+
+	/* Common to all ALUs. For st_var this is the stored register */
+	unsigned dest;
+	bool dest_32;
+
+	/* Opcode specific: comparison of icsel/fcsel, truth table of bitop,
+	 * immediate of movi, varying index of st_var */
+	unsigned mode;
+	uint32_t imm;
+
+	/* Leftover bits printed as-is: st_var's dest unk flag and unknown
+	 * bytes 2 and 3, fadd.32's byte 5 */
+	bool unk;
+	uint8_t unk_bytes[2];
+
+	unsigned nr_srcs;
+	struct agx_src src[AGX_MAX_SRCS];
+
+	/* The encoding, for hexdumps */
+	uint8_t bytes[AGX_MAX_INSTR_BYTES];
+};
+
+/* Decodes a single instruction. At least AGX_MAX_INSTR_BYTES must be readable
+ * from code */
+
+struct agx_instr
+agx_decode_instr(const uint8_t *code);
+
+/* Version of the text the printers below produce. Bump it with any change to
+ * the output, so disassembly cached on disk by older versions isn't used */
+
+#define AGX_DISASM_VERSION 1
+
+/* Prints an instruction, preceded by a hexdump if verbose or the opcode isn't
+ * completely understood. agx_emit_asm prints just the instruction line */
+
+void
+agx_emit_instr(struct agx_emitter *e, const struct agx_instr *I, bool verbose);
+
+void
+agx_emit_asm(struct agx_emitter *e, const struct agx_instr *I);
+
+void
+agx_print_instr(FILE *fp, const struct agx_instr *I, bool verbose);
+
+float
+agx_decode_float_imm8(uint16_t src);
+
+/* Decodes the instruction at offset of a size byte buffer, which may be less
+ * than AGX_MAX_INSTR_BYTES from the end. Fails if it doesn't fit */
+
+bool
+agx_decode_at(const uint8_t *code, size_t size, size_t offset,
+		struct agx_instr *I);
+
+/* Size in bytes of the instruction at code, or 0 for an unknown opcode.
+ * Reads 2 bytes */
+
+unsigned
+agx_instr_size(const uint8_t *code);
+
+const char *
+agx_opcode_name(uint8_t opc);
+
+bool
+agx_opcode_complete(uint8_t opc);
+
+int
+agx_opcode_from_name(const char *name, size_t len);
+
+/* Find plausible shaders in a memory dump: runs of known instructions ending
+ * in a stop. Returns the number found, with a malloc'd array of them in
+ * *shaders in order of offset */
+
+struct agx_shader_range {
+	size_t offset, size;
+	unsigned instrs;
+};
+
+size_t
+agx_scan_shaders(const uint8_t *data, size_t size,
+		struct agx_shader_range **shaders);
+
+/* Decode and print, returning the size of the instruction */
+
+unsigned
+agx_disassemble_instr(uint8_t *code, bool *stop, bool verbose, FILE *fp);
+
+void
+agx_disassemble(void *_code, size_t maxlen, FILE *fp);
+
+void
+agx_disassemble_to(struct agx_emitter *e, const void *_code, size_t maxlen);
+
+/* Static analysis, see cfg.c */
+
+enum agx_instr_class {
+	AGX_CLASS_ALU,
+	AGX_CLASS_MEMORY,
+	AGX_CLASS_VARYING,
+	AGX_CLASS_BLEND,
+	AGX_CLASS_CONTROL,
+	AGX_CLASS_OTHER,
+	AGX_NUM_CLASSES
+};
+
+enum agx_instr_class
+agx_instr_class(uint8_t opcode);
+
+struct agx_block {
+	size_t offset, size;
+	unsigned instrs;
+	unsigned counts[AGX_NUM_CLASSES];
+
+	/* Indices of the successor blocks. A branch whose target can't be
+	 * decoded sets unknown_target instead */
+	size_t succs[2];
+	unsigned nr_succs;
+	bool unknown_target;
+
+	/* Ends in a stop */
+	bool stopped;
+};
+
+struct agx_shader_info {
+	struct agx_block *blocks;
+	unsigned nr_blocks;
+
+	unsigned instrs, bytes;
+	unsigned counts[AGX_NUM_CLASSES];
+
+	/* Most instructions executed on any path from the entry, not counting
+	 * back edges, which set loops */
+	unsigned longest_path;
+	bool loops;
+
+	/* Ran off the end of the range before a stop */
+	bool truncated;
+};
+
+struct agx_shader_info
+agx_analyze_shader(const void *code, size_t size);
+
+void
+agx_shader_info_free(struct agx_shader_info *info);
+
+void
+agx_print_shader_info(FILE *fp, const struct agx_shader_info *info);
+
+/* Register usage, see regs.c. Registers are counted in 16-bit halves: h<n> is
+ * half n, w<n> is halves 2n and 2n + 1 */
+
+#define AGX_NUM_HALVES 256
+
+struct agx_live_range {
+	/* Instruction indices of the first and last access, -1 if unused. A
+	 * register read before it's written is live from the start */
+	int start, end;
+};
+
+struct agx_reg_info {
+	/* Highest h<n> and w<n> named, -1 if none */
+	int max_h, max_w;
+
+	/* Halves up to and including the highest touched */
+	unsigned halves;
+
+	/* Most halves live at once, and where */
+	unsigned max_live;
+	unsigned max_live_instr;
+
+	/* Estimated threads per core at this footprint */
+	unsigned threads;
+
+	unsigned instrs;
+	struct agx_live_range live[AGX_NUM_HALVES];
+};
+
+struct agx_reg_info
+agx_analyze_regs(const void *code, size_t size);
+
+unsigned
+agx_threads_for_halves(unsigned halves);
+
+void
+agx_print_reg_info(FILE *fp, const struct agx_reg_info *info);
+
+/* Structured output, one record per instruction, see records.c */
+
+enum agx_record_format {
+	AGX_RECORD_JSON,
+	AGX_RECORD_BINARY,
+};
+
+#define AGX_RECORD_MAGIC "AGXR"
+#define AGX_RECORD_VERSION 1
+#define AGX_RECORD_HEADER_SIZE 12
+#define AGX_RECORD_SIZE 52
+
+struct agx_record {
+	/* Where the shader started in its input, and the instruction within */
+	uint32_t shader, offset;
+	struct agx_instr I;
+};
+
+void
+agx_pack_record(uint8_t *out, const struct agx_record *r);
+
+void
+agx_unpack_record(const uint8_t *in, struct agx_record *r);
+
+void
+agx_emit_record_header(struct agx_emitter *e, enum agx_record_format format);
+
+void
+agx_emit_record(struct agx_emitter *e, enum agx_record_format format,
+		const struct agx_record *r);
+
+void
+agx_emit_records(struct agx_emitter *e, enum agx_record_format format,
+		const void *code, size_t size, uint32_t shader);
+
+/* Reads either format back, returning the number of records with a malloc'd
+ * array of them in *records */
+
+size_t
+agx_read_records(const void *data, size_t size, struct agx_record **records);
+
+/* Content-keyed cache in front of agx_disassemble, see cache.c. With a dir,
+ * entries also persist there across runs */
+
+struct agx_disasm_cache_entry {
+	uint64_t hash;
+	uint8_t *key;
+	size_t key_size;
+
+	/* NUL terminated, NULL for an empty slot */
+	char *text;
+	size_t text_size;
+
+	/* Lookups that found this shader, and anything the caller wants to
+	 * keep with it (not freed by the cache) */
+	unsigned refs;
+	void *data;
+};
+
+struct agx_disasm_cache {
+	struct agx_disasm_cache_entry *entries;
+	size_t capacity;
+
+	char *dir;
+	bool verbose;
+
+	struct {
+		size_t hits, disk_hits, misses;
+		size_t entries, bytes;
+	} stats;
+};
+
+struct agx_disasm_cache *
+agx_disasm_cache_create(const char *dir);
+
+void
+agx_disasm_cache_destroy(struct agx_disasm_cache *cache);
+
+/* The entry for code, disassembling it if it's new, with the text
+ * agx_disassemble would print. The entry may move on the next lookup, but its
+ * text stays valid until the cache is destroyed */
+
+struct agx_disasm_cache_entry *
+agx_disasm_cache_get(struct agx_disasm_cache *cache, const void *code,
+		size_t maxlen);
+
+void
+agx_disassemble_cached(struct agx_disasm_cache *cache, const void *code,
+		size_t maxlen, FILE *fp);
+
+/* Assembles the text printed by agx_disassemble back to machine code.
+ * Instructions preceded by a hexdump line are taken from the hexdump, the rest
+ * are encoded from their operands. Either way they must print back exactly as
+ * written, so only the hexdump of the former can be edited. Lines starting
+ * with // are ignored. On failure, code is NULL and error and line (1-based)
+ * say why. */
+
+struct agx_assembly {
+	uint8_t *code;
+	size_t size;
+
+	const char *error;
+	unsigned line;
+};
+
+struct agx_assembly
+agx_assemble(const char *text);
+
+/* Checks that assembling the disassembly of code, up to its stop, gives back
+ * the same bytes */
+
+bool
+agx_check_roundtrip(const void *code, size_t size);
+
+#endif
@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disasm.h"
+
+/* Structured disassembly, one record per instruction, for tools to consume
+ * instead of the text. Records come as JSON Lines, or as a binary stream: a
+ * header of AGX_RECORD_MAGIC, version and record size as 32-bit little endian,
+ * then fixed size records laid out as
+ *
+ * 	 0: shader (u32), offset (u32)
+ * 	 8: size, opcode, flags, dest (u8)
+ * 	12: imm (u32)
+ * 	16: mode, nr_srcs, unk_bytes[2] (u8)
+ * 	20: 3 sources of type, flags, value (u16), extra, padding
+ * 	38: bytes[12], 2 bytes padding
+ *
+ * where extra is the component of a sysval or the raw type of an unknown. */
+
+enum {
+	AGX_RECORD_COMPLETE = (1 << 0),
+	AGX_RECORD_STOP = (1 << 1),
+	AGX_RECORD_UNK80 = (1 << 2),
+	AGX_RECORD_DEST_32 = (1 << 3),
+	AGX_RECORD_UNK = (1 << 4),
+};
+
+enum {
+	AGX_RECORD_SRC_SIZE32 = (1 << 0),
+	AGX_RECORD_SRC_ABS = (1 << 1),
+	AGX_RECORD_SRC_NEG = (1 << 2),
+	AGX_RECORD_SRC_UNK = (1 << 3),
+};
+
+static const char *agx_src_type_names[] = {
+	[AGX_SRC_IMM] = "imm",
+	[AGX_SRC_UNK1] = "unk1",
+	[AGX_SRC_CONST] = "const",
+	[AGX_SRC_REG] = "reg",
+	[AGX_SRC_FLOAT_IMM] = "float_imm",
+	[AGX_SRC_SYSVAL] = "sysval",
+	[AGX_SRC_UNKNOWN] = "unknown",
+};
+
+static void
+agx_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+agx_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint16_t
+agx_get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+agx_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void
+agx_pack_record(uint8_t *out, const struct agx_record *r)
+{
+	const struct agx_instr *I = &r->I;
+	memset(out, 0, AGX_RECORD_SIZE);
+
+	agx_put32(out + 0, r->shader);
+	agx_put32(out + 4, r->offset);
+
+	out[8] = I->size;
+	out[9] = I->opcode;
+	out[10] = (agx_opcode_complete(I->opcode) ? AGX_RECORD_COMPLETE : 0) |
+		(I->stop ? AGX_RECORD_STOP : 0) |
+		(I->unk80 ? AGX_RECORD_UNK80 : 0) |
+		(I->dest_32 ? AGX_RECORD_DEST_32 : 0) |
+		(I->unk ? AGX_RECORD_UNK : 0);
+	out[11] = I->dest;
+
+	agx_put32(out + 12, I->imm);
+	out[16] = I->mode;
+	out[17] = I->nr_srcs;
+	out[18] = I->unk_bytes[0];
+	out[19] = I->unk_bytes[1];
+
+	for (unsigned s = 0; s < I->nr_srcs; ++s) {
+		const struct agx_src *src = &I->src[s];
+		uint8_t *p = out + 20 + (s * 6);
+
+		p[0] = src->type;
+		p[1] = (src->size32 ? AGX_RECORD_SRC_SIZE32 : 0) |
+			(src->abs ? AGX_RECORD_SRC_ABS : 0) |
+			(src->neg ? AGX_RECORD_SRC_NEG : 0) |
+			(src->unk ? AGX_RECORD_SRC_UNK : 0);
+		agx_put16(p + 2, src->value);
+		p[4] = (src->type == AGX_SRC_SYSVAL) ? src->component : src->raw_type;
+	}
+
+	memcpy(out + 38, I->bytes, I->size);
+}
+
+/* The flags that only describe the opcode are left out, since they follow
+ * from it */
+
+void
+agx_unpack_record(const uint8_t *in, struct agx_record *r)
+{
+	struct agx_instr *I = &r->I;
+	*r = (struct agx_record) {
+		.shader = agx_get32(in + 0),
+		.offset = agx_get32(in + 4),
+	};
+
+	I->size = in[8] <= AGX_MAX_INSTR_BYTES ? in[8] : AGX_MAX_INSTR_BYTES;
+	I->opcode = in[9];
+	I->stop = in[10] & AGX_RECORD_STOP;
+	I->unk80 = in[10] & AGX_RECORD_UNK80;
+	I->dest_32 = in[10] & AGX_RECORD_DEST_32;
+	I->unk = in[10] & AGX_RECORD_UNK;
+	I->dest = in[11];
+
+	I->imm = agx_get32(in + 12);
+	I->mode = in[16];
+	I->nr_srcs = in[17] <= AGX_MAX_SRCS ? in[17] : AGX_MAX_SRCS;
+	I->unk_bytes[0] = in[18];
+	I->unk_bytes[1] = in[19];
+
+	for (unsigned s = 0; s < I->nr_srcs; ++s) {
+		struct agx_src *src = &I->src[s];
+		const uint8_t *p = in + 20 + (s * 6);
+
+		src->type = p[0] <= AGX_SRC_UNKNOWN ? p[0] : AGX_SRC_UNKNOWN;
+		src->size32 = p[1] & AGX_RECORD_SRC_SIZE32;
+		src->abs = p[1] & AGX_RECORD_SRC_ABS;
+		src->neg = p[1] & AGX_RECORD_SRC_NEG;
+		src->unk = p[1] & AGX_RECORD_SRC_UNK;
+		src->value = agx_get16(p + 2);
+
+		if (src->type == AGX_SRC_SYSVAL)
+			src->component = p[4];
+		else
+			src->raw_type = p[4];
+	}
+
+	memcpy(I->bytes, in + 38, I->size);
+}
+
+static void
+agx_emit_json_bool(struct agx_emitter *e, const char *key, bool value)
+{
+	if (value) {
+		agx_emit_str(e, ",\"");
+		agx_emit_str(e, key);
+		agx_emit_str(e, "\":true");
+	}
+}
+
+static void
+agx_emit_json_uint(struct agx_emitter *e, const char *key, uint64_t value)
+{
+	agx_emit_str(e, ",\"");
+	agx_emit_str(e, key);
+	agx_emit_str(e, "\":");
+	agx_emit_uint(e, value);
+}
+
+/* Keys are always in this order and false flags are left out, so records of
+ * the same instruction are the same line */
+
+static void
+agx_emit_record_json(struct agx_emitter *e, const struct agx_record *r)
+{
+	const struct agx_instr *I = &r->I;
+
+	agx_emit_str(e, "{\"shader\":");
+	agx_emit_uint(e, r->shader);
+	agx_emit_json_uint(e, "offset", r->offset);
+
+	agx_emit_str(e, ",\"bytes\":\"");
+	for (unsigned i = 0; i < I->size; ++i)
+		agx_emit_hex8(e, I->bytes[i], false);
+
+	agx_emit_str(e, "\",\"opcode\":\"");
+	if (agx_opcode_name(I->opcode)) {
+		agx_emit_str(e, agx_opcode_name(I->opcode));
+	} else {
+		agx_emit_str(e, "op_");
+		agx_emit_hex8(e, I->opcode, true);
+	}
+	agx_emit_char(e, '"');
+
+	agx_emit_json_bool(e, "complete", agx_opcode_complete(I->opcode));
+	agx_emit_json_bool(e, "stop", I->stop);
+	agx_emit_json_bool(e, "unk80", I->unk80);
+
+	agx_emit_str(e, ",\"dest\":\"");
+	agx_emit_char(e, I->dest_32 ? 'w' : 'h');
+	agx_emit_uint(e, I->dest);
+	agx_emit_char(e, '"');
+
+	agx_emit_json_uint(e, "mode", I->mode);
+	agx_emit_json_uint(e, "imm", I->imm);
+	agx_emit_json_bool(e, "unk", I->unk);
+
+	agx_emit_str(e, ",\"unk_bytes\":[");
+	agx_emit_uint(e, I->unk_bytes[0]);
+	agx_emit_char(e, ',');
+	agx_emit_uint(e, I->unk_bytes[1]);
+
+	agx_emit_str(e, "],\"srcs\":[");
+
+	for (unsigned s = 0; s < I->nr_srcs; ++s) {
+		const struct agx_src *src = &I->src[s];
+
+		agx_emit_str(e, s ? ",{\"type\":\"" : "{\"type\":\"");
+		agx_emit_str(e, agx_src_type_names[src->type]);
+		agx_emit_char(e, '"');
+		agx_emit_json_uint(e, "value", src->value);
+		agx_emit_json_uint(e, "size", src->size32 ? 32 : 16);
+		agx_emit_json_bool(e, "abs", src->abs);
+		agx_emit_json_bool(e, "neg", src->neg);
+		agx_emit_json_bool(e, "unk", src->unk);
+
+		if (src->type == AGX_SRC_SYSVAL)
+			agx_emit_json_uint(e, "component", src->component);
+		else if (src->type == AGX_SRC_UNKNOWN)
+			agx_emit_json_uint(e, "raw_type", src->raw_type);
+
+		agx_emit_char(e, '}');
+	}
+
+	agx_emit_str(e, "]}\n");
+}
+
+void
+agx_emit_record_header(struct agx_emitter *e, enum agx_record_format format)
+{
+	if (format != AGX_RECORD_BINARY)
+		return;
+
+	uint8_t *p = (uint8_t *) agx_emit_reserve(e, AGX_RECORD_HEADER_SIZE);
+	memcpy(p, AGX_RECORD_MAGIC, 4);
+	agx_put32(p + 4, AGX_RECORD_VERSION);
+	agx_put32(p + 8, AGX_RECORD_SIZE);
+	e->size += AGX_RECORD_HEADER_SIZE;
+}
+
+void
+agx_emit_record(struct agx_emitter *e, enum agx_record_format format,
+		const struct agx_record *r)
+{
+	if (format == AGX_RECORD_BINARY) {
+		agx_pack_record((uint8_t *) agx_emit_reserve(e, AGX_RECORD_SIZE), r);
+		e->size += AGX_RECORD_SIZE;
+	} else {
+		agx_emit_record_json(e, r);
+	}
+}
+
+/* Records for a shader, up to its stop like agx_disassemble. A truncated last
+ * instruction has no record */
+
+void
+agx_emit_records(struct agx_emitter *e, enum agx_record_format format,
+		const void *code, size_t size, uint32_t shader)
+{
+	struct agx_record r = { .shader = shader };
+	size_t offset = 0;
+	bool stop = false;
+
+	while (offset < size && !stop) {
+		if (!agx_decode_at(code, size, offset, &r.I))
+			break;
+
+		r.offset = offset;
+		agx_emit_record(e, format, &r);
+
+		offset += r.I.size;
+		stop = r.I.stop;
+	}
+}
+
+/* Reading back. JSON lines are only read for their position and bytes, which
+ * are decoded again, and lines without them are skipped */
+
+static bool
+agx_json_uint(const char *line, const char *end, const char *key, uint32_t *out)
+{
+	size_t len = strlen(key);
+
+	for (const char *p = line; p + len < end; ++p) {
+		if (!memcmp(p, key, len)) {
+			char *rest;
+			*out = strtoul(p + len, &rest, 10);
+			return rest != p + len;
+		}
+	}
+
+	return false;
+}
+
+static int
+agx_hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	else if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	else if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	else
+		return -1;
+}
+
+static bool
+agx_parse_json_record(const char *line, const char *end, struct agx_record *r)
+{
+	static const char key[] = "\"bytes\":\"";
+	const char *p = NULL;
+
+	if (!agx_json_uint(line, end, "\"shader\":", &r->shader) ||
+	    !agx_json_uint(line, end, "\"offset\":", &r->offset))
+		return false;
+
+	for (const char *q = line; q + sizeof(key) - 1 < end; ++q) {
+		if (!memcmp(q, key, sizeof(key) - 1)) {
+			p = q + sizeof(key) - 1;
+			break;
+		}
+	}
+
+	if (!p)
+		return false;
+
+	uint8_t bytes[AGX_MAX_INSTR_BYTES] = { 0 };
+	unsigned size = 0;
+
+	while (p + 1 < end && *p != '"' && size < AGX_MAX_INSTR_BYTES) {
+		int hi = agx_hex_digit(p[0]), lo = agx_hex_digit(p[1]);
+		if (hi < 0 || lo < 0)
+			return false;
+
+		bytes[size++] = (hi << 4) | lo;
+		p += 2;
+	}
+
+	if (!size || !agx_decode_at(bytes, size, 0, &r->I))
+		return false;
+
+	/* Keep what was recorded, even where the decoder now disagrees */
+	r->I.size = size;
+	return true;
+}
+
+size_t
+agx_read_records(const void *_data, size_t size, struct agx_record **records)
+{
+	const uint8_t *data = _data;
+	size_t count = 0, capacity = 0;
+	*records = NULL;
+
+	if (size >= AGX_RECORD_HEADER_SIZE && !memcmp(data, AGX_RECORD_MAGIC, 4)) {
+		uint32_t record_size = agx_get32(data + 8);
+
+		if (agx_get32(data + 4) != AGX_RECORD_VERSION ||
+		    record_size < AGX_RECORD_SIZE)
+			return 0;
+
+		count = (size - AGX_RECORD_HEADER_SIZE) / record_size;
+		*records = calloc(count ? count : 1, sizeof(struct agx_record));
+
+		for (size_t i = 0; i < count; ++i) {
+			agx_unpack_record(data + AGX_RECORD_HEADER_SIZE +
+					(i * record_size), &(*records)[i]);
+		}
+
+		return count;
+	}
+
+	const char *text = _data, *end = text + size;
+
+	for (const char *line = text; line < end; ) {
+		const char *eol = memchr(line, '\n', end - line);
+		if (!eol)
+			eol = end;
+
+		struct agx_record r;
+
+		if (agx_parse_json_record(line, eol, &r)) {
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 256;
+				*records = realloc(*records, capacity * sizeof(r));
+			}
+
+			(*records)[count++] = r;
+		}
+
+		line = eol + 1;
+	}
+
+	return count;
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disasm.h"
+
+/* Register usage of a shader: the highest registers named, the live range of
+ * each 16-bit half, and the peak number live at once, which decides how many
+ * threads fit on a core. The register file is shared by the threads, so a
+ * bigger footprint means fewer in flight to hide latency with. */
+
+/* Halves per thread against threads per core. These are estimates of the
+ * hardware's steps, to be refined as they're measured */
+
+static const struct {
+	unsigned halves, threads;
+} agx_occupancy[] = {
+	{ 104, 1024 },
+	{ 112, 896 },
+	{ 136, 832 },
+	{ 160, 640 },
+	{ 184, 576 },
+	{ 208, 512 },
+	{ 232, 448 },
+	{ 256, 384 },
+};
+
+unsigned
+agx_threads_for_halves(unsigned halves)
+{
+	for (unsigned i = 0; i < sizeof(agx_occupancy) / sizeof(agx_occupancy[0]); ++i) {
+		if (halves <= agx_occupancy[i].halves)
+			return agx_occupancy[i].threads;
+	}
+
+	return 0;
+}
+
+struct agx_reg_set {
+	uint64_t bits[AGX_NUM_HALVES / 64];
+};
+
+static void
+agx_reg_set_add(struct agx_reg_set *set, unsigned half)
+{
+	set->bits[half / 64] |= (1ull << (half % 64));
+}
+
+static void
+agx_reg_set_remove(struct agx_reg_set *set, unsigned half)
+{
+	set->bits[half / 64] &= ~(1ull << (half % 64));
+}
+
+static unsigned
+agx_reg_set_count(const struct agx_reg_set *set)
+{
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < AGX_NUM_HALVES / 64; ++i)
+		count += __builtin_popcountll(set->bits[i]);
+
+	return count;
+}
+
+/* Registers read and written by one instruction, as half sets */
+
+struct agx_reg_access {
+	struct agx_reg_set reads, writes;
+};
+
+static void
+agx_access(struct agx_reg_set *set, struct agx_reg_info *info,
+		unsigned value, bool size32)
+{
+	unsigned first = size32 ? value * 2 : value;
+	unsigned count = size32 ? 2 : 1;
+
+	if (first + count > AGX_NUM_HALVES)
+		return;
+
+	if (size32 && (int) value > info->max_w)
+		info->max_w = value;
+	else if (!size32 && (int) value > info->max_h)
+		info->max_h = value;
+
+	for (unsigned i = 0; i < count; ++i)
+		agx_reg_set_add(set, first + i);
+}
+
+/* Instructions known to write their dest field. st_var instead stores it, and
+ * the rest either have no register dest or aren't understood well enough to
+ * say */
+
+static bool
+agx_writes_dest(uint8_t opcode)
+{
+	switch (agx_instr_class(opcode)) {
+	case AGX_CLASS_ALU:
+		return true;
+	case AGX_CLASS_MEMORY:
+		return opcode != OPC_STORE;
+	case AGX_CLASS_VARYING:
+		return opcode != OPC_ST_VAR;
+	default:
+		return false;
+	}
+}
+
+static struct agx_reg_access
+agx_reg_access(const struct agx_instr *I, struct agx_reg_info *info)
+{
+	struct agx_reg_access access = { 0 };
+
+	if (agx_writes_dest(I->opcode))
+		agx_access(&access.writes, info, I->dest, I->dest_32);
+	else if (I->opcode == OPC_ST_VAR)
+		agx_access(&access.reads, info, I->dest, I->dest_32);
+
+	for (unsigned s = 0; s < I->nr_srcs; ++s) {
+		if (I->src[s].type == AGX_SRC_REG)
+			agx_access(&access.reads, info, I->src[s].value, I->src[s].size32);
+	}
+
+	return access;
+}
+
+struct agx_reg_info
+agx_analyze_regs(const void *_code, size_t size)
+{
+	const uint8_t *code = _code;
+	struct agx_reg_info info = {
+		.max_h = -1,
+		.max_w = -1,
+	};
+
+	for (unsigned h = 0; h < AGX_NUM_HALVES; ++h)
+		info.live[h] = (struct agx_live_range) { -1, -1 };
+
+	/* Forward: collect each instruction's accesses up to the stop */
+	struct agx_reg_access *accesses = NULL;
+	unsigned capacity = 0;
+	size_t offset = 0;
+	bool stop = false;
+
+	while (offset < size && !stop) {
+		struct agx_instr I;
+		if (!agx_decode_at(code, size, offset, &I))
+			break;
+
+		if (info.instrs == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			accesses = realloc(accesses, capacity * sizeof(*accesses));
+		}
+
+		accesses[info.instrs++] = agx_reg_access(&I, &info);
+		offset += I.size;
+		stop = I.stop;
+	}
+
+	/* Backward: the live set after each instruction, from which the
+	 * pressure is the larger of what's live into it and what's live out
+	 * plus its writes. Branch targets aren't known, so the stream is
+	 * treated as straight line code */
+	struct agx_reg_set live = { 0 };
+
+	for (unsigned i = info.instrs; i-- > 0; ) {
+		const struct agx_reg_access *a = &accesses[i];
+		struct agx_reg_set out = live;
+
+		for (unsigned w = 0; w < AGX_NUM_HALVES / 64; ++w) {
+			out.bits[w] |= a->writes.bits[w];
+			live.bits[w] = (live.bits[w] & ~a->writes.bits[w]) | a->reads.bits[w];
+		}
+
+		unsigned pressure = agx_reg_set_count(&out);
+		if (agx_reg_set_count(&live) > pressure)
+			pressure = agx_reg_set_count(&live);
+
+		if (pressure >= info.max_live) {
+			info.max_live = pressure;
+			info.max_live_instr = i;
+		}
+	}
+
+	/* Live ranges, from the first access to the last. Anything live into
+	 * the first instruction was read before written, so starts at 0 */
+	for (unsigned i = 0; i < info.instrs; ++i) {
+		for (unsigned h = 0; h < AGX_NUM_HALVES; ++h) {
+			uint64_t bit = 1ull << (h % 64);
+			bool touched = (accesses[i].reads.bits[h / 64] | accesses[i].writes.bits[h / 64]) & bit;
+
+			if (!touched)
+				continue;
+
+			if (info.live[h].start < 0)
+				info.live[h].start = (live.bits[h / 64] & bit) ? 0 : (int) i;
+
+			info.live[h].end = i;
+			info.halves = h + 1 > info.halves ? h + 1 : info.halves;
+		}
+	}
+
+	info.threads = agx_threads_for_halves(info.halves);
+	free(accesses);
+	return info;
+}
+
+void
+agx_print_reg_info(FILE *fp, const struct agx_reg_info *info)
+{
+	struct agx_emitter e = { .fp = fp };
+
+	agx_emit_str(&e, "// registers: ");
+	agx_emit_uint(&e, info->halves);
+	agx_emit_str(&e, " halves");
+
+	if (info->max_h >= 0) {
+		agx_emit_str(&e, ", max h");
+		agx_emit_uint(&e, info->max_h);
+	}
+
+	if (info->max_w >= 0) {
+		agx_emit_str(&e, ", max w");
+		agx_emit_uint(&e, info->max_w);
+	}
+
+	agx_emit_str(&e, ", ");
+	agx_emit_uint(&e, info->max_live);
+	agx_emit_str(&e, " live at instruction ");
+	agx_emit_uint(&e, info->max_live_instr);
+	agx_emit_str(&e, ", ~");
+	agx_emit_uint(&e, info->threads);
+	agx_emit_str(&e, " threads per core\n");
+
+	for (unsigned h = 0; h < info->halves; ++h) {
+		if (info->live[h].start < 0)
+			continue;
+
+		agx_emit_str(&e, "// h");
+		agx_emit_uint(&e, h);
+		agx_emit_str(&e, " live ");
+		agx_emit_int(&e, info->live[h].start);
+		agx_emit_char(&e, '-');
+		agx_emit_int(&e, info->live[h].end);
+		agx_emit_char(&e, '\n');
+	}
+
+	agx_emit_finish(&e);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "disasm.h"
+
+#define STOP_BYTE 0x88 /* OPC_STOP | 0x80 */
+
+/* Given a stop at end, walk backwards finding the earliest offset from which
+ * decoding known instructions lands exactly on it. Instructions are at most
+ * AGX_MAX_INSTR_BYTES, so whether offset q reaches the stop only depends on
+ * the next few offsets, which we keep in a ring. Once that many offsets in a
+ * row can't reach it, nothing further back can either. */
+
+static size_t
+agx_scan_back(const uint8_t *data, size_t lo, size_t end)
+{
+	bool reaches[16] = { false };
+	size_t start = end;
+	unsigned misses = 0;
+
+	reaches[end & 15] = true;
+
+	for (size_t q = end; q-- > lo; ) {
+		unsigned n = agx_instr_size(data + q);
+		bool r = n && (q + n) <= end && reaches[(q + n) & 15];
+
+		reaches[q & 15] = r;
+
+		if (r) {
+			start = q;
+			misses = 0;
+		} else if (++misses >= AGX_MAX_INSTR_BYTES) {
+			break;
+		}
+	}
+
+	return start;
+}
+
+size_t
+agx_scan_shaders(const uint8_t *data, size_t size,
+		struct agx_shader_range **shaders)
+{
+	size_t count = 0, capacity = 0;
+	size_t lo = 0;
+	*shaders = NULL;
+
+	/* memchr is vectorized in any libc worth using, and the anchor byte is
+	 * rare enough in real dumps that this is most of the scan */
+	for (const uint8_t *p = data; size >= 4 && p <= data + size - 4; ++p) {
+		p = memchr(p, STOP_BYTE, (data + size - 3) - p);
+
+		if (!p)
+			break;
+
+		/* Top bit of the second byte is part of the opcode */
+		if (p[1] & 0x80)
+			continue;
+
+		size_t end = p - data;
+		size_t start = agx_scan_back(data, lo, end);
+
+		/* Padding between shaders is a run of stops with the top bit
+		 * clear, which belongs to neither */
+		while (start < end && data[start] == 0x08 && !(data[start + 1] & 0x80))
+			start += agx_instr_size(data + start);
+
+		unsigned instrs = 1;
+
+		for (size_t q = start; q < end; q += agx_instr_size(data + q))
+			++instrs;
+
+		/* Short runs are too easy to hit by chance in random data */
+		if (instrs < 3)
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			*shaders = realloc(*shaders, capacity * sizeof(**shaders));
+		}
+
+		(*shaders)[count++] = (struct agx_shader_range) {
+			.offset = start,
+			.size = (end + 4) - start,
+			.instrs = instrs,
+		};
+
+		lo = end + 4;
+		p = data + lo - 1;
+	}
+
+	return count;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include "emit.h"
+
+/* Every byte as two hex digits */
+
+const char agx_hex_lower[513] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+const char agx_hex_upper[513] =
+	"000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+	"202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+	"404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+	"606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+	"808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+	"A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+	"C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+	"E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/* "00" to "99", for two decimal digits per division */
+
+static const char agx_decimal_pairs[201] =
+	"0001020304050607080910111213141516171819202122232425262728293031"
+	"3233343536373839404142434445464748495051525354555657585960616263"
+	"6465666768697071727374757677787980818283848586878889909192939495"
+	"96979899";
+
+/* Callers write straight into the space reserved, and wrap runs this inside
+ * applications that may be built without asserts, so running out of memory
+ * is fatal here rather than a write through NULL */
+
+void
+agx_emit_grow(struct agx_emitter *e, size_t bytes)
+{
+	size_t capacity = e->capacity ? e->capacity : 4096;
+	char *data = NULL;
+
+	if (bytes <= SIZE_MAX / 2 - e->size) {
+		while (capacity < e->size + bytes)
+			capacity *= 2;
+
+		data = realloc(e->data, capacity);
+	}
+
+	if (!data) {
+		fprintf(stderr, "agx_emit: out of memory growing to %zu + %zu bytes\n",
+				e->size, bytes);
+		abort();
+	}
+
+	e->data = data;
+	e->capacity = capacity;
+}
+
+void
+agx_emit_flush(struct agx_emitter *e)
+{
+	if (e->fp && e->size) {
+		fwrite(e->data, 1, e->size, e->fp);
+		e->size = 0;
+	}
+}
+
+void
+agx_emit_finish(struct agx_emitter *e)
+{
+	agx_emit_flush(e);
+	free(e->data);
+	*e = (struct agx_emitter) { .fp = e->fp };
+}
+
+/* Like %x with a minimum width of zeroes, so %02X is agx_emit_hex(e, v, 2, true) */
+
+void
+agx_emit_hex(struct agx_emitter *e, uint64_t v, unsigned min_digits, bool upper)
+{
+	const char *digits = upper ? agx_hex_upper : agx_hex_lower;
+	char buf[16];
+	unsigned n = 0;
+
+	/* Two digits at a time from the back */
+	do {
+		n += 2;
+		memcpy(buf + sizeof(buf) - n, digits + 2 * (v & 0xFF), 2);
+		v >>= 8;
+	} while (v);
+
+	/* Drop a leading zero, unless the width wants it */
+	if (buf[sizeof(buf) - n] == '0' && n > 1 && n > min_digits)
+		--n;
+
+	while (n < min_digits && n < sizeof(buf))
+		buf[sizeof(buf) - (++n)] = '0';
+
+	agx_emit_mem(e, buf + sizeof(buf) - n, n);
+}
+
+void
+agx_emit_uint(struct agx_emitter *e, uint64_t v)
+{
+	char buf[20];
+	unsigned n = 0;
+
+	while (v >= 100) {
+		n += 2;
+		memcpy(buf + sizeof(buf) - n, agx_decimal_pairs + 2 * (v % 100), 2);
+		v /= 100;
+	}
+
+	if (v >= 10) {
+		n += 2;
+		memcpy(buf + sizeof(buf) - n, agx_decimal_pairs + 2 * v, 2);
+	} else {
+		buf[sizeof(buf) - (++n)] = '0' + v;
+	}
+
+	agx_emit_mem(e, buf + sizeof(buf) - n, n);
+}
+
+void
+agx_emit_int(struct agx_emitter *e, int64_t v)
+{
+	if (v < 0) {
+		agx_emit_char(e, '-');
+		agx_emit_uint(e, -(uint64_t) v);
+	} else {
+		agx_emit_uint(e, v);
+	}
+}
+
+/* For the odd float, everything else should use the formatters above */
+
+void
+agx_emit_printf(struct agx_emitter *e, const char *fmt, ...)
+{
+	va_list ap, ap2;
+	va_start(ap, fmt);
+	va_copy(ap2, ap);
+
+	/* Nothing is printed if the format can't be */
+	int n = vsnprintf(NULL, 0, fmt, ap);
+
+	if (n >= 0) {
+		vsnprintf(agx_emit_reserve(e, n + 1), n + 1, fmt, ap2);
+		e->size += n;
+	}
+
+	va_end(ap2);
+	va_end(ap);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_EMIT_H
+#define __AGX_EMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Growable text buffer for the tools' output. Records are built up with the
+ * formatters below, which are table-driven rather than going through printf,
+ * then handed to the FILE in one write by agx_emit_flush. With a NULL FILE it
+ * just accumulates, for building strings. */
+
+struct agx_emitter {
+	FILE *fp;
+	char *data;
+	size_t size, capacity;
+};
+
+void agx_emit_grow(struct agx_emitter *e, size_t bytes);
+void agx_emit_flush(struct agx_emitter *e);
+void agx_emit_finish(struct agx_emitter *e);
+
+void agx_emit_hex(struct agx_emitter *e, uint64_t v, unsigned min_digits, bool upper);
+void agx_emit_uint(struct agx_emitter *e, uint64_t v);
+void agx_emit_int(struct agx_emitter *e, int64_t v);
+void agx_emit_printf(struct agx_emitter *e, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Space for bytes more characters, returning where to put them */
+
+static inline char *
+agx_emit_reserve(struct agx_emitter *e, size_t bytes)
+{
+	if (e->size + bytes > e->capacity)
+		agx_emit_grow(e, bytes);
+
+	return e->data + e->size;
+}
+
+static inline void
+agx_emit_mem(struct agx_emitter *e, const char *s, size_t len)
+{
+	memcpy(agx_emit_reserve(e, len), s, len);
+	e->size += len;
+}
+
+static inline void
+agx_emit_str(struct agx_emitter *e, const char *s)
+{
+	agx_emit_mem(e, s, strlen(s));
+}
+
+static inline void
+agx_emit_char(struct agx_emitter *e, char c)
+{
+	*agx_emit_reserve(e, 1) = c;
+	e->size++;
+}
+
+/* Like %p */
+
+static inline void
+agx_emit_ptr(struct agx_emitter *e, const void *ptr)
+{
+	agx_emit_str(e, "0x");
+	agx_emit_hex(e, (uintptr_t) ptr, 0, false);
+}
+
+/* Exactly two hex digits, the hexdump workhorse */
+
+extern const char agx_hex_lower[513], agx_hex_upper[513];
+
+static inline void
+agx_emit_hex8(struct agx_emitter *e, uint8_t v, bool upper)
+{
+	memcpy(agx_emit_reserve(e, 2), (upper ? agx_hex_upper : agx_hex_lower) + 2 * v, 2);
+	e->size += 2;
+}
+
+/* NUL terminated contents, for NULL FILE emitters */
+
+static inline const char *
+agx_emit_string(struct agx_emitter *e)
+{
+	*agx_emit_reserve(e, 1) = '\0';
+	return e->data;
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "hash.h"
+
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+/* Both the M1 and the machines the tools run on are little endian */
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = rotl64(acc, 31);
+	return acc * P1;
+}
+
+static inline uint64_t
+merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return acc * P1 + P4;
+}
+
+uint64_t
+agx_hash64(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *p = data, *end = p + size;
+	uint64_t h;
+
+	/* Four independent lanes over 32 byte stripes */
+	if (size >= 32) {
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2;
+		uint64_t v3 = seed, v4 = seed - P1;
+
+		do {
+			v1 = round64(v1, read64(p + 0));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = seed + P5;
+	}
+
+	h += size;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * P1 + P4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= read32(p) * P1;
+		h = rotl64(h, 23) * P2 + P3;
+		p += 4;
+	}
+
+	for (; p < end; ++p) {
+		h ^= (*p) * P5;
+		h = rotl64(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
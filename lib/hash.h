@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_HASH_H
+#define __AGX_HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Content hashes for deduplicating shaders and buffers. This is XXH64, so
+ * hashes can be checked against the reference implementation, and is fast
+ * enough to hash whole BOs on every submit. */
+
+uint64_t
+agx_hash64(const void *data, size_t size, uint64_t seed);
+
+/* 128 bits from two seeds, for keys where a collision would go unnoticed */
+
+struct agx_hash128 {
+	uint64_t lo, hi;
+};
+
+static inline struct agx_hash128
+agx_hash128(const void *data, size_t size)
+{
+	return (struct agx_hash128) {
+		.lo = agx_hash64(data, size, 0),
+		.hi = agx_hash64(data, size, 0x9E3779B97F4A7C15ull),
+	};
+}
+
+#endif
@@ -59,7 +59,8 @@ agx_alloc_mem(mach_port_t connection, size_t size, enum agx_memory_type type, bo
 		.index = (out[3] >> 32ull),
 		.gpu_va = out[0],
 		.map = (void *) out[1],
-		.size = size
+		.size = size,
+		.write_combine = write_combine
 	};
 }
 
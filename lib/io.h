@@ -25,9 +25,14 @@
 #define __AGX_IO_H
 
 #include <stdbool.h>
-#include <mach/mach.h>
 #include "selectors.h"
 
+#ifdef __APPLE__
+#include <mach/mach.h>
+#else
+typedef unsigned int mach_port_t;
+#endif
+
 enum agx_alloc_type {
 	AGX_ALLOC_REGULAR = 0,
 	AGX_ALLOC_MEMMAP = 1,
@@ -49,6 +54,9 @@ struct agx_allocation {
 
 	/* If type REGULAR, mapped GPU address */
 	uint64_t gpu_va;
+
+	/* If the CPU mapping is write-combined, reads are uncached */
+	bool write_combine;
 };
 
 struct agx_notification_queue {
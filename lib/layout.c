@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "layout.h"
+#include "util.h"
+
+#define ALIGN_POT(x, pot) (((x) + (pot) - 1) & ~((size_t) (pot) - 1))
+
+unsigned
+ash_layout_max_levels(unsigned width, unsigned height)
+{
+	unsigned size = width > height ? width : height;
+	unsigned levels = 1;
+
+	while (size > 1) {
+		size >>= 1;
+		++levels;
+	}
+
+	return levels;
+}
+
+struct ash_layout
+ash_layout_create(bool tiled,
+		unsigned width, unsigned height, unsigned bpp,
+		unsigned levels, unsigned layers)
+{
+	assert(width && height && layers);
+	assert(bpp >= 8 && bpp <= 128 && (bpp & (bpp - 1)) == 0);
+	assert(levels >= 1 && levels <= ASH_MAX_LEVELS);
+	assert(levels <= ash_layout_max_levels(width, height));
+
+	struct ash_layout layout = {
+		.tiled = tiled,
+		.width = width,
+		.height = height,
+		.bpp = bpp,
+		.levels = levels,
+		.layers = layers,
+	};
+
+	unsigned cpp = bpp / 8;
+	size_t offset = 0;
+
+	for (unsigned l = 0; l < levels; ++l) {
+		struct ash_level *level = &layout.level[l];
+
+		level->width = MAX2(width >> l, 1);
+		level->height = MAX2(height >> l, 1);
+
+		if (tiled) {
+			level->tiles_x = (level->width + 63) / 64;
+			level->tiles_y = (level->height + 63) / 64;
+			level->stride = level->tiles_x * 64 * 64 * cpp;
+			level->size = (size_t) level->stride * level->tiles_y;
+		} else {
+			level->stride = ALIGN_POT(level->width * cpp,
+					ASH_LINEAR_STRIDE_ALIGN);
+			level->size = (size_t) level->stride * level->height;
+		}
+
+		/* Tiled levels are whole tiles so stay aligned by themselves */
+		level->offset = offset;
+		offset = ALIGN_POT(offset + level->size, ASH_LINEAR_STRIDE_ALIGN);
+	}
+
+	layout.layer_stride = offset;
+	layout.size = ALIGN_POT(offset * layers, ASH_BO_ALIGN);
+
+	return layout;
+}
+
+size_t
+ash_layout_offset(const struct ash_layout *layout,
+		unsigned level, unsigned layer)
+{
+	assert(level < layout->levels && layer < layout->layers);
+
+	return (layout->layer_stride * layer) + layout->level[level].offset;
+}
+
+unsigned
+ash_layout_pitch(const struct ash_layout *layout, unsigned level)
+{
+	assert(level < layout->levels);
+	assert(!layout->tiled && "tiled surfaces have no linear pitch");
+
+	return layout->level[level].stride / (layout->bpp / 8);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __ASH_LAYOUT_H
+#define __ASH_LAYOUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Where each mip level and array layer of a surface lives in its BO, and how
+ * big the BO needs to be. Layers are outermost, each holding a full mip chain,
+ * levels are consecutive within a layer.
+ *
+ * Tiled levels are padded out to whole 64x64 tiles, which is what the
+ * ash_detile family expects. Linear levels have their stride padded to a
+ * cache line, so the non-temporal paths can be used on them. */
+
+#define ASH_MAX_LEVELS 16
+#define ASH_LINEAR_STRIDE_ALIGN 64
+#define ASH_BO_ALIGN 16384
+
+struct ash_level {
+	unsigned width, height;
+
+	/* In tiles, for tiled surfaces */
+	unsigned tiles_x, tiles_y;
+
+	/* Bytes between rows of texels (linear) or rows of tiles (tiled) */
+	unsigned stride;
+
+	/* Offset within a layer, and size in bytes */
+	size_t offset, size;
+};
+
+struct ash_layout {
+	bool tiled;
+	unsigned width, height, bpp;
+	unsigned levels, layers;
+
+	struct ash_level level[ASH_MAX_LEVELS];
+
+	/* Bytes between array layers, and the total rounded up to a page */
+	size_t layer_stride, size;
+};
+
+struct ash_layout ash_layout_create(bool tiled,
+		unsigned width, unsigned height, unsigned bpp,
+		unsigned levels, unsigned layers);
+
+/* Number of levels in a full mip chain down to 1x1 */
+unsigned ash_layout_max_levels(unsigned width, unsigned height);
+
+size_t ash_layout_offset(const struct ash_layout *layout,
+		unsigned level, unsigned layer);
+
+/* Linear row pitch of a level, in texels */
+unsigned ash_layout_pitch(const struct ash_layout *layout, unsigned level);
+
+#endif
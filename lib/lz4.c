@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+/* Each sequence is a token (literal length, match length - 4), the literal
+ * length's continuation bytes, literals, a 16-bit offset, then the match
+ * length's continuation bytes. The last sequence is literals only, and
+ * covers at least the last 5 bytes; no match starts in the last 12. */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_BITS 13
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes a length's continuation bytes, after the 15 in its token nibble */
+
+static uint8_t *
+emit_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*(op++) = 255;
+
+	*(op++) = len;
+	return op;
+}
+
+/* Worst case output for a sequence, to check before writing it */
+
+static size_t
+sequence_bound(size_t literals, size_t match)
+{
+	return 1 + (literals / 255) + 1 + literals + 2 + (match / 255) + 1;
+}
+
+static uint8_t *
+emit_sequence(uint8_t *op, const uint8_t *literals, size_t nr_literals,
+		size_t offset, size_t match)
+{
+	uint8_t *token = op++;
+	*token = (nr_literals >= 15 ? 15 : nr_literals) << 4;
+
+	if (nr_literals >= 15)
+		op = emit_length(op, nr_literals - 15);
+
+	memcpy(op, literals, nr_literals);
+	op += nr_literals;
+
+	if (!match)
+		return op;
+
+	*(op++) = offset & 0xFF;
+	*(op++) = offset >> 8;
+
+	match -= MIN_MATCH;
+	*token |= match >= 15 ? 15 : match;
+
+	if (match >= 15)
+		op = emit_length(op, match - 15);
+
+	return op;
+}
+
+size_t
+agx_lz4_compress(const void *_src, size_t size, void *_dst, size_t capacity)
+{
+	const uint8_t *src = _src, *end = src + size;
+	uint8_t *dst = _dst, *op = dst, *oend = dst + capacity;
+	const uint8_t *ip = src, *anchor = src;
+	uint32_t table[1 << HASH_BITS] = { 0 };
+
+	if (size >= MF_LIMIT + 1) {
+		const uint8_t *mflimit = end - MF_LIMIT;
+		const uint8_t *matchlimit = end - LAST_LITERALS;
+		unsigned misses = 0;
+
+		while (ip < mflimit) {
+			uint32_t seq = read32(ip);
+			uint32_t h = hash4(seq);
+			const uint8_t *ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+				/* Skip faster through incompressible data */
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+
+			misses = 0;
+
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+
+			const uint8_t *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+			while (m < matchlimit && *m == *r) {
+				++m;
+				++r;
+			}
+
+			size_t literals = ip - anchor, match = m - ip;
+			if (sequence_bound(literals, match) > (size_t) (oend - op))
+				return 0;
+
+			op = emit_sequence(op, anchor, literals, ip - ref, match);
+			ip = anchor = m;
+		}
+	}
+
+	size_t literals = end - anchor;
+	if (sequence_bound(literals, 0) > (size_t) (oend - op))
+		return 0;
+
+	op = emit_sequence(op, anchor, literals, 0, 0);
+	return op - dst;
+}
+
+/* Reads a length's continuation bytes, failing past the end of the input */
+
+static bool
+read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+
+		b = *((*ip)++);
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+bool
+agx_lz4_decompress(const void *_src, size_t src_size, void *_dst, size_t size)
+{
+	const uint8_t *ip = _src, *iend = ip + src_size;
+	uint8_t *dst = _dst, *op = dst, *oend = dst + size;
+
+	while (ip < iend) {
+		uint8_t token = *(ip++);
+		size_t literals = token >> 4;
+
+		if (literals == 15 && !read_length(&ip, iend, &literals))
+			return false;
+
+		if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op))
+			return false;
+
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		/* The last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		size_t match = token & 15;
+		ip += 2;
+
+		if (match == 15 && !read_length(&ip, iend, &match))
+			return false;
+
+		match += MIN_MATCH;
+
+		if (!offset || offset > (size_t) (op - dst) ||
+		    match > (size_t) (oend - op))
+			return false;
+
+		/* Overlapping copies repeat the pattern, so go bytewise */
+		const uint8_t *ref = op - offset;
+
+		if (offset >= match) {
+			memcpy(op, ref, match);
+			op += match;
+		} else {
+			for (size_t i = 0; i < match; ++i)
+				*(op++) = ref[i];
+		}
+	}
+
+	return op == oend;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_LZ4_H
+#define __AGX_LZ4_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* LZ4 block format, without the frame around it: fast enough to compress
+ * buffer captures as they are taken. Blocks are interchangeable with the
+ * reference implementation's LZ4_compress_default / LZ4_decompress_safe. */
+
+/* Largest compressed size for size bytes of input */
+
+static inline size_t
+agx_lz4_bound(size_t size)
+{
+	return size + (size / 255) + 16;
+}
+
+/* Returns the compressed size, or 0 if it doesn't fit in capacity */
+
+size_t
+agx_lz4_compress(const void *src, size_t size, void *dst, size_t capacity);
+
+/* Returns whether src decompressed to exactly size bytes, checking every
+ * length and offset against the buffers, so any input is safe */
+
+bool
+agx_lz4_decompress(const void *src, size_t src_size, void *dst, size_t size);
+
+#endif
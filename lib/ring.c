@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "ring.h"
+
+void
+agx_ring_init(struct agx_ring *ring, size_t size)
+{
+	size_t pot = 64;
+	while (pot < size)
+		pot <<= 1;
+
+	*ring = (struct agx_ring) {
+		.data = malloc(pot),
+		.size = pot,
+	};
+
+	assert(ring->data != NULL);
+}
+
+void
+agx_ring_fini(struct agx_ring *ring)
+{
+	free(ring->data);
+	ring->data = NULL;
+}
+
+static void
+agx_ring_copy(struct agx_ring *ring, size_t head, const void *data, size_t size)
+{
+	size_t at = head & (ring->size - 1);
+	size_t first = ring->size - at;
+
+	if (size <= first) {
+		memcpy(ring->data + at, data, size);
+	} else {
+		memcpy(ring->data + at, data, first);
+		memcpy(ring->data, (const uint8_t *) data + first, size - first);
+	}
+}
+
+bool
+agx_ring_pushv(struct agx_ring *ring, const struct iovec *iov, unsigned count)
+{
+	size_t size = 0;
+	for (unsigned i = 0; i < count; ++i)
+		size += iov[i].iov_len;
+
+	/* Only we move head, and tail only grows, so a stale tail just means
+	 * less room than there really is */
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (size > ring->size - (head - tail)) {
+		/* Single writer, so no read-modify-write needed */
+		uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+		uint64_t bytes = atomic_load_explicit(&ring->dropped_bytes, memory_order_relaxed);
+		atomic_store_explicit(&ring->dropped, dropped + 1, memory_order_relaxed);
+		atomic_store_explicit(&ring->dropped_bytes, bytes + size, memory_order_relaxed);
+		return false;
+	}
+
+	size_t at = head;
+	for (unsigned i = 0; i < count; ++i) {
+		agx_ring_copy(ring, at, iov[i].iov_base, iov[i].iov_len);
+		at += iov[i].iov_len;
+	}
+
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+	return true;
+}
+
+bool
+agx_ring_push(struct agx_ring *ring, const void *data, size_t size)
+{
+	return agx_ring_pushv(ring, &(struct iovec) { (void *) data, size }, 1);
+}
+
+size_t
+agx_ring_peek(struct agx_ring *ring, const uint8_t **first,
+		size_t *first_size, const uint8_t **second, size_t *second_size)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t used = head - tail;
+	size_t at = tail & (ring->size - 1);
+
+	*first = ring->data + at;
+	*first_size = (used < ring->size - at) ? used : ring->size - at;
+	*second = ring->data;
+	*second_size = used - *first_size;
+
+	return used;
+}
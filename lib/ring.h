@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_RING_H
+#define __AGX_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/* Single-producer, single-consumer byte ring. The producer never waits: a
+ * push either fits whole, or is dropped and counted. Positions only grow, and
+ * are masked into the power-of-two buffer, so the consumer can always tell a
+ * full ring from an empty one. Each side owns a cache line. */
+
+struct agx_ring {
+	uint8_t *data;
+	size_t size;
+
+	/* Written by the producer */
+	_Alignas(64) _Atomic size_t head;
+	_Atomic uint64_t dropped, dropped_bytes;
+
+	/* Written by the consumer */
+	_Alignas(64) _Atomic size_t tail;
+};
+
+/* size is rounded up to a power of two */
+
+void agx_ring_init(struct agx_ring *ring, size_t size);
+void agx_ring_fini(struct agx_ring *ring);
+
+/* Producer side: copies size bytes in as one unit, or returns false if there
+ * isn't room for them all */
+
+bool agx_ring_push(struct agx_ring *ring, const void *data, size_t size);
+
+/* As agx_ring_push, gathering the unit from count pieces */
+
+bool agx_ring_pushv(struct agx_ring *ring, const struct iovec *iov,
+		unsigned count);
+
+/* Consumer side: what has been pushed and not yet consumed, as up to two
+ * pieces since it may wrap around the end of the buffer. Returns the total. */
+
+size_t agx_ring_peek(struct agx_ring *ring, const uint8_t **first,
+		size_t *first_size, const uint8_t **second, size_t *second_size);
+
+static inline void
+agx_ring_consume(struct agx_ring *ring, size_t size)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+}
+
+#endif
@@ -24,7 +24,14 @@
 #ifndef __AGX_SELECTOR_H
 #define __AGX_SELECTOR_H
 
+#include <stdint.h>
+
+/* Only the layouts need IOKit, so trace tools can use the names elsewhere */
+#ifdef __APPLE__
 #include <IOKit/IODataQueueClient.h>
+#else
+typedef struct IODataQueueMemory IODataQueueMemory;
+#endif
 
 enum agx_selector {
 	AGX_SELECTOR_SET_API = 0x7,
@@ -0,0 +1,613 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "store.h"
+#include "lz4.h"
+
+static bool
+agx_store_is_empty(struct agx_hash128 h)
+{
+	return !h.lo && !h.hi;
+}
+
+/* Returns the slot for a hash, either holding it or empty */
+
+static struct agx_store_entry *
+agx_store_slot(const struct agx_store *store, struct agx_hash128 hash)
+{
+	size_t mask = store->capacity - 1;
+
+	for (size_t i = hash.lo & mask;; i = (i + 1) & mask) {
+		struct agx_store_entry *slot = &store->entries[i];
+
+		if (agx_store_is_empty(slot->hash) ||
+		    (slot->hash.lo == hash.lo && slot->hash.hi == hash.hi))
+			return slot;
+	}
+}
+
+static const struct agx_store_entry *
+agx_store_find(const struct agx_store *store, struct agx_hash128 hash)
+{
+	if (!store->capacity || agx_store_is_empty(hash))
+		return NULL;
+
+	const struct agx_store_entry *slot = agx_store_slot(store, hash);
+	return agx_store_is_empty(slot->hash) ? NULL : slot;
+}
+
+static void
+agx_store_remember(struct agx_store *store, struct agx_hash128 hash,
+		uint64_t offset)
+{
+	if (agx_store_is_empty(hash))
+		return;
+
+	/* Kept under half full */
+	if (2 * (store->nr_entries + 1) > store->capacity) {
+		struct agx_store_entry *old = store->entries;
+		size_t old_capacity = store->capacity;
+
+		store->capacity = old_capacity ? old_capacity * 2 : 1024;
+		store->entries = calloc(store->capacity, sizeof(*store->entries));
+
+		for (size_t i = 0; i < old_capacity; ++i) {
+			if (!agx_store_is_empty(old[i].hash))
+				*agx_store_slot(store, old[i].hash) = old[i];
+		}
+
+		free(old);
+	}
+
+	struct agx_store_entry *slot = agx_store_slot(store, hash);
+
+	if (agx_store_is_empty(slot->hash)) {
+		*slot = (struct agx_store_entry) { hash, offset };
+		store->nr_entries++;
+	}
+}
+
+static size_t
+agx_store_chunk_size(const struct agx_store_chunk *chunk)
+{
+	return sizeof(*chunk) + ((chunk->stored_size + 7) & ~7ull);
+}
+
+/* Loads the index of a mapped archive, from its footer if it was closed, or
+ * else by walking the chunks as far as they are whole. Returns the end of the
+ * chunks, where more can be added. */
+
+static uint64_t
+agx_store_load(struct agx_store *store, const uint8_t *map, size_t size)
+{
+	struct agx_store_footer footer;
+
+	if (size >= 8 + sizeof(footer)) {
+		memcpy(&footer, map + size - sizeof(footer), sizeof(footer));
+
+		/* The index must fill exactly the space between its offset and
+		 * the footer. Bounded without adding untrusted values, which a
+		 * crafted footer could wrap around. */
+		if (!memcmp(footer.magic, AGX_STORE_INDEX_MAGIC, 8) &&
+		    footer.index_offset >= 8 &&
+		    footer.index_offset <= size - sizeof(footer) &&
+		    footer.count <= (size - sizeof(footer) - footer.index_offset) /
+		                    sizeof(struct agx_store_entry) &&
+		    footer.count * sizeof(struct agx_store_entry) ==
+		    size - sizeof(footer) - footer.index_offset) {
+			for (uint64_t i = 0; i < footer.count; ++i) {
+				struct agx_store_entry e;
+				memcpy(&e, map + footer.index_offset + i * sizeof(e), sizeof(e));
+
+				/* Only entries whose chunk header is in the archive,
+				 * before the index */
+				if (e.offset >= 8 && e.offset <= footer.index_offset &&
+				    footer.index_offset - e.offset >= sizeof(struct agx_store_chunk))
+					agx_store_remember(store, e.hash, e.offset);
+			}
+
+			return footer.index_offset;
+		}
+	}
+
+	uint64_t offset = 8;
+
+	while (size - offset >= sizeof(struct agx_store_chunk)) {
+		struct agx_store_chunk chunk;
+		memcpy(&chunk, map + offset, sizeof(chunk));
+
+		if (chunk.codec > AGX_STORE_LZ4 ||
+		    chunk.stored_size > size - offset - sizeof(chunk) ||
+		    agx_store_chunk_size(&chunk) > size - offset)
+			break;
+
+		agx_store_remember(store, chunk.hash, offset);
+		offset += agx_store_chunk_size(&chunk);
+	}
+
+	return offset;
+}
+
+struct agx_store *
+agx_store_open(const char *path, bool write)
+{
+	int fd = open(path, write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	struct stat st;
+
+	if (fd < 0)
+		return NULL;
+
+	if ((write && flock(fd, LOCK_EX | LOCK_NB) < 0) || fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	struct agx_store *store = calloc(1, sizeof(*store));
+	size_t size = st.st_size;
+	uint8_t *map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+
+	store->fd = fd;
+	store->write = write;
+
+	if (map == MAP_FAILED || (size && (size < 8 || memcmp(map, AGX_STORE_MAGIC, 8)))) {
+		if (map != MAP_FAILED && map)
+			munmap(map, size);
+
+		close(fd);
+		free(store);
+		return NULL;
+	}
+
+	if (size)
+		store->end = agx_store_load(store, map, size);
+
+	if (!write) {
+		store->map = map;
+		store->map_size = size;
+		return store;
+	}
+
+	if (map)
+		munmap(map, size);
+
+	/* New chunks go over the old index, or anything torn off the end */
+	if (!size) {
+		store->end = 8;
+		pwrite(fd, AGX_STORE_MAGIC, 8, 0);
+	}
+
+	if (ftruncate(fd, store->end) < 0) {
+		close(fd);
+		free(store->entries);
+		free(store);
+		return NULL;
+	}
+
+	return store;
+}
+
+struct agx_store *
+agx_store_open_memory(const void *data, size_t size)
+{
+	if (size < 8 || memcmp(data, AGX_STORE_MAGIC, 8))
+		return NULL;
+
+	struct agx_store *store = calloc(1, sizeof(*store));
+	store->fd = -1;
+	store->map = data;
+	store->map_size = size;
+	store->end = agx_store_load(store, data, size);
+	return store;
+}
+
+void
+agx_store_close(struct agx_store *store)
+{
+	if (!store)
+		return;
+
+	if (store->write) {
+		struct agx_store_footer footer = {
+			.index_offset = store->end,
+			.magic = AGX_STORE_INDEX_MAGIC,
+		};
+
+		struct agx_store_entry *index =
+			malloc((store->nr_entries + 1) * sizeof(*index));
+
+		for (size_t i = 0; i < store->capacity; ++i) {
+			if (!agx_store_is_empty(store->entries[i].hash))
+				index[footer.count++] = store->entries[i];
+		}
+
+		size_t index_size = footer.count * sizeof(*index);
+		pwrite(store->fd, index, index_size, store->end);
+		pwrite(store->fd, &footer, sizeof(footer), store->end + index_size);
+		free(index);
+	} else if (store->map && store->fd >= 0) {
+		munmap((void *) store->map, store->map_size);
+	}
+
+	if (store->fd >= 0)
+		close(store->fd);
+	free(store->entries);
+	free(store);
+}
+
+/* Chunks are written whole with one call, so a crash leaves at most one torn
+ * chunk at the end, which the next open cuts off */
+
+enum agx_store_status
+agx_store_put(struct agx_store *store, struct agx_hash128 hash,
+		const void *data, size_t size)
+{
+	assert(store->write);
+	store->stats.puts++;
+
+	if (agx_store_find(store, hash))
+		return AGX_STORE_EXISTS;
+
+	size_t bound = agx_lz4_bound(size);
+	uint8_t *compressed = malloc(bound);
+	size_t compressed_size = compressed ?
+		agx_lz4_compress(data, size, compressed, bound) : 0;
+	bool lz4 = compressed_size && compressed_size < size;
+
+	struct agx_store_chunk chunk = {
+		.hash = hash,
+		.size = size,
+		.stored_size = lz4 ? compressed_size : size,
+		.codec = lz4 ? AGX_STORE_LZ4 : AGX_STORE_RAW,
+	};
+
+	static const uint8_t zero[8];
+	struct iovec iov[] = {
+		{ &chunk, sizeof(chunk) },
+		{ lz4 ? compressed : (void *) data, chunk.stored_size },
+		{ (void *) zero, agx_store_chunk_size(&chunk) - sizeof(chunk) - chunk.stored_size },
+	};
+
+	size_t total = agx_store_chunk_size(&chunk);
+	bool written = pwritev(store->fd, iov, 3, store->end) == (ssize_t) total;
+	free(compressed);
+
+	if (!written)
+		return AGX_STORE_FAILED;
+
+	agx_store_remember(store, hash, store->end);
+	store->end += total;
+	store->stats.blobs++;
+	store->stats.bytes += total;
+	return AGX_STORE_STORED;
+}
+
+void *
+agx_store_get(const struct agx_store *store, struct agx_hash128 hash,
+		size_t *size)
+{
+	const struct agx_store_entry *e = agx_store_find(store, hash);
+	if (!e || !store->map || e->offset > store->map_size ||
+	    store->map_size - e->offset < sizeof(struct agx_store_chunk))
+		return NULL;
+
+	struct agx_store_chunk chunk;
+	memcpy(&chunk, store->map + e->offset, sizeof(chunk));
+
+	const uint8_t *stored = store->map + e->offset + sizeof(chunk);
+	if (chunk.codec > AGX_STORE_LZ4 ||
+	    chunk.stored_size > store->map_size - e->offset - sizeof(chunk))
+		return NULL;
+
+	/* LZ4 expands at most 255 times, and anything larger than that is not
+	 * worth trying to allocate */
+	if (chunk.codec == AGX_STORE_LZ4 ?
+	    chunk.size / 255 > chunk.stored_size :
+	    chunk.size != chunk.stored_size)
+		return NULL;
+
+	uint8_t *data = malloc(chunk.size ? chunk.size : 1);
+	bool ok;
+
+	if (!data)
+		return NULL;
+
+	if (chunk.codec == AGX_STORE_LZ4) {
+		ok = agx_lz4_decompress(stored, chunk.stored_size, data, chunk.size);
+	} else {
+		memcpy(data, stored, chunk.size);
+		ok = true;
+	}
+
+	struct agx_hash128 check = agx_hash128(data, chunk.size);
+
+	if (!ok || check.lo != hash.lo || check.hi != hash.hi) {
+		free(data);
+		return NULL;
+	}
+
+	*size = chunk.size;
+	return data;
+}
+
+void
+agx_store_bo_fini(struct agx_store_bo *bo)
+{
+	free(bo->pages);
+	*bo = (struct agx_store_bo) { 0 };
+}
+
+void
+agx_store_bo_keyframe(struct agx_store_bo *bo)
+{
+	free(bo->pages);
+	bo->pages = NULL;
+}
+
+static size_t
+agx_store_page_size(size_t size, size_t page)
+{
+	size_t offset = page * AGX_STORE_PAGE;
+	return size - offset < AGX_STORE_PAGE ? size - offset : AGX_STORE_PAGE;
+}
+
+bool
+agx_store_diff_bo(struct agx_store_bo *bo, const void *_data, size_t size,
+		unsigned keyframe_interval, struct agx_store_blob *blob)
+{
+	const uint8_t *data = _data;
+	size_t nr_pages = (size + AGX_STORE_PAGE - 1) / AGX_STORE_PAGE;
+
+	/* A new or resized buffer starts from a keyframe */
+	bool fresh = !bo->pages || bo->size != size;
+
+	if (fresh) {
+		free(bo->pages);
+		bo->pages = calloc(nr_pages ? nr_pages : 1, sizeof(uint64_t));
+		bo->size = size;
+	}
+
+	uint32_t *changed = malloc((nr_pages ? nr_pages : 1) * sizeof(uint32_t));
+	unsigned nr_changed = 0;
+
+	for (size_t p = 0; p < nr_pages; ++p) {
+		size_t offset = p * AGX_STORE_PAGE;
+		uint64_t h = agx_hash64(data + offset, agx_store_page_size(size, p), 0);
+
+		if (fresh || h != bo->pages[p]) {
+			changed[nr_changed++] = p;
+			bo->pages[p] = h;
+		}
+	}
+
+	if (!fresh && !nr_changed) {
+		free(changed);
+		return false;
+	}
+
+	/* Once most of it changed, a delta would be no smaller */
+	bool keyframe = fresh || !keyframe_interval ||
+		bo->deltas >= keyframe_interval || 2 * nr_changed > nr_pages;
+
+	/* Pages can change under us, so they are checksummed again as copied,
+	 * to compare the next version against exactly what was stored */
+	if (keyframe) {
+		uint8_t *copy = malloc(size ? size : 1);
+		memcpy(copy, data, size);
+
+		for (size_t p = 0; p < nr_pages; ++p) {
+			size_t offset = p * AGX_STORE_PAGE;
+			bo->pages[p] = agx_hash64(copy + offset,
+					agx_store_page_size(size, p), 0);
+		}
+
+		*blob = (struct agx_store_blob) { copy, size, false };
+		bo->deltas = 0;
+		free(changed);
+		return true;
+	}
+
+	/* The base is only known once the version before is put */
+	struct agx_store_delta header = {
+		.magic = AGX_STORE_DELTA_MAGIC,
+		.size = size,
+		.page_size = AGX_STORE_PAGE,
+		.nr_pages = nr_changed,
+	};
+
+	size_t blob_size = sizeof(header) + nr_changed * sizeof(uint32_t) +
+		nr_changed * AGX_STORE_PAGE;
+	uint8_t *delta = malloc(blob_size);
+	uint8_t *out = delta + sizeof(header) + nr_changed * sizeof(uint32_t);
+
+	memcpy(delta, &header, sizeof(header));
+	memcpy(delta + sizeof(header), changed, nr_changed * sizeof(uint32_t));
+
+	for (unsigned i = 0; i < nr_changed; ++i) {
+		size_t offset = (size_t) changed[i] * AGX_STORE_PAGE;
+		size_t len = agx_store_page_size(size, changed[i]);
+
+		memcpy(out, data + offset, len);
+		bo->pages[changed[i]] = agx_hash64(out, len, 0);
+		out += len;
+	}
+
+	*blob = (struct agx_store_blob) { delta, out - delta, true };
+	bo->deltas++;
+	free(changed);
+	return true;
+}
+
+enum agx_store_status
+agx_store_put_blob(struct agx_store *store, struct agx_store_bo *bo,
+		struct agx_store_blob *blob)
+{
+	enum agx_store_status status = AGX_STORE_FAILED;
+
+	/* A delta to a version that never made it can't be rebuilt */
+	if (!blob->delta || !bo->failed) {
+		if (blob->delta) {
+			struct agx_store_delta header;
+			memcpy(&header, blob->data, sizeof(header));
+			header.base = bo->hash;
+			header.base_delta = bo->delta;
+			memcpy(blob->data, &header, sizeof(header));
+		}
+
+		struct agx_hash128 hash = agx_hash128(blob->data, blob->size);
+		status = agx_store_put(store, hash, blob->data, blob->size);
+
+		if (status != AGX_STORE_FAILED) {
+			bo->hash = hash;
+			bo->delta = blob->delta;
+		}
+	}
+
+	bo->failed = status == AGX_STORE_FAILED;
+	free(blob->data);
+	blob->data = NULL;
+	return status;
+}
+
+enum agx_store_status
+agx_store_put_bo(struct agx_store *store, struct agx_store_bo *bo,
+		const void *data, size_t size, unsigned keyframe_interval)
+{
+	struct agx_store_blob blob;
+
+	if (!agx_store_diff_bo(bo, data, size, keyframe_interval, &blob))
+		return AGX_STORE_EXISTS;
+
+	if (agx_store_put_blob(store, bo, &blob) != AGX_STORE_FAILED)
+		return AGX_STORE_STORED;
+
+	agx_store_bo_keyframe(bo);
+	return AGX_STORE_FAILED;
+}
+
+/* Reads the header of a delta blob, checking its indices are all there */
+
+static bool
+agx_store_delta_header(const uint8_t *blob, size_t blob_size,
+		struct agx_store_delta *header)
+{
+	if (blob_size < sizeof(*header))
+		return false;
+
+	memcpy(header, blob, sizeof(*header));
+
+	size_t pages_at = sizeof(*header) + (size_t) header->nr_pages * sizeof(uint32_t);
+	return !memcmp(header->magic, AGX_STORE_DELTA_MAGIC, 8) &&
+		header->page_size && pages_at <= blob_size;
+}
+
+/* Applies a delta blob to its rebuilt base */
+
+static bool
+agx_store_apply_delta(uint8_t *data, size_t size, const uint8_t *blob,
+		size_t blob_size)
+{
+	struct agx_store_delta header;
+	if (!agx_store_delta_header(blob, blob_size, &header) || header.size != size)
+		return false;
+
+	const uint8_t *in = blob + sizeof(header) + (size_t) header.nr_pages * sizeof(uint32_t);
+
+	for (unsigned i = 0; i < header.nr_pages; ++i) {
+		uint32_t page;
+		memcpy(&page, blob + sizeof(header) + i * sizeof(uint32_t), sizeof(page));
+
+		size_t offset = (size_t) page * header.page_size;
+		size_t len = offset < header.size ? header.size - offset : 0;
+		if (len > header.page_size)
+			len = header.page_size;
+
+		if (!len || len > (size_t) (blob + blob_size - in))
+			return false;
+
+		memcpy(data + offset, in, len);
+		in += len;
+	}
+
+	return true;
+}
+
+/* Deltas are followed back to the keyframe first, then applied forwards. No
+ * chain can be longer than the archive has blobs. */
+
+void *
+agx_store_get_bo(const struct agx_store *store, struct agx_hash128 hash,
+		bool delta, size_t *size)
+{
+	struct { uint8_t *data; size_t size; } *chain = NULL;
+	size_t nr_chain = 0, data_size = 0;
+	uint8_t *data = NULL;
+	bool ok = true;
+
+	while (ok && delta) {
+		struct agx_store_delta header;
+		size_t blob_size;
+		uint8_t *blob = agx_store_get(store, hash, &blob_size);
+
+		ok = blob && nr_chain < store->nr_entries &&
+			agx_store_delta_header(blob, blob_size, &header);
+
+		if (!ok) {
+			free(blob);
+			break;
+		}
+
+		if (!(nr_chain & (nr_chain - 1)))
+			chain = realloc(chain, (nr_chain ? 2 * nr_chain : 1) * sizeof(*chain));
+
+		chain[nr_chain].data = blob;
+		chain[nr_chain++].size = blob_size;
+		hash = header.base;
+		delta = header.base_delta;
+	}
+
+	if (ok)
+		data = agx_store_get(store, hash, &data_size);
+
+	for (size_t i = nr_chain; i-- > 0;) {
+		if (data && !agx_store_apply_delta(data, data_size, chain[i].data, chain[i].size)) {
+			free(data);
+			data = NULL;
+		}
+
+		free(chain[i].data);
+	}
+
+	free(chain);
+	*size = data ? data_size : 0;
+	return data;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_STORE_H
+#define __AGX_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "hash.h"
+
+/* Content-addressed blob store, for buffer contents captured over and over.
+ * Each distinct blob is kept once, keyed by its 128-bit hash and compressed
+ * with LZ4, in a single append-only archive: a header, the chunks, then an
+ * index of them written on close. An archive that was never closed, because
+ * the application crashed say, is read by walking its chunks instead. */
+
+#define AGX_STORE_MAGIC "AGXSTORE"
+#define AGX_STORE_INDEX_MAGIC "AGXINDEX"
+
+enum agx_store_codec {
+	AGX_STORE_RAW,
+	AGX_STORE_LZ4,
+};
+
+/* Each chunk is this header, then stored_size bytes padded to 8 */
+
+struct agx_store_chunk {
+	struct agx_hash128 hash;
+	uint64_t size, stored_size;
+	uint32_t codec, pad;
+};
+
+/* The index is an array of these, then the footer ending the file */
+
+struct agx_store_entry {
+	struct agx_hash128 hash;
+	uint64_t offset;
+};
+
+struct agx_store_footer {
+	uint64_t index_offset, count;
+	char magic[8];
+};
+
+struct agx_store {
+	int fd;
+	bool write;
+
+	/* The archive as mapped when opened for reading */
+	const uint8_t *map;
+	size_t map_size;
+
+	/* Where the next chunk goes, when writing */
+	uint64_t end;
+
+	/* Chunks by hash, open addressed, zero for empty */
+	struct agx_store_entry *entries;
+	size_t nr_entries, capacity;
+
+	struct {
+		uint64_t puts, blobs, bytes;
+	} stats;
+};
+
+/* Opens an archive to read, or to add to, creating it if needed. Returns NULL
+ * if it can't be used, or is already open for writing elsewhere. */
+
+struct agx_store *agx_store_open(const char *path, bool write);
+
+/* Reads an archive already in memory, which must outlive the store */
+
+struct agx_store *agx_store_open_memory(const void *data, size_t size);
+
+/* Writes the index when writing */
+
+void agx_store_close(struct agx_store *store);
+
+enum agx_store_status {
+	AGX_STORE_FAILED,
+	AGX_STORE_EXISTS,
+	AGX_STORE_STORED,
+};
+
+/* Stores a blob under its hash unless it already is. Nothing is remembered of
+ * a blob that failed to write, so it is written again next time. */
+
+enum agx_store_status agx_store_put(struct agx_store *store, struct agx_hash128 hash,
+		const void *data, size_t size);
+
+/* Reads a blob back from an archive opened for reading, or returns NULL if it
+ * isn't there or doesn't match its hash */
+
+void *agx_store_get(const struct agx_store *store, struct agx_hash128 hash,
+		size_t *size);
+
+/* A buffer stored again and again as it changes. Its pages are checksummed to
+ * tell what changed since the previous version. In full mode each version
+ * that changed is stored whole. In delta mode only the pages that changed are
+ * stored, as a delta blob against it, with a keyframe (the whole buffer) every
+ * keyframe_interval deltas so rebuilding any version stays cheap.
+ *
+ * Storing a version is two steps, which may be on different threads: diffing
+ * it where the buffer is, then putting the blob that makes in the archive.
+ * Each step uses its own half of struct agx_store_bo. */
+
+#define AGX_STORE_PAGE 4096
+
+struct agx_store_bo {
+	/* For diffing: checksums of the pages as copied, and deltas since the
+	 * keyframe */
+	uint64_t *pages;
+	size_t size;
+	unsigned deltas;
+
+	/* For putting: the version last stored, whether its blob is a delta,
+	 * and whether the version after it failed to store */
+	struct agx_hash128 hash;
+	bool delta, failed;
+};
+
+/* A version of a buffer to put: a copy of it whole, or a delta to the version
+ * diffed before it */
+
+struct agx_store_blob {
+	void *data;
+	size_t size;
+	bool delta;
+};
+
+/* Copies out what changed in a buffer as a blob, or 0 for keyframe_interval to
+ * always copy it whole. Returns false, with no blob, if nothing changed. */
+
+bool agx_store_diff_bo(struct agx_store_bo *bo, const void *data, size_t size,
+		unsigned keyframe_interval, struct agx_store_blob *blob);
+
+/* Puts blobs from agx_store_diff_bo in the order they were diffed, linking
+ * each delta to the version before, and frees them. Once one fails, bo->failed
+ * is set and the deltas after it fail too, since they can't be rebuilt, until
+ * agx_store_bo_keyframe makes the next version whole. */
+
+enum agx_store_status agx_store_put_blob(struct agx_store *store,
+		struct agx_store_bo *bo, struct agx_store_blob *blob);
+
+void agx_store_bo_keyframe(struct agx_store_bo *bo);
+
+/* Diffs and puts at once. Returns AGX_STORE_EXISTS if the contents are
+ * unchanged, and AGX_STORE_STORED if they changed and are now in the archive.
+ * On failure, bo still names the previous version, and the next put is a
+ * keyframe. */
+
+enum agx_store_status agx_store_put_bo(struct agx_store *store, struct agx_store_bo *bo,
+		const void *data, size_t size, unsigned keyframe_interval);
+
+void agx_store_bo_fini(struct agx_store_bo *bo);
+
+/* Delta blobs are this header, nr_pages 32-bit page indices, then the pages,
+ * the last of which may be partial */
+
+#define AGX_STORE_DELTA_MAGIC "AGXDELTA"
+
+struct agx_store_delta {
+	char magic[8];
+	struct agx_hash128 base;
+	uint64_t size;
+	uint32_t page_size, nr_pages;
+
+	/* Whether base is itself a delta */
+	uint32_t base_delta, pad;
+};
+
+/* Rebuilds a version of a buffer from its blob, following deltas back to the
+ * keyframe. Returns NULL if anything is missing or inconsistent. */
+
+void *agx_store_get_bo(const struct agx_store *store, struct agx_hash128 hash,
+		bool delta, size_t *size);
+
+#endif
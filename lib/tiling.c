@@ -24,7 +24,19 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "tiling.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 /* Z-order with 64x64 tiles:
  *
@@ -59,6 +71,10 @@
 /* mask of bits used for X coordinate in a tile */
 #define SPACE_MASK 0x555 // 0b010101010101
 
+/* X bits above x1 (resp. x2), for stepping 4 (resp. 8) pixels at a time */
+#define SPACE_MASK_4 0x550 // 0b010101010000
+#define SPACE_MASK_8 0x540 // 0b010101000000
+
 #define MAX2(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN2(x, y) (((x) < (y)) ? (x) : (y))
 
@@ -70,103 +86,1156 @@ ash_space_bits(unsigned x)
 		((x & 8) << 3) | ((x & 16) << 4) | ((x & 32) << 5);
 }
 
-static void
-ash_detile_unaligned_32(uint32_t *tiled, uint32_t *linear,
+/* 128-bit texels are only ever copied around, never interpreted */
+typedef struct {
+	uint64_t lo, hi;
+} ash_uint128_t;
+
+/* The tiled and linear pointers point to the start of the tiled image and the
+ * texel (sx, sy) in the linear image respectively. Pitch is in texels. */
+
+typedef void (*ash_tiling_fn)(void *tiled, void *linear,
 		unsigned width, unsigned linear_pitch,
-		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+/* The scalar kernels are generated per tiled texel type T of 2^shift bytes,
+ * with the shift folded into the masks so the offsets are in bytes and the
+ * inner loops don't shift at all. COPY moves one texel between tiled_texel and
+ * linear_texel (of type L, normally T), which direction determines whether we
+ * tile or detile.
+ *
+ * The Y bits are interleaved with X, so Y is incremented with the same trick
+ * using the mask shifted by one.
+ */
+
+#define X_MASK(shift) (SPACE_MASK << (shift))
+#define Y_MASK(shift) (SPACE_MASK << ((shift) + 1))
+#define TILE_BYTES_SHIFT(shift) ((2 * TILE_SHIFT) + (shift))
+
+#define ASH_UNALIGNED(name, T, L, shift, COPY) \
+static void \
+name(void *tiled, void *linear, \
+		unsigned width, unsigned linear_pitch, \
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy) \
+{ \
+	unsigned tiles_per_row = (width + TILE_WIDTH - 1) >> TILE_SHIFT; \
+	unsigned y_offs = ash_space_bits(sy & TILE_MASK) << ((shift) + 1); \
+	unsigned x_offs_start = ash_space_bits(sx & TILE_MASK) << (shift); \
+	L *linear_row = linear; \
+\
+	for (unsigned y = sy; y < smaxy; ++y) { \
+		unsigned tile_y = (y >> TILE_SHIFT); \
+		unsigned tile_row = tile_y * tiles_per_row; \
+		unsigned x_offs = x_offs_start; \
+		L *linear_texel = linear_row; \
+\
+		for (unsigned x = sx; x < smaxx; ++x) { \
+			unsigned tile_x = (x >> TILE_SHIFT); \
+			size_t tile_idx = (tile_row + tile_x); \
+			uint8_t *tile = ((uint8_t *) tiled) + \
+				(tile_idx << TILE_BYTES_SHIFT(shift)); \
+			T *tiled_texel = (T *) (tile + y_offs + x_offs); \
+\
+			COPY; \
+			linear_texel++; \
+			x_offs = (x_offs - X_MASK(shift)) & X_MASK(shift); \
+		} \
+\
+		y_offs = (y_offs - Y_MASK(shift)) & Y_MASK(shift); \
+		linear_row += linear_pitch; \
+	} \
+}
+
+/* Assumes sx, smaxx are both aligned to TILE_WIDTH */
+#define ASH_ALIGNED(name, T, L, shift, COPY) \
+static void \
+name(void *tiled, void *linear, \
+		unsigned width, unsigned linear_pitch, \
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy) \
+{ \
+	unsigned tiles_per_row = (width + TILE_WIDTH - 1) >> TILE_SHIFT; \
+	unsigned y_offs = ash_space_bits(sy & TILE_MASK) << ((shift) + 1); \
+	L *linear_row = linear; \
+\
+	for (unsigned y = sy; y < smaxy; ++y) { \
+		unsigned tile_y = (y >> TILE_SHIFT); \
+		unsigned tile_row = tile_y * tiles_per_row; \
+		unsigned x_offs = 0; \
+		L *linear_texel = linear_row; \
+\
+		for (unsigned x = sx; x < smaxx; x += TILE_WIDTH) { \
+			unsigned tile_x = (x >> TILE_SHIFT); \
+			size_t tile_idx = (tile_row + tile_x); \
+			uint8_t *tile = ((uint8_t *) tiled) + \
+				(tile_idx << TILE_BYTES_SHIFT(shift)) + y_offs; \
+\
+			for (unsigned j = 0; j < TILE_WIDTH; ++j) { \
+				T *tiled_texel = (T *) (tile + x_offs); \
+\
+				COPY; \
+				linear_texel++; \
+				x_offs = (x_offs - X_MASK(shift)) & X_MASK(shift); \
+			} \
+		} \
+\
+		y_offs = (y_offs - Y_MASK(shift)) & Y_MASK(shift); \
+		linear_row += linear_pitch; \
+	} \
+}
+
+#define ASH_DETILE_COPY (*linear_texel = *tiled_texel)
+#define ASH_TILE_COPY (*tiled_texel = *linear_texel)
+
+/* Tiled-to-tiled copy of a w x h rectangle, texel by texel, walking the
+ * Morton offsets of both surfaces at once. Used for ragged edges and when the
+ * rectangles sit at different positions within their tiles. */
+
+typedef void (*ash_copy_fn)(void *dst, unsigned dst_width,
+		unsigned dx, unsigned dy,
+		void *src, unsigned src_width,
+		unsigned sx, unsigned sy, unsigned w, unsigned h);
+
+#define ASH_COPY(name, T, shift) \
+static void \
+name(void *dst, unsigned dst_width, unsigned dx, unsigned dy, \
+		void *src, unsigned src_width, \
+		unsigned sx, unsigned sy, unsigned w, unsigned h) \
+{ \
+	unsigned src_tiles_per_row = (src_width + TILE_WIDTH - 1) >> TILE_SHIFT; \
+	unsigned dst_tiles_per_row = (dst_width + TILE_WIDTH - 1) >> TILE_SHIFT; \
+	unsigned src_y_offs = ash_space_bits(sy & TILE_MASK) << ((shift) + 1); \
+	unsigned dst_y_offs = ash_space_bits(dy & TILE_MASK) << ((shift) + 1); \
+	unsigned src_x_start = ash_space_bits(sx & TILE_MASK) << (shift); \
+	unsigned dst_x_start = ash_space_bits(dx & TILE_MASK) << (shift); \
+\
+	for (unsigned j = 0; j < h; ++j) { \
+		unsigned src_row = ((sy + j) >> TILE_SHIFT) * src_tiles_per_row; \
+		unsigned dst_row = ((dy + j) >> TILE_SHIFT) * dst_tiles_per_row; \
+		unsigned src_x_offs = src_x_start; \
+		unsigned dst_x_offs = dst_x_start; \
+\
+		for (unsigned i = 0; i < w; ++i) { \
+			size_t src_tile = src_row + ((sx + i) >> TILE_SHIFT); \
+			size_t dst_tile = dst_row + ((dx + i) >> TILE_SHIFT); \
+			uint8_t *in = ((uint8_t *) src) + \
+				(src_tile << TILE_BYTES_SHIFT(shift)); \
+			uint8_t *out = ((uint8_t *) dst) + \
+				(dst_tile << TILE_BYTES_SHIFT(shift)); \
+\
+			*((T *) (out + dst_y_offs + dst_x_offs)) = \
+				*((T *) (in + src_y_offs + src_x_offs)); \
+\
+			src_x_offs = (src_x_offs - X_MASK(shift)) & X_MASK(shift); \
+			dst_x_offs = (dst_x_offs - X_MASK(shift)) & X_MASK(shift); \
+		} \
+\
+		src_y_offs = (src_y_offs - Y_MASK(shift)) & Y_MASK(shift); \
+		dst_y_offs = (dst_y_offs - Y_MASK(shift)) & Y_MASK(shift); \
+	} \
+}
+
+#define ASH_KERNELS(bpp, T, shift) \
+	ASH_UNALIGNED(ash_detile_unaligned_##bpp, T, T, shift, ASH_DETILE_COPY) \
+	ASH_ALIGNED(ash_detile_aligned_##bpp, T, T, shift, ASH_DETILE_COPY) \
+	ASH_UNALIGNED(ash_tile_unaligned_##bpp, T, T, shift, ASH_TILE_COPY) \
+	ASH_ALIGNED(ash_tile_aligned_##bpp, T, T, shift, ASH_TILE_COPY) \
+	ASH_COPY(ash_copy_tiled_##bpp, T, shift)
+
+ASH_KERNELS(8, uint8_t, 0)
+ASH_KERNELS(16, uint16_t, 1)
+ASH_KERNELS(32, uint32_t, 2)
+ASH_KERNELS(64, uint64_t, 3)
+ASH_KERNELS(128, ash_uint128_t, 4)
+
+/* Fused detile and format conversion, so presenting a frame in another format
+ * reads and writes it exactly once. Formats are in memory byte order, so RGBA8
+ * is R in the low byte of a little-endian word. */
+
+static inline uint32_t
+ash_swap_rb(uint32_t x)
 {
-	unsigned tiles_per_row = (width + TILE_WIDTH - 1) >> TILE_SHIFT;
-	unsigned y_offs = ash_space_bits(sy & TILE_MASK);
-	unsigned x_offs_start = ash_space_bits(sx & TILE_MASK);
-
-	for (unsigned y = sy; y < smaxy; ++y) {
-		unsigned tile_y = (y >> TILE_SHIFT);
-		unsigned tile_row = tile_y * tiles_per_row;
-		unsigned x_offs = x_offs_start;
-
-		uint32_t *linear_row = linear;
-		
-		for (unsigned x = sx; x < smaxx; ++x) {
-			unsigned tile_x = (x >> TILE_SHIFT);
-			unsigned tile_idx = (tile_row + tile_x);
-			unsigned tile_base = tile_idx * (TILE_WIDTH * TILE_HEIGHT);
-
-			*(linear_row++) = tiled[tile_base + y_offs + x_offs];
-			x_offs = (x_offs - SPACE_MASK) & SPACE_MASK;
+	return (x & 0xFF00FF00) | ((x >> 16) & 0xFF) | ((x & 0xFF) << 16);
+}
+
+static inline uint16_t
+ash_rgba8_to_rgb565(uint32_t x)
+{
+	uint32_t r = (x >> 0) & 0xFF, g = (x >> 8) & 0xFF, b = (x >> 16) & 0xFF;
+	return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+/* Clamping half to UNORM8. Negative, NaN and anything rounding to zero are 0,
+ * 1.0 and above (including infinity) are 255 */
+
+static inline uint32_t
+ash_half_to_unorm8(uint16_t h)
+{
+	unsigned exp = (h >> 10) & 0x1F;
+
+	if ((h & 0x8000) || exp == 0 || h > 0x7C00)
+		return 0;
+	else if (h >= 0x3C00)
+		return 255;
+
+	uint32_t bits = ((exp - 15 + 127) << 23) | ((h & 0x3FF) << 13);
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+
+	return (uint32_t) ((f * 255.0f) + 0.5f);
+}
+
+static inline uint32_t
+ash_rgba16f_to_rgba8(uint64_t x)
+{
+	return (ash_half_to_unorm8(x >> 0) << 0) |
+		(ash_half_to_unorm8(x >> 16) << 8) |
+		(ash_half_to_unorm8(x >> 32) << 16) |
+		(ash_half_to_unorm8(x >> 48) << 24);
+}
+
+#define ASH_CONVERT_KERNELS(conv, T, L, shift, fn) \
+	ASH_UNALIGNED(ash_detile_unaligned_##conv, T, L, shift, \
+			*linear_texel = fn(*tiled_texel)) \
+	ASH_ALIGNED(ash_detile_aligned_##conv, T, L, shift, \
+			*linear_texel = fn(*tiled_texel))
+
+ASH_CONVERT_KERNELS(swap_rb, uint32_t, uint32_t, 2, ash_swap_rb)
+ASH_CONVERT_KERNELS(rgb565, uint32_t, uint16_t, 2, ash_rgba8_to_rgb565)
+ASH_CONVERT_KERNELS(rgba16f, uint64_t, uint32_t, 3, ash_rgba16f_to_rgba8)
+
+/* Vectorized variants of the aligned 32bpp kernels. The scalar versions above
+ * are the reference, these must produce byte-identical output.
+ *
+ * Within a tile, the low bits of the offset are [x2][y1][x1][y0][x0], so the
+ * 8 texels at offsets 0..7 are the 4x2 block covering x0..x3 of rows y and
+ * y + 1 (for even y), laid out as
+ *
+ * 	(0, 0) (1, 0) (0, 1) (1, 1) (2, 0) (3, 0) (2, 1) (3, 1)
+ *
+ * Treating each X pair as a single 64-bit element, a pair of rows is a simple
+ * two-way interleave of 64-bit elements, which every SIMD ISA can do or undo
+ * with a shuffle. So we (de)tile two rows at a time, stepping X with the masks
+ * above, and fall back on the scalar path for an unpaired first or last row.
+ * The body moves `step` texels between `tile_ptr` and `row0`/`row1`.
+ */
+
+#define ASH_ROW_PAIRS(name, scalar, step, mask, attrs, ...) \
+static attrs void \
+name(void *tiled, void *linear_start, \
+		unsigned width, unsigned linear_pitch, \
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy) \
+{ \
+	unsigned tiles_per_row = (width + TILE_WIDTH - 1) >> TILE_SHIFT; \
+	uint32_t *linear = linear_start; \
+\
+	if ((sy & 1) && sy < smaxy) { \
+		scalar(tiled, linear, width, linear_pitch, \
+				sx, sy, smaxx, sy + 1); \
+		linear += linear_pitch; \
+		++sy; \
+	} \
+\
+	if (sy < smaxy && ((smaxy - sy) & 1)) { \
+		--smaxy; \
+		scalar(tiled, linear + (smaxy - sy) * linear_pitch, \
+				width, linear_pitch, sx, smaxy, smaxx, smaxy + 1); \
+	} \
+\
+	unsigned y_offs = ash_space_bits(sy & TILE_MASK) << 1; \
+\
+	for (unsigned y = sy; y < smaxy; y += 2) { \
+		unsigned tile_row = (y >> TILE_SHIFT) * tiles_per_row; \
+		uint32_t *row0 = linear; \
+		uint32_t *row1 = linear + linear_pitch; \
+\
+		for (unsigned x = sx; x < smaxx; x += TILE_WIDTH) { \
+			size_t tile_idx = (tile_row + (x >> TILE_SHIFT)); \
+			size_t tile_base = tile_idx * (TILE_WIDTH * TILE_HEIGHT); \
+			uint8_t *tile = (uint8_t *) (((uint32_t *) tiled) + tile_base + y_offs); \
+			unsigned x_offs = 0; \
+\
+			for (unsigned j = 0; j < TILE_WIDTH; j += step) { \
+				uint8_t *tile_ptr = tile + x_offs; \
+				__VA_ARGS__ \
+				row0 += step; \
+				row1 += step; \
+				x_offs = (x_offs - (mask << 2)) & (mask << 2); \
+			} \
+		} \
+\
+		/* Two increments of y, rows are paired so y0 is always 0 */ \
+		y_offs = (((y_offs >> 1) - SPACE_MASK) & SPACE_MASK) << 1; \
+		y_offs = (((y_offs >> 1) - SPACE_MASK) & SPACE_MASK) << 1; \
+		linear += 2 * linear_pitch; \
+	} \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+ASH_ROW_PAIRS(ash_detile_aligned_32_sse2, ash_detile_aligned_32,
+		4, SPACE_MASK_4, __attribute__((target("sse2"))), {
+	__m128i lo = _mm_loadu_si128((__m128i *) tile_ptr);
+	__m128i hi = _mm_loadu_si128((__m128i *) (tile_ptr + 16));
+
+	_mm_storeu_si128((__m128i *) row0, _mm_unpacklo_epi64(lo, hi));
+	_mm_storeu_si128((__m128i *) row1, _mm_unpackhi_epi64(lo, hi));
+})
+
+ASH_ROW_PAIRS(ash_tile_aligned_32_sse2, ash_tile_aligned_32,
+		4, SPACE_MASK_4, __attribute__((target("sse2"))), {
+	__m128i r0 = _mm_loadu_si128((__m128i *) row0);
+	__m128i r1 = _mm_loadu_si128((__m128i *) row1);
+
+	_mm_storeu_si128((__m128i *) tile_ptr, _mm_unpacklo_epi64(r0, r1));
+	_mm_storeu_si128((__m128i *) (tile_ptr + 16), _mm_unpackhi_epi64(r0, r1));
+})
+
+/* Each 256-bit load is a 4x2 block. Permuting 64-bit lanes as 0, 2, 1, 3
+ * puts row y in the low half and row y + 1 in the high half, then the two
+ * blocks are recombined across 128-bit lanes to get 8 texels of each row */
+
+ASH_ROW_PAIRS(ash_detile_aligned_32_avx2, ash_detile_aligned_32,
+		8, SPACE_MASK_8, __attribute__((target("avx2"))), {
+	__m256i a = _mm256_loadu_si256((__m256i *) tile_ptr);
+	__m256i b = _mm256_loadu_si256((__m256i *) (tile_ptr + 64));
+
+	a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(3, 1, 2, 0));
+
+	_mm256_storeu_si256((__m256i *) row0, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *) row1, _mm256_permute2x128_si256(a, b, 0x31));
+})
+
+/* Going the other way, interleaving within 128-bit lanes gives the 4x2
+ * blocks split across lanes, so gather the halves back together */
+
+ASH_ROW_PAIRS(ash_tile_aligned_32_avx2, ash_tile_aligned_32,
+		8, SPACE_MASK_8, __attribute__((target("avx2"))), {
+	__m256i r0 = _mm256_loadu_si256((__m256i *) row0);
+	__m256i r1 = _mm256_loadu_si256((__m256i *) row1);
+
+	__m256i lo = _mm256_unpacklo_epi64(r0, r1);
+	__m256i hi = _mm256_unpackhi_epi64(r0, r1);
+
+	_mm256_storeu_si256((__m256i *) tile_ptr, _mm256_permute2x128_si256(lo, hi, 0x20));
+	_mm256_storeu_si256((__m256i *) (tile_ptr + 64), _mm256_permute2x128_si256(lo, hi, 0x31));
+})
+
+/* Non-temporal variant for ash_detile_streaming, requires row0/row1 to be
+ * 16-byte aligned (and ought to be cache line aligned) */
+
+ASH_ROW_PAIRS(ash_detile_aligned_32_sse2_nt, ash_detile_aligned_32,
+		4, SPACE_MASK_4, __attribute__((target("sse2"))), {
+	__m128i lo = _mm_loadu_si128((__m128i *) tile_ptr);
+	__m128i hi = _mm_loadu_si128((__m128i *) (tile_ptr + 16));
+
+	_mm_stream_si128((__m128i *) row0, _mm_unpacklo_epi64(lo, hi));
+	_mm_stream_si128((__m128i *) row1, _mm_unpackhi_epi64(lo, hi));
+})
+
+/* Fused detile and R/B swap. With R and B isolated as 0x00BB00RR, shifting
+ * by 16 each way swaps them */
+
+static inline __attribute__((target("sse2"))) __m128i
+ash_swap_rb_sse2(__m128i x)
+{
+	__m128i ag = _mm_and_si128(x, _mm_set1_epi32(0xFF00FF00));
+	__m128i rb = _mm_and_si128(x, _mm_set1_epi32(0x00FF00FF));
+
+	return _mm_or_si128(ag, _mm_or_si128(_mm_slli_epi32(rb, 16),
+				_mm_srli_epi32(rb, 16)));
+}
+
+ASH_ROW_PAIRS(ash_detile_aligned_swap_rb_sse2, ash_detile_aligned_swap_rb,
+		4, SPACE_MASK_4, __attribute__((target("sse2"))), {
+	__m128i lo = _mm_loadu_si128((__m128i *) tile_ptr);
+	__m128i hi = _mm_loadu_si128((__m128i *) (tile_ptr + 16));
+
+	_mm_storeu_si128((__m128i *) row0, ash_swap_rb_sse2(_mm_unpacklo_epi64(lo, hi)));
+	_mm_storeu_si128((__m128i *) row1, ash_swap_rb_sse2(_mm_unpackhi_epi64(lo, hi)));
+})
+
+static inline __attribute__((target("avx2"))) __m256i
+ash_swap_rb_avx2(__m256i x)
+{
+	const __m256i shuffle = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+	return _mm256_shuffle_epi8(x, shuffle);
+}
+
+ASH_ROW_PAIRS(ash_detile_aligned_swap_rb_avx2, ash_detile_aligned_swap_rb,
+		8, SPACE_MASK_8, __attribute__((target("avx2"))), {
+	__m256i a = _mm256_loadu_si256((__m256i *) tile_ptr);
+	__m256i b = _mm256_loadu_si256((__m256i *) (tile_ptr + 64));
+
+	a = _mm256_permute4x64_epi64(ash_swap_rb_avx2(a), _MM_SHUFFLE(3, 1, 2, 0));
+	b = _mm256_permute4x64_epi64(ash_swap_rb_avx2(b), _MM_SHUFFLE(3, 1, 2, 0));
+
+	_mm256_storeu_si256((__m256i *) row0, _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *) row1, _mm256_permute2x128_si256(a, b, 0x31));
+})
+
+/* MOVNTDQA is the one way to read write-combined memory at full speed */
+
+static __attribute__((target("sse4.1"))) void
+ash_stream_copy_sse41(void *dst, void *src, size_t bytes)
+{
+	if (((uintptr_t) dst | (uintptr_t) src | bytes) & 15) {
+		memcpy(dst, src, bytes);
+		return;
+	}
+
+	__m128i *in = src, *out = dst;
+	size_t count = bytes / 16, i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i a = _mm_stream_load_si128(in + i + 0);
+		__m128i b = _mm_stream_load_si128(in + i + 1);
+		__m128i c = _mm_stream_load_si128(in + i + 2);
+		__m128i d = _mm_stream_load_si128(in + i + 3);
+
+		_mm_store_si128(out + i + 0, a);
+		_mm_store_si128(out + i + 1, b);
+		_mm_store_si128(out + i + 2, c);
+		_mm_store_si128(out + i + 3, d);
+	}
+
+	/* Sizes that aren't a multiple of 64 bytes */
+	for (; i < count; ++i)
+		_mm_store_si128(out + i, _mm_stream_load_si128(in + i));
+}
+
+#elif defined(__aarch64__)
+
+/* ld2/st2 on 64-bit elements are exactly the (de)interleave we need */
+
+ASH_ROW_PAIRS(ash_detile_aligned_32_neon, ash_detile_aligned_32,
+		4, SPACE_MASK_4, , {
+	uint64x2x2_t v = vld2q_u64((const uint64_t *) tile_ptr);
+
+	vst1q_u32(row0, vreinterpretq_u32_u64(v.val[0]));
+	vst1q_u32(row1, vreinterpretq_u32_u64(v.val[1]));
+})
+
+ASH_ROW_PAIRS(ash_tile_aligned_32_neon, ash_tile_aligned_32,
+		4, SPACE_MASK_4, , {
+	uint64x2x2_t v = {{
+		vreinterpretq_u64_u32(vld1q_u32(row0)),
+		vreinterpretq_u64_u32(vld1q_u32(row1)),
+	}};
+
+	vst2q_u64((uint64_t *) tile_ptr, v);
+})
+
+static inline uint32x4_t
+ash_swap_rb_neon(uint64x2_t x)
+{
+	static const uint8_t shuffle[16] = {
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+	};
+
+	return vreinterpretq_u32_u8(vqtbl1q_u8(vreinterpretq_u8_u64(x),
+				vld1q_u8(shuffle)));
+}
+
+ASH_ROW_PAIRS(ash_detile_aligned_swap_rb_neon, ash_detile_aligned_swap_rb,
+		4, SPACE_MASK_4, , {
+	uint64x2x2_t v = vld2q_u64((const uint64_t *) tile_ptr);
+
+	vst1q_u32(row0, ash_swap_rb_neon(v.val[0]));
+	vst1q_u32(row1, ash_swap_rb_neon(v.val[1]));
+})
+
+/* STNP through the compiler, where it knows how */
+
+#ifdef __has_builtin
+#if __has_builtin(__builtin_nontemporal_store)
+
+ASH_ROW_PAIRS(ash_detile_aligned_32_neon_nt, ash_detile_aligned_32,
+		4, SPACE_MASK_4, , {
+	uint64x2x2_t v = vld2q_u64((const uint64_t *) tile_ptr);
+
+	__builtin_nontemporal_store(vreinterpretq_u32_u64(v.val[0]), (uint32x4_t *) row0);
+	__builtin_nontemporal_store(vreinterpretq_u32_u64(v.val[1]), (uint32x4_t *) row1);
+})
+
+#define ASH_HAS_NEON_NT 1
+#endif
+#endif
+
+#endif
+
+/* Kernels for each texel size, indexed by bits per texel / 8 */
+
+struct ash_tiling_kernels {
+	unsigned cpp;
+	ash_tiling_fn detile_unaligned, detile_aligned;
+	ash_tiling_fn tile_unaligned, tile_aligned;
+	ash_copy_fn copy_tiled;
+
+	/* Optional, detile_aligned with non-temporal stores to a cache line
+	 * aligned destination */
+	ash_tiling_fn detile_aligned_nt;
+};
+
+#define ASH_KERNEL_ENTRY(bpp) \
+	[(bpp) / 8] = { \
+		.cpp = (bpp) / 8, \
+		.detile_unaligned = ash_detile_unaligned_##bpp, \
+		.detile_aligned = ash_detile_aligned_##bpp, \
+		.tile_unaligned = ash_tile_unaligned_##bpp, \
+		.tile_aligned = ash_tile_aligned_##bpp, \
+		.copy_tiled = ash_copy_tiled_##bpp, \
+	}
+
+static struct ash_tiling_kernels ash_kernels[(128 / 8) + 1] = {
+	ASH_KERNEL_ENTRY(8),
+	ASH_KERNEL_ENTRY(16),
+	ASH_KERNEL_ENTRY(32),
+	ASH_KERNEL_ENTRY(64),
+	ASH_KERNEL_ENTRY(128),
+};
+
+static pthread_once_t ash_kernels_once = PTHREAD_ONCE_INIT;
+
+/* Detile-and-convert kernels, indexed by enum ash_conversion */
+
+struct ash_conversion_kernels {
+	unsigned tiled_bpp, cpp;
+	ash_tiling_fn unaligned, aligned;
+};
+
+static struct ash_conversion_kernels ash_conversions[ASH_NUM_CONVERSIONS] = {
+	[ASH_CONVERT_SWAP_RB] = {
+		32, 4,
+		ash_detile_unaligned_swap_rb, ash_detile_aligned_swap_rb
+	},
+	[ASH_CONVERT_RGBA8_TO_RGB565] = {
+		32, 2,
+		ash_detile_unaligned_rgb565, ash_detile_aligned_rgb565
+	},
+	[ASH_CONVERT_RGBA16F_TO_RGBA8] = {
+		64, 4,
+		ash_detile_unaligned_rgba16f, ash_detile_aligned_rgba16f
+	},
+};
+
+/* Reads a tile out of (possibly write-combined) memory into a cached buffer */
+
+typedef void (*ash_stream_copy_fn)(void *dst, void *src, size_t bytes);
+
+static void
+ash_stream_copy_memcpy(void *dst, void *src, size_t bytes)
+{
+	memcpy(dst, src, bytes);
+}
+
+static ash_stream_copy_fn ash_stream_copy = ash_stream_copy_memcpy;
+
+/* Swap in the best 32bpp kernels for the CPU we're running on. Set
+ * ASAHI_NO_SIMD to force the scalar reference, e.g. for comparisons */
+
+static void
+ash_select_kernels(void)
+{
+	struct ash_tiling_kernels *k = &ash_kernels[32 / 8];
+	struct ash_conversion_kernels *swap_rb = &ash_conversions[ASH_CONVERT_SWAP_RB];
+
+	if (getenv("ASAHI_NO_SIMD") == NULL) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_cpu_init();
+
+		if (__builtin_cpu_supports("avx2")) {
+			k->detile_aligned = ash_detile_aligned_32_avx2;
+			k->tile_aligned = ash_tile_aligned_32_avx2;
+			swap_rb->aligned = ash_detile_aligned_swap_rb_avx2;
+		} else if (__builtin_cpu_supports("sse2")) {
+			k->detile_aligned = ash_detile_aligned_32_sse2;
+			k->tile_aligned = ash_tile_aligned_32_sse2;
+			swap_rb->aligned = ash_detile_aligned_swap_rb_sse2;
 		}
 
-		y_offs = (((y_offs >> 1) - SPACE_MASK) & SPACE_MASK) << 1;
-		linear += linear_pitch;
+		if (__builtin_cpu_supports("sse2"))
+			k->detile_aligned_nt = ash_detile_aligned_32_sse2_nt;
+
+		if (__builtin_cpu_supports("sse4.1"))
+			ash_stream_copy = ash_stream_copy_sse41;
+#elif defined(__aarch64__)
+		k->detile_aligned = ash_detile_aligned_32_neon;
+		k->tile_aligned = ash_tile_aligned_32_neon;
+		swap_rb->aligned = ash_detile_aligned_swap_rb_neon;
+#ifdef ASH_HAS_NEON_NT
+		k->detile_aligned_nt = ash_detile_aligned_32_neon_nt;
+#endif
+#endif
 	}
 }
 
-/* Assumes sx, smaxx are both aligned to TILE_WIDTH */
+static const struct ash_tiling_kernels *
+ash_get_kernels(unsigned bpp)
+{
+	assert((bpp & 7) == 0 && (bpp / 8) <= (128 / 8));
+	assert(ash_kernels[bpp / 8].cpp && "unsupported bpp");
+
+	pthread_once(&ash_kernels_once, ash_select_kernels);
+
+	return &ash_kernels[bpp / 8];
+}
+
+/* Split a sub-rectangle into an aligned interior handled by the fast kernel
+ * and unaligned left/right edges, handled texel-by-texel */
+
 static void
-ash_detile_aligned_32(uint32_t *tiled, uint32_t *linear,
+ash_split(ash_tiling_fn unaligned, ash_tiling_fn aligned, unsigned cpp,
+		void *tiled, void *linear,
 		unsigned width, unsigned linear_pitch,
 		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
 {
+	uint8_t *linear_bytes = linear;
+	unsigned ax = (sx + TILE_MASK) & ~TILE_MASK;
+	unsigned amaxx = smaxx & ~TILE_MASK;
+
+	/* Doesn't span a whole tile column */
+	if (ax >= amaxx) {
+		unaligned(tiled, linear, width, linear_pitch,
+				sx, sy, smaxx, smaxy);
+		return;
+	}
+
+	if (sx < ax) {
+		unaligned(tiled, linear, width, linear_pitch,
+				sx, sy, ax, smaxy);
+	}
+
+	if (smaxx > amaxx) {
+		unaligned(tiled, linear_bytes + (amaxx - sx) * cpp,
+				width, linear_pitch, amaxx, sy, smaxx, smaxy);
+	}
+
+	aligned(tiled, linear_bytes + (ax - sx) * cpp, width, linear_pitch,
+			ax, sy, amaxx, smaxy);
+}
+
+void
+ash_detile(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	const struct ash_tiling_kernels *k = ash_get_kernels(bpp);
+
+	ash_split(k->detile_unaligned, k->detile_aligned, k->cpp,
+			tiled, linear, width, linear_pitch,
+			sx, sy, smaxx, smaxy);
+}
+
+void
+ash_tile(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	const struct ash_tiling_kernels *k = ash_get_kernels(bpp);
+
+	ash_split(k->tile_unaligned, k->tile_aligned, k->cpp,
+			tiled, linear, width, linear_pitch,
+			sx, sy, smaxx, smaxy);
+}
+
+/* Whole mip levels of a tiled surface in a BO laid out by ash_layout */
+
+void
+ash_detile_surface(const struct ash_layout *layout, void *bo, void *linear,
+		unsigned linear_pitch, unsigned level, unsigned layer)
+{
+	const struct ash_level *l = &layout->level[level];
+	assert(layout->tiled);
+
+	ash_detile((uint8_t *) bo + ash_layout_offset(layout, level, layer),
+			linear, l->width, layout->bpp, linear_pitch,
+			0, 0, l->width, l->height);
+}
+
+void
+ash_tile_surface(const struct ash_layout *layout, void *bo, void *linear,
+		unsigned linear_pitch, unsigned level, unsigned layer)
+{
+	const struct ash_level *l = &layout->level[level];
+	assert(layout->tiled);
+
+	ash_tile((uint8_t *) bo + ash_layout_offset(layout, level, layer),
+			linear, l->width, layout->bpp, linear_pitch,
+			0, 0, l->width, l->height);
+}
+
+void
+ash_detile_convert(void *tiled, void *linear,
+		unsigned width, enum ash_conversion conversion,
+		unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	assert(conversion < ASH_NUM_CONVERSIONS);
+
+	pthread_once(&ash_kernels_once, ash_select_kernels);
+
+	const struct ash_conversion_kernels *k = &ash_conversions[conversion];
+
+	ash_split(k->unaligned, k->aligned, k->cpp,
+			tiled, linear, width, linear_pitch,
+			sx, sy, smaxx, smaxy);
+}
+
+/* Tile-major detiling for sources in write-combined memory, where reads are
+ * uncached and the scanline order of ash_detile would stream every tile once
+ * per row. Instead each tile is read exactly once, front to back, into a
+ * cached staging buffer (with streaming loads where available), detiled from
+ * there and written out with non-temporal stores so the linear image doesn't
+ * evict the staging tile. */
+
+void
+ash_detile_streaming(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	const struct ash_tiling_kernels *k = ash_get_kernels(bpp);
+
+	if (sx >= smaxx || sy >= smaxy)
+		return;
+
 	unsigned tiles_per_row = (width + TILE_WIDTH - 1) >> TILE_SHIFT;
-	unsigned y_offs = 0;
-
-	for (unsigned y = sy; y < smaxy; ++y) {
-		unsigned tile_y = (y >> TILE_SHIFT);
-		unsigned tile_row = tile_y * tiles_per_row;
-		unsigned x_offs = 0;
-
-		uint32_t *linear_row = linear;
-		
-		for (unsigned x = sx; x < smaxx; x += TILE_WIDTH) {
-			unsigned tile_x = (x >> TILE_SHIFT);
-			unsigned tile_idx = (tile_row + tile_x);
-			unsigned tile_base = tile_idx * (TILE_WIDTH * TILE_HEIGHT);
-			uint32_t *tile = tiled + tile_base + y_offs;
-
-			for (unsigned j = 0; j < TILE_WIDTH; ++j) {
-				/* Written in a funny way to avoid inner shift,
-				 * do it free as part of x_offs instead */
-				uint32_t *in = (uint32_t *) (((uint8_t *) tile) + x_offs);
-				*(linear_row++) = *in;
-				x_offs = (x_offs - (SPACE_MASK << 2)) & (SPACE_MASK << 2);
+	size_t tile_bytes = TILE_WIDTH * TILE_HEIGHT * k->cpp;
+	uint8_t *staging = aligned_alloc(64, tile_bytes);
+	assert(staging != NULL);
+
+	for (unsigned ty = (sy >> TILE_SHIFT); ty <= ((smaxy - 1) >> TILE_SHIFT); ++ty) {
+		unsigned y0 = MAX2(sy, ty << TILE_SHIFT);
+		unsigned y1 = MIN2(smaxy, (ty + 1) << TILE_SHIFT);
+
+		for (unsigned tx = (sx >> TILE_SHIFT); tx <= ((smaxx - 1) >> TILE_SHIFT); ++tx) {
+			unsigned x0 = MAX2(sx, tx << TILE_SHIFT);
+			unsigned x1 = MIN2(smaxx, (tx + 1) << TILE_SHIFT);
+
+			size_t tile_idx = (ty * tiles_per_row) + tx;
+			uint8_t *tile = ((uint8_t *) tiled) + tile_idx * tile_bytes;
+			uint8_t *out = ((uint8_t *) linear) +
+				(((size_t) (y0 - sy) * linear_pitch) + (x0 - sx)) * k->cpp;
+
+			ash_stream_copy(staging, tile, tile_bytes);
+
+			/* The staging buffer is a single tile, so detile it
+			 * as a 64-wide image in tile-local coordinates */
+			unsigned lx = x0 & TILE_MASK, ly = y0 & TILE_MASK;
+			unsigned lmaxx = lx + (x1 - x0), lmaxy = ly + (y1 - y0);
+
+			if (lx == 0 && lmaxx == TILE_WIDTH) {
+				/* Partial cache lines written non-temporally are
+				 * read-modify-written in memory, which is far worse
+				 * than going through the cache */
+				bool aligned = !(((uintptr_t) out |
+						(linear_pitch * k->cpp)) & 63);
+
+				ash_tiling_fn fn = (aligned && k->detile_aligned_nt) ?
+					k->detile_aligned_nt : k->detile_aligned;
+
+				fn(staging, out, TILE_WIDTH, linear_pitch,
+						0, ly, TILE_WIDTH, lmaxy);
+			} else {
+				k->detile_unaligned(staging, out, TILE_WIDTH,
+						linear_pitch, lx, ly, lmaxx, lmaxy);
 			}
 		}
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	/* Non-temporal stores are weakly ordered */
+	_mm_sfence();
+#elif defined(__aarch64__)
+	__asm__ volatile("dmb ishst" ::: "memory");
+#endif
+
+	free(staging);
+}
+
+/* Copy a w x h rectangle between tiled surfaces. If both rectangles sit at
+ * the same position within their tiles, every tile fully covered maps to a
+ * whole tile of the destination and a row of them is a single memcpy, since
+ * tiles in a row are contiguous. Only the ragged edges need Morton math. */
+
+void
+ash_copy_tiled(void *dst, unsigned dst_width, unsigned dx, unsigned dy,
+		void *src, unsigned src_width, unsigned sx, unsigned sy,
+		unsigned w, unsigned h, unsigned bpp)
+{
+	const struct ash_tiling_kernels *k = ash_get_kernels(bpp);
+
+	unsigned ax = (sx + TILE_MASK) & ~TILE_MASK;
+	unsigned ay = (sy + TILE_MASK) & ~TILE_MASK;
+	unsigned amaxx = (sx + w) & ~TILE_MASK;
+	unsigned amaxy = (sy + h) & ~TILE_MASK;
 
-		y_offs = (((y_offs >> 1) - SPACE_MASK) & SPACE_MASK) << 1;
-		linear += linear_pitch;
+	bool same_phase = !(((sx ^ dx) | (sy ^ dy)) & TILE_MASK);
+
+	if (!same_phase || ax >= amaxx || ay >= amaxy) {
+		k->copy_tiled(dst, dst_width, dx, dy, src, src_width,
+				sx, sy, w, h);
+		return;
+	}
+
+	/* Destination coordinates of the aligned interior */
+	unsigned adx = dx + (ax - sx);
+	unsigned ady = dy + (ay - sy);
+
+	unsigned src_tiles_per_row = (src_width + TILE_WIDTH - 1) >> TILE_SHIFT;
+	unsigned dst_tiles_per_row = (dst_width + TILE_WIDTH - 1) >> TILE_SHIFT;
+	size_t tile_bytes = TILE_WIDTH * TILE_HEIGHT * k->cpp;
+	size_t row_bytes = ((amaxx - ax) >> TILE_SHIFT) * tile_bytes;
+
+	for (unsigned y = ay; y < amaxy; y += TILE_HEIGHT) {
+		size_t src_tile = ((y >> TILE_SHIFT) * src_tiles_per_row) + (ax >> TILE_SHIFT);
+		size_t dst_tile = (((ady + y - ay) >> TILE_SHIFT) * dst_tiles_per_row) + (adx >> TILE_SHIFT);
+
+		memcpy(((uint8_t *) dst) + dst_tile * tile_bytes,
+				((uint8_t *) src) + src_tile * tile_bytes,
+				row_bytes);
+	}
+
+	/* Top and bottom bands across the full width */
+	if (ay > sy) {
+		k->copy_tiled(dst, dst_width, dx, dy, src, src_width,
+				sx, sy, w, ay - sy);
+	}
+
+	if (sy + h > amaxy) {
+		k->copy_tiled(dst, dst_width, dx, dy + (amaxy - sy),
+				src, src_width, sx, amaxy, w, sy + h - amaxy);
+	}
+
+	/* Left and right edges of the interior rows */
+	if (ax > sx) {
+		k->copy_tiled(dst, dst_width, dx, ady, src, src_width,
+				sx, ay, ax - sx, amaxy - ay);
+	}
+
+	if (sx + w > amaxx) {
+		k->copy_tiled(dst, dst_width, dx + (amaxx - sx), ady,
+				src, src_width, amaxx, ay, sx + w - amaxx, amaxy - ay);
 	}
 }
 
+/* Parallel detiling. Work is split into bands of whole tile rows, so every
+ * worker reads its own tiles and writes a disjoint band of the linear image.
+ * Workers live in a persistent pool created on first use, the calling thread
+ * works on bands too rather than sleeping. Small sub-rectangles aren't worth
+ * the wakeups and go straight to the serial path. */
+
+#define ASH_PARALLEL_MIN_TEXELS (256 * 256)
+#define ASH_MAX_WORKERS 16
+
+typedef void (*ash_entry_fn)(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+struct ash_job {
+	ash_entry_fn fn;
+	void *tiled;
+	uint8_t *linear;
+	unsigned width, bpp, linear_pitch;
+	unsigned sx, sy, smaxx, smaxy;
+
+	unsigned nr_bands;
+	atomic_uint next_band;
+};
+
+static struct {
+	pthread_once_t once;
+	unsigned nr_workers;
+
+	/* Serializes callers, the pool runs one job at a time */
+	pthread_mutex_t submit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	struct ash_job *job;
+	unsigned generation;
+	unsigned active;
+} ash_pool = {
+	.once = PTHREAD_ONCE_INIT,
+	.submit = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
 static void
-ash_detile_32(uint32_t *tiled, uint32_t *linear,
-		unsigned width, unsigned linear_pitch,
-		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+ash_run_bands(struct ash_job *job)
 {
-	if (sx & TILE_MASK) {
-		ash_detile_unaligned_32(tiled, linear, width, linear_pitch, sx, sy,
-				MIN2(TILE_WIDTH - (sx & TILE_MASK), smaxx - sx), smaxy);
-		sx = (sx & ~TILE_MASK) + 1;
+	unsigned first_row = job->sy >> TILE_SHIFT;
+
+	for (;;) {
+		unsigned band = atomic_fetch_add(&job->next_band, 1);
+
+		if (band >= job->nr_bands)
+			break;
+
+		unsigned y0 = MAX2(job->sy, (first_row + band) << TILE_SHIFT);
+		unsigned y1 = MIN2(job->smaxy, (first_row + band + 1) << TILE_SHIFT);
+
+		size_t offset = (size_t) (y0 - job->sy) * job->linear_pitch * (job->bpp / 8);
+
+		job->fn(job->tiled, job->linear + offset,
+				job->width, job->bpp, job->linear_pitch,
+				job->sx, y0, job->smaxx, y1);
 	}
+}
+
+static void *
+ash_worker(void *data)
+{
+	unsigned seen = 0;
+	(void) data;
+
+	pthread_mutex_lock(&ash_pool.lock);
+
+	for (;;) {
+		while (ash_pool.generation == seen)
+			pthread_cond_wait(&ash_pool.wake, &ash_pool.lock);
 
-	if ((smaxx & TILE_MASK) && (smaxx > sx)) {
-		ash_detile_unaligned_32(tiled, linear, width, linear_pitch,
-				MAX2(sx, smaxx & ~TILE_MASK), sy,
-				smaxx, smaxy);
-		smaxx = (smaxx & ~TILE_MASK);
+		seen = ash_pool.generation;
+		struct ash_job *job = ash_pool.job;
+		pthread_mutex_unlock(&ash_pool.lock);
+
+		ash_run_bands(job);
+
+		pthread_mutex_lock(&ash_pool.lock);
+		if (--ash_pool.active == 0)
+			pthread_cond_signal(&ash_pool.done);
 	}
 
-	if (smaxx > sx) {
-		ash_detile_aligned_32(tiled, linear, width, linear_pitch,
-				sx, sy, smaxx, smaxy);
+	return NULL;
+}
+
+static void
+ash_pool_init(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned want = (cpus > 1) ? MIN2(cpus - 1, ASH_MAX_WORKERS) : 0;
+
+	for (unsigned i = 0; i < want; ++i) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, ash_worker, NULL))
+			break;
+
+		pthread_detach(thread);
+		ash_pool.nr_workers++;
 	}
 }
 
+static void
+ash_parallel(ash_entry_fn fn, void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	unsigned nr_bands = (smaxy > sy) ?
+		((smaxy + TILE_MASK) >> TILE_SHIFT) - (sy >> TILE_SHIFT) : 0;
+
+	bool small = (smaxx <= sx) || (smaxy <= sy) ||
+		((smaxx - sx) * (smaxy - sy) < ASH_PARALLEL_MIN_TEXELS);
+
+	if (!small && nr_bands > 1)
+		pthread_once(&ash_pool.once, ash_pool_init);
+
+	if (small || nr_bands < 2 || !ash_pool.nr_workers) {
+		fn(tiled, linear, width, bpp, linear_pitch, sx, sy, smaxx, smaxy);
+		return;
+	}
+
+	/* Select kernels up front so workers don't race on it */
+	ash_get_kernels(bpp);
+
+	struct ash_job job = {
+		.fn = fn,
+		.tiled = tiled, .linear = linear,
+		.width = width, .bpp = bpp, .linear_pitch = linear_pitch,
+		.sx = sx, .sy = sy, .smaxx = smaxx, .smaxy = smaxy,
+		.nr_bands = nr_bands,
+	};
+
+	atomic_init(&job.next_band, 0);
+
+	pthread_mutex_lock(&ash_pool.submit);
+
+	pthread_mutex_lock(&ash_pool.lock);
+	ash_pool.job = &job;
+	ash_pool.active = ash_pool.nr_workers;
+	ash_pool.generation++;
+	pthread_cond_broadcast(&ash_pool.wake);
+	pthread_mutex_unlock(&ash_pool.lock);
+
+	ash_run_bands(&job);
+
+	/* Every worker must be done with the job before it goes out of scope */
+	pthread_mutex_lock(&ash_pool.lock);
+	while (ash_pool.active)
+		pthread_cond_wait(&ash_pool.done, &ash_pool.lock);
+	pthread_mutex_unlock(&ash_pool.lock);
+
+	pthread_mutex_unlock(&ash_pool.submit);
+}
+
 void
-ash_detile(uint32_t *tiled, uint32_t *linear,
+ash_detile_parallel(void *tiled, void *linear,
 		unsigned width, unsigned bpp, unsigned linear_pitch,
 		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
 {
-	/* TODO: parametrize with macro magic */
-	assert(bpp == 32);
+	ash_parallel(ash_detile, tiled, linear, width, bpp, linear_pitch,
+			sx, sy, smaxx, smaxy);
+}
+
+/* Dirty tile tracking. One bit per tile, rows of the bitmap padded to whole
+ * 64-bit words so a tile row can be scanned a word at a time. */
+
+struct ash_dirty
+ash_dirty_create(unsigned width, unsigned height)
+{
+	unsigned tiles_x = (width + TILE_WIDTH - 1) >> TILE_SHIFT;
+	unsigned tiles_y = (height + TILE_HEIGHT - 1) >> TILE_SHIFT;
+	unsigned words_per_row = (tiles_x + 63) / 64;
+
+	struct ash_dirty dirty = {
+		.width = width,
+		.height = height,
+		.tiles_x = tiles_x,
+		.tiles_y = tiles_y,
+		.words_per_row = words_per_row,
+		.bits = calloc(MAX2(words_per_row * tiles_y, 1), sizeof(uint64_t)),
+	};
+
+	assert(dirty.bits != NULL);
+	return dirty;
+}
+
+void
+ash_dirty_destroy(struct ash_dirty *dirty)
+{
+	free(dirty->bits);
+	dirty->bits = NULL;
+}
+
+/* Set bits [start, end) of a bitmap row */
+
+static void
+ash_set_bits(uint64_t *row, unsigned start, unsigned end)
+{
+	while (start < end) {
+		unsigned bit = start & 63;
+		unsigned count = MIN2(64 - bit, end - start);
+		uint64_t mask = (count == 64) ? ~0ull : (((1ull << count) - 1) << bit);
+
+		row[start / 64] |= mask;
+		start += count;
+	}
+}
 
-	ash_detile_32(tiled, linear, width, linear_pitch, sx, sy, smaxx, smaxy);
+void
+ash_dirty_mark(struct ash_dirty *dirty,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy)
+{
+	smaxx = MIN2(smaxx, dirty->width);
+	smaxy = MIN2(smaxy, dirty->height);
+
+	if (sx >= smaxx || sy >= smaxy)
+		return;
+
+	unsigned tx0 = sx >> TILE_SHIFT;
+	unsigned tx1 = ((smaxx - 1) >> TILE_SHIFT) + 1;
+
+	for (unsigned ty = (sy >> TILE_SHIFT); ty <= ((smaxy - 1) >> TILE_SHIFT); ++ty)
+		ash_set_bits(dirty->bits + ty * dirty->words_per_row, tx0, tx1);
+}
+
+void
+ash_dirty_mark_all(struct ash_dirty *dirty)
+{
+	ash_dirty_mark(dirty, 0, 0, dirty->width, dirty->height);
+}
+
+/* Find the next run of set bits at or after *tx in a bitmap row, returning
+ * false if there is none. The run is [*tx, *end) */
+
+static bool
+ash_next_run(uint64_t *row, unsigned count, unsigned *tx, unsigned *end)
+{
+	unsigned x = *tx;
+
+	/* Skip clean tiles a word at a time */
+	for (;;) {
+		if (x >= count)
+			return false;
+
+		uint64_t w = row[x / 64] >> (x & 63);
+
+		if (w) {
+			x += __builtin_ctzll(w);
+			break;
+		}
+
+		x = (x | 63) + 1;
+	}
+
+	if (x >= count)
+		return false;
+
+	*tx = x;
+
+	/* Then dirty ones. Bits past the end are never set, so the run ends by
+	 * the end of the row at the latest */
+	for (;;) {
+		uint64_t clean = ~row[x / 64] >> (x & 63);
+
+		if (clean) {
+			x += __builtin_ctzll(clean);
+			break;
+		}
+
+		x = (x | 63) + 1;
+
+		if (x >= count)
+			break;
+	}
+
+	*end = MIN2(x, count);
+	return true;
+}
+
+void
+ash_detile_dirty(struct ash_dirty *dirty, void *tiled, void *linear,
+		unsigned bpp, unsigned linear_pitch)
+{
+	unsigned cpp = ash_get_kernels(bpp)->cpp;
+
+	for (unsigned ty = 0; ty < dirty->tiles_y; ++ty) {
+		uint64_t *row = dirty->bits + ty * dirty->words_per_row;
+		unsigned y0 = ty << TILE_SHIFT;
+		unsigned y1 = MIN2(y0 + TILE_HEIGHT, dirty->height);
+		unsigned tx = 0, end = 0;
+
+		/* Each run of dirty tiles in a row is detiled as one rectangle,
+		 * so all but the last tile of the surface go down the aligned
+		 * path */
+		while (ash_next_run(row, dirty->tiles_x, &tx, &end)) {
+			unsigned x0 = tx << TILE_SHIFT;
+			unsigned x1 = MIN2(end << TILE_SHIFT, dirty->width);
+			size_t offset = ((size_t) y0 * linear_pitch + x0) * cpp;
+
+			ash_detile(tiled, ((uint8_t *) linear) + offset,
+					dirty->width, bpp, linear_pitch,
+					x0, y0, x1, y1);
+
+			tx = end;
+		}
+
+		for (unsigned i = 0; i < dirty->words_per_row; ++i)
+			row[i] = 0;
+	}
 }
@@ -24,8 +24,99 @@
 #ifndef __ASH_DETILE_H
 #define __ASH_DETILE_H
 
-void ash_detile(uint32_t *tiled, uint32_t *linear,
+#include <stdint.h>
+#include "layout.h"
+
+/* Convert between the GPU's 64x64 Z-order tiled layout and a linear image.
+ * The sub-rectangle [sx, smaxx) x [sy, smaxy) is copied, with linear pointing
+ * to texel (sx, sy) of the linear image and linear_pitch in texels. bpp may
+ * be 8, 16, 32, 64 or 128, texels of any size are laid out in the same 64x64
+ * Z-order. */
+
+void ash_detile(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+void ash_tile(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+/* As ash_detile, but reads each tile of the source exactly once and writes
+ * with non-temporal stores. Much faster when the tiled image is in
+ * write-combined memory, slower otherwise. */
+
+void ash_detile_streaming(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+/* Detile or tile a whole level and layer of a surface in a BO laid out by
+ * ash_layout_create, which must be tiled */
+
+void ash_detile_surface(const struct ash_layout *layout, void *bo, void *linear,
+		unsigned linear_pitch, unsigned level, unsigned layer);
+
+void ash_tile_surface(const struct ash_layout *layout, void *bo, void *linear,
+		unsigned linear_pitch, unsigned level, unsigned layer);
+
+/* As ash_detile, converting each texel on the way out, for presenting in a
+ * format other than the one rendered. Formats are in memory byte order. The
+ * tiled image has the source format's bpp and linear_pitch is in destination
+ * texels. */
+
+enum ash_conversion {
+	/* BGRA8 <-> RGBA8 */
+	ASH_CONVERT_SWAP_RB,
+
+	/* RGBA8 -> RGB565, truncating */
+	ASH_CONVERT_RGBA8_TO_RGB565,
+
+	/* RGBA16F -> RGBA8 UNORM, clamping */
+	ASH_CONVERT_RGBA16F_TO_RGBA8,
+
+	ASH_NUM_CONVERSIONS
+};
+
+void ash_detile_convert(void *tiled, void *linear,
+		unsigned width, enum ash_conversion conversion,
+		unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+/* Copy a w x h rectangle from (sx, sy) of one tiled surface to (dx, dy) of
+ * another, without going through a linear image. The rectangles must not
+ * overlap. */
+
+void ash_copy_tiled(void *dst, unsigned dst_width, unsigned dx, unsigned dy,
+		void *src, unsigned src_width, unsigned sx, unsigned sy,
+		unsigned w, unsigned h, unsigned bpp);
+
+/* As ash_detile, but spread over a pool of worker threads, one band of tile
+ * rows at a time. Falls back to ash_detile for small sub-rectangles. */
+
+void ash_detile_parallel(void *tiled, void *linear,
 		unsigned width, unsigned bpp, unsigned linear_pitch,
 		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
 
+/* Tile-granular damage tracking for incremental readback. Mark damaged
+ * rectangles as they're rendered, then ash_detile_dirty detiles just the
+ * marked tiles (linear pointing to texel (0, 0) this time) and clears them. */
+
+struct ash_dirty {
+	unsigned width, height;
+	unsigned tiles_x, tiles_y;
+	unsigned words_per_row;
+
+	/* One bit per tile, row-major */
+	uint64_t *bits;
+};
+
+struct ash_dirty ash_dirty_create(unsigned width, unsigned height);
+void ash_dirty_destroy(struct ash_dirty *dirty);
+
+void ash_dirty_mark(struct ash_dirty *dirty,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+void ash_dirty_mark_all(struct ash_dirty *dirty);
+
+void ash_detile_dirty(struct ash_dirty *dirty, void *tiled, void *linear,
+		unsigned bpp, unsigned linear_pitch);
+
 #endif
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "trace.h"
+#include "selectors.h"
+#include "io.h"
+
+unsigned
+agx_trace_iov(struct agx_trace_record *r, const uint64_t *scalars,
+		const uint64_t *references, const void *strct,
+		const void *extra, struct iovec *iov)
+{
+	static const uint8_t zero[8];
+
+	size_t scalar_size = r->nr_scalars * sizeof(uint64_t);
+	size_t reference_size = r->nr_references * sizeof(uint64_t);
+	size_t payload = scalar_size + reference_size + r->struct_size + r->extra_size;
+	size_t padded = (sizeof(*r) + payload + 7) & ~7;
+
+	r->size = padded;
+
+	unsigned count = 0;
+	iov[count++] = (struct iovec) { r, sizeof(*r) };
+
+	if (scalar_size)
+		iov[count++] = (struct iovec) { (void *) scalars, scalar_size };
+	if (reference_size)
+		iov[count++] = (struct iovec) { (void *) references, reference_size };
+	if (r->struct_size)
+		iov[count++] = (struct iovec) { (void *) strct, r->struct_size };
+	if (r->extra_size)
+		iov[count++] = (struct iovec) { (void *) extra, r->extra_size };
+	if (padded - sizeof(*r) - payload)
+		iov[count++] = (struct iovec) { (void *) zero, padded - sizeof(*r) - payload };
+
+	return count;
+}
+
+void
+agx_trace_pack(struct agx_emitter *e, struct agx_trace_record r,
+		const uint64_t *scalars, const uint64_t *references,
+		const void *strct, const void *extra)
+{
+	struct iovec iov[AGX_TRACE_MAX_IOV];
+	unsigned count = agx_trace_iov(&r, scalars, references, strct, extra, iov);
+
+	char *p = agx_emit_reserve(e, r.size);
+	for (unsigned i = 0; i < count; ++i) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	e->size += r.size;
+}
+
+const struct agx_trace_record *
+agx_trace_record_at(const void *trace, size_t size, size_t offset)
+{
+	const struct agx_trace_record *r =
+		(const struct agx_trace_record *) ((const uint8_t *) trace + offset);
+
+	if (offset + sizeof(*r) > size || (offset & 7))
+		return NULL;
+
+	uint64_t payload = ((uint64_t) r->nr_scalars + r->nr_references) * 8 +
+		(uint64_t) r->struct_size + r->extra_size;
+
+	if (r->size < sizeof(*r) || (r->size & 7) || r->size > size - offset ||
+	    sizeof(*r) + payload > r->size || r->type >= AGX_TRACE_NUM_TYPES)
+		return NULL;
+
+	return r;
+}
+
+static void
+hexdump(struct agx_emitter *e, const uint8_t *hex, size_t cnt)
+{
+	for (unsigned i = 0; i < cnt; ++i) {
+		agx_emit_hex8(e, hex[i], true);
+		agx_emit_char(e, ' ');
+
+		if (i && (i & 0xF) == 0xF) {
+			char *ascii = agx_emit_reserve(e, 3 + 16 + 1);
+			memcpy(ascii, " | ", 3);
+			ascii += 3;
+
+			for (unsigned j = i & ~0xF; j <= i; ++j) {
+				uint8_t c = hex[j];
+				*(ascii++) = (c < 32 || c > 128) ? '.' : c;
+			}
+
+			*ascii = '\n';
+			e->size += 3 + 16 + 1;
+		}
+	}
+
+	agx_emit_char(e, '\n');
+}
+
+/* Scalars as the tracer has always printed them, with a separator before
+ * (" %llx") or after ("%llx ") */
+
+static void
+emit_scalars(struct agx_emitter *e, const uint64_t *values, unsigned count,
+		bool before)
+{
+	for (unsigned i = 0; i < count; ++i) {
+		if (before)
+			agx_emit_char(e, ' ');
+
+		agx_emit_hex(e, values[i], 0, false);
+
+		if (!before)
+			agx_emit_char(e, ' ');
+	}
+}
+
+static void
+emit_ptr(struct agx_emitter *e, uint64_t ptr)
+{
+	agx_emit_str(e, "0x");
+	agx_emit_hex(e, ptr, 0, false);
+}
+
+static void
+print_inputs(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	agx_emit_str(e, " (out ");
+	emit_ptr(e, r->ptrs[1]);
+	agx_emit_str(e, ", ");
+	agx_emit_uint(e, r->out_struct_size);
+	agx_emit_char(e, ')');
+
+	emit_scalars(e, agx_trace_scalars(r), r->nr_scalars, true);
+
+	if (r->struct_size) {
+		agx_emit_str(e, ", struct:\n");
+		hexdump(e, agx_trace_struct(r), r->struct_size);
+	} else {
+		agx_emit_char(e, '\n');
+	}
+}
+
+static void
+print_call(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	const uint8_t *strct = agx_trace_struct(r);
+
+	switch (r->selector) {
+	case AGX_SELECTOR_SET_API:
+		agx_emit_hex(e, r->connection, 0, true);
+		agx_emit_str(e, ": SET_API(");
+		agx_emit_mem(e, (const char *) strct, strnlen((const char *) strct, r->struct_size));
+		agx_emit_str(e, ")\n");
+		return;
+
+	case AGX_SELECTOR_SUBMIT_COMMAND_BUFFERS:
+		agx_emit_hex(e, r->connection, 0, true);
+		agx_emit_str(e, ": SUBMIT_COMMAND_BUFFERS command queue id:");
+		agx_emit_hex(e, r->nr_scalars ? agx_trace_scalars(r)[0] : 0, 0, false);
+		agx_emit_char(e, ' ');
+		emit_ptr(e, r->ptrs[0]);
+		agx_emit_char(e, '\n');
+		break;
+
+	default:
+		break;
+	}
+
+	agx_emit_hex(e, r->connection, 0, true);
+	agx_emit_str(e, ": call ");
+	agx_emit_str(e, wrap_selector_name(r->selector));
+	print_inputs(e, r);
+}
+
+static void
+print_return(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	agx_emit_str(e, "return ");
+	agx_emit_uint(e, (uint32_t) r->ret);
+
+	if (r->flags & AGX_TRACE_HAS_SCALARS) {
+		agx_emit_uint(e, r->nr_scalars);
+		agx_emit_str(e, " scalars: ");
+		emit_scalars(e, agx_trace_scalars(r), r->nr_scalars, false);
+		agx_emit_char(e, '\n');
+	}
+
+	if (r->flags & AGX_TRACE_HAS_STRUCT) {
+		agx_emit_str(e, " struct\n");
+		hexdump(e, agx_trace_struct(r), r->struct_size);
+
+		/* Linked buffer */
+		if (r->extra_size)
+			hexdump(e, agx_trace_extra(r), r->extra_size);
+	}
+
+	agx_emit_char(e, '\n');
+}
+
+static void
+print_allocate(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	const uint64_t *s = agx_trace_scalars(r);
+	if (r->nr_scalars < 5)
+		return;
+
+	const char *type = agx_memory_type_name(s[4]);
+
+	agx_emit_str(e, "allocate gpu va ");
+	agx_emit_hex(e, s[0], 0, false);
+	agx_emit_str(e, ", cpu ");
+	agx_emit_hex(e, s[1], 0, false);
+	agx_emit_str(e, ", 0x");
+	agx_emit_hex(e, s[2], 0, false);
+	agx_emit_str(e, " bytes (");
+	agx_emit_uint(e, s[3]);
+	agx_emit_str(e, ") ");
+
+	if (type) {
+		agx_emit_char(e, ' ');
+		agx_emit_str(e, type);
+		agx_emit_char(e, '\n');
+	} else {
+		agx_emit_str(e, " unknown type ");
+		agx_emit_hex(e, s[4], 8, true);
+		agx_emit_char(e, '\n');
+	}
+}
+
+/* One line per mapping, named as the old per-file dumps were */
+
+static void
+print_snapshot(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	const struct agx_trace_bo *bos = (const void *) agx_trace_struct(r);
+	unsigned count = r->struct_size / sizeof(*bos);
+	const uint64_t *s = agx_trace_scalars(r);
+
+	if (r->nr_scalars < 3)
+		return;
+
+	agx_emit_str(e, "snapshot ");
+	agx_emit_uint(e, s[0]);
+	agx_emit_str(e, ": ");
+	agx_emit_uint(e, count);
+	agx_emit_str(e, " mappings, ");
+	agx_emit_uint(e, s[1]);
+	agx_emit_str(e, " new blobs, ");
+	agx_emit_uint(e, s[2]);
+	agx_emit_str(e, " bytes\n");
+
+	for (unsigned i = 0; i < count; ++i) {
+		const struct agx_trace_bo *bo = &bos[i];
+
+		agx_emit_str(e, "  ");
+		agx_emit_str(e, bo->type < AGX_NUM_ALLOC ? agx_alloc_types[bo->type] : "unk");
+		agx_emit_char(e, '_');
+		agx_emit_hex(e, bo->gpu_va, 0, false);
+		agx_emit_char(e, '_');
+		agx_emit_uint(e, bo->index);
+		agx_emit_str(e, " 0x");
+		agx_emit_hex(e, bo->size, 0, false);
+		agx_emit_str(e, " bytes ");
+		agx_emit_hex(e, bo->hash.hi, 16, false);
+		agx_emit_hex(e, bo->hash.lo, 16, false);
+
+		if (bo->flags & AGX_TRACE_BO_CHANGED)
+			agx_emit_str(e, " changed");
+
+		if (bo->flags & AGX_TRACE_BO_DELTA)
+			agx_emit_str(e, " delta");
+
+		agx_emit_char(e, '\n');
+	}
+}
+
+void
+agx_trace_print(struct agx_emitter *e, const struct agx_trace_record *r)
+{
+	switch (r->type) {
+	case AGX_TRACE_CALL:
+		print_call(e, r);
+		break;
+
+	case AGX_TRACE_CALL_ASYNC:
+		agx_emit_hex(e, r->connection, 0, true);
+		agx_emit_str(e, ": call ");
+		agx_emit_hex(e, r->selector, 0, true);
+		agx_emit_str(e, ", wake port ");
+		agx_emit_hex(e, r->port, 0, true);
+		print_inputs(e, r);
+
+		agx_emit_str(e, ", references: ");
+		emit_scalars(e, agx_trace_references(r), r->nr_references, true);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_RETURN:
+	case AGX_TRACE_RETURN_ASYNC:
+		print_return(e, r);
+		break;
+
+	case AGX_TRACE_ALLOCATE:
+		print_allocate(e, r);
+		break;
+
+	case AGX_TRACE_SET_NOTIFICATION_PORT:
+		agx_emit_str(e, "connect ");
+		agx_emit_hex(e, r->connection, 0, true);
+		agx_emit_str(e, ", type ");
+		agx_emit_hex(e, r->selector, 0, true);
+		agx_emit_str(e, ", to notification port ");
+		agx_emit_hex(e, r->port, 0, true);
+		agx_emit_str(e, ", with reference ");
+		agx_emit_hex(e, r->nr_scalars ? agx_trace_scalars(r)[0] : 0, 0, false);
+		agx_emit_str(e, "\nreturn ");
+		agx_emit_uint(e, (uint32_t) r->ret);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_NOTIFICATION_PORT_CREATE:
+		agx_emit_str(e, "creating notification port from master ");
+		agx_emit_hex(e, r->port, 0, true);
+		agx_emit_str(e, " --> ");
+		emit_ptr(e, r->ptrs[0]);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_SET_DISPATCH_QUEUE:
+		agx_emit_str(e, "set dispatch queue ");
+		emit_ptr(e, r->ptrs[0]);
+		agx_emit_str(e, " to queue ");
+		emit_ptr(e, r->ptrs[1]);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_DATA_QUEUE_ALLOCATE_PORT:
+		agx_emit_str(e, "data queue notif port ");
+		agx_emit_hex(e, r->port, 0, true);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_DATA_QUEUE_SET_PORT:
+		agx_emit_str(e, "data queue ");
+		emit_ptr(e, r->ptrs[0]);
+		agx_emit_str(e, " set notif port ");
+		agx_emit_hex(e, r->port, 0, true);
+		agx_emit_str(e, " -> ");
+		agx_emit_hex(e, (uint32_t) r->ret, 0, true);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_DROPPED:
+		if (r->nr_scalars < 2)
+			break;
+
+		agx_emit_str(e, "dropped ");
+		agx_emit_uint(e, agx_trace_scalars(r)[0]);
+		agx_emit_str(e, " records (");
+		agx_emit_uint(e, agx_trace_scalars(r)[1]);
+		agx_emit_str(e, " bytes) from thread ");
+		agx_emit_uint(e, r->thread);
+		agx_emit_char(e, '\n');
+		break;
+
+	case AGX_TRACE_SNAPSHOT:
+		print_snapshot(e, r);
+		break;
+	}
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __AGX_TRACE_H
+#define __AGX_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include "emit.h"
+#include "hash.h"
+
+/* Binary trace written by wrap: a header, then length-prefixed records of
+ * everything the text log used to show, copied rather than formatted so
+ * capture doesn't perturb the workload. trace-bin turns it back into the
+ * text. Both ends are little endian, so structs are written as-is. */
+
+#define AGX_TRACE_MAGIC "AGXTRACE"
+#define AGX_TRACE_VERSION 1
+
+struct agx_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+};
+
+enum agx_trace_type {
+	/* IOConnectCallMethod before the call, with the inputs */
+	AGX_TRACE_CALL,
+
+	/* and after, with the return code and outputs */
+	AGX_TRACE_RETURN,
+
+	/* Same for IOConnectCallAsyncMethod, with a wake port and references */
+	AGX_TRACE_CALL_ASYNC,
+	AGX_TRACE_RETURN_ASYNC,
+
+	/* A buffer was allocated. Scalars are GPU VA, CPU address, size,
+	 * mapping index and memory type */
+	AGX_TRACE_ALLOCATE,
+
+	/* Notification setup, arguments in the fields named below */
+	AGX_TRACE_SET_NOTIFICATION_PORT,	/* connection, selector = type, port, scalar reference, ret */
+	AGX_TRACE_NOTIFICATION_PORT_CREATE,	/* port = master, ptrs[0] = ref */
+	AGX_TRACE_SET_DISPATCH_QUEUE,		/* ptrs = notify, queue */
+	AGX_TRACE_DATA_QUEUE_ALLOCATE_PORT,	/* port */
+	AGX_TRACE_DATA_QUEUE_SET_PORT,		/* ptrs[0] = queue, port, ret */
+
+	/* The tracer lost records from thread, because the writer fell behind.
+	 * Scalars are the number of records and bytes dropped since the last. */
+	AGX_TRACE_DROPPED,
+
+	/* Contents of every tracked mapping, taken before each submit. Scalars
+	 * are the submit number and the blobs and bytes newly stored for it,
+	 * and the struct an array of struct agx_trace_bo. */
+	AGX_TRACE_SNAPSHOT,
+
+	AGX_TRACE_NUM_TYPES
+};
+
+/* Outputs present, even if empty */
+#define AGX_TRACE_HAS_SCALARS (1 << 0)
+#define AGX_TRACE_HAS_STRUCT (1 << 1)
+
+/* Followed by nr_scalars then nr_references 64-bit words, struct_size bytes
+ * of struct, extra_size bytes of extra (selector 2's linked buffer), and
+ * padding to a multiple of 8 */
+
+struct agx_trace_record {
+	uint32_t size;
+	uint16_t type;
+	uint16_t flags;
+
+	/* Nanoseconds, CLOCK_MONOTONIC */
+	uint64_t timestamp;
+
+	/* Small per-process thread numbers, in order of first trace */
+	uint32_t thread;
+
+	uint32_t connection;
+	uint32_t selector;
+	uint32_t port;
+	int32_t ret;
+
+	/* For calls, the output struct size on entry */
+	uint32_t out_struct_size;
+
+	uint32_t nr_scalars, nr_references;
+	uint32_t struct_size, extra_size;
+
+	/* For calls, the input struct and output struct size pointers */
+	uint64_t ptrs[2];
+};
+
+_Static_assert(sizeof(struct agx_trace_record) == 72, "trace ABI");
+
+/* A mapping in a snapshot. Its contents are the blob with this hash in the
+ * store the capture was written with, or a zero hash if they couldn't be
+ * stored. */
+
+struct agx_trace_bo {
+	struct agx_hash128 hash;
+	uint64_t gpu_va, size;
+
+	/* Index of the mapping as tracked, and the kernel's index of the buffer
+	 * within its enum agx_alloc_type */
+	uint32_t mapping, index;
+	uint32_t type, flags;
+};
+
+_Static_assert(sizeof(struct agx_trace_bo) == 48, "trace ABI");
+
+/* Contents differ from this mapping's in the previous snapshot */
+#define AGX_TRACE_BO_CHANGED (1 << 0)
+
+/* The blob is a delta to rebuild with agx_store_get_bo */
+#define AGX_TRACE_BO_DELTA (1 << 1)
+
+/* Fills in the size of a record and lays it out, payload and padding, as up
+ * to AGX_TRACE_MAX_IOV pieces for writing directly where it is going. The
+ * first piece points at r. Returns the number of pieces. */
+
+#define AGX_TRACE_MAX_IOV 6
+
+unsigned
+agx_trace_iov(struct agx_trace_record *r, const uint64_t *scalars,
+		const uint64_t *references, const void *strct,
+		const void *extra, struct iovec *iov);
+
+/* Appends a record, with its size filled in and payload copied after it */
+
+void
+agx_trace_pack(struct agx_emitter *e, struct agx_trace_record r,
+		const uint64_t *scalars, const uint64_t *references,
+		const void *strct, const void *extra);
+
+/* The payload of a record, which must have been checked already */
+
+static inline const uint64_t *
+agx_trace_scalars(const struct agx_trace_record *r)
+{
+	return (const uint64_t *) (r + 1);
+}
+
+static inline const uint64_t *
+agx_trace_references(const struct agx_trace_record *r)
+{
+	return agx_trace_scalars(r) + r->nr_scalars;
+}
+
+static inline const uint8_t *
+agx_trace_struct(const struct agx_trace_record *r)
+{
+	return (const uint8_t *) (agx_trace_references(r) + r->nr_references);
+}
+
+static inline const uint8_t *
+agx_trace_extra(const struct agx_trace_record *r)
+{
+	return agx_trace_struct(r) + r->struct_size;
+}
+
+/* Returns the record at offset of a trace, or NULL if there isn't a complete,
+ * consistent one there */
+
+const struct agx_trace_record *
+agx_trace_record_at(const void *trace, size_t size, size_t offset);
+
+/* The text the wrapper used to print for a record */
+
+void
+agx_trace_print(struct agx_emitter *e, const struct agx_trace_record *r);
+
+#endif
@@ -0,0 +1,592 @@
+/*
+ * Copyright (C) 2021 Alyssa Rosenzweig <alyssa@rosenzweig.io>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Correctness checks and throughput numbers for lib/tiling.c, which has no
+ * dependencies on the rest of the stack so this runs on any machine.
+ *
+ * 	tiling-bench check [iterations]
+ * 	tiling-bench bench
+ *
+ * Checks compare against a naive Morton order reference computed texel by
+ * texel. Set ASAHI_NO_SIMD to check or time the scalar kernels. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include "tiling.h"
+#include "util.h"
+
+static unsigned bpps[] = { 8, 16, 32, 64, 128 };
+#define NR_BPPS (sizeof(bpps) / sizeof(bpps[0]))
+
+/* Deterministic across platforms, unlike rand() */
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint32_t
+rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state >> 16;
+}
+
+static unsigned
+rng_range(unsigned lo, unsigned hi)
+{
+	return lo + (rng() % (hi - lo));
+}
+
+static void
+fill_random(uint8_t *buf, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		buf[i] = rng();
+}
+
+static double
+now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + (tp.tv_nsec / 1e9);
+}
+
+/* Reference: byte offset of texel (x, y) in a tiled image */
+
+static size_t
+ref_offset(unsigned width, unsigned cpp, unsigned x, unsigned y)
+{
+	unsigned tiles_per_row = (width + 63) / 64;
+	size_t tile = ((y / 64) * tiles_per_row) + (x / 64);
+	unsigned morton = 0;
+
+	for (unsigned i = 0; i < 6; ++i) {
+		morton |= ((x >> i) & 1) << (2 * i);
+		morton |= ((y >> i) & 1) << (2 * i + 1);
+	}
+
+	return ((tile * 64 * 64) + morton) * cpp;
+}
+
+static size_t
+tiled_size(unsigned width, unsigned height, unsigned cpp)
+{
+	return (size_t) ((width + 63) / 64) * ((height + 63) / 64) * 64 * 64 * cpp;
+}
+
+struct rect {
+	unsigned x, y, maxx, maxy;
+};
+
+static struct rect
+random_rect(unsigned width, unsigned height)
+{
+	struct rect r;
+	r.x = rng_range(0, width);
+	r.y = rng_range(0, height);
+	r.maxx = rng_range(r.x + 1, width + 1);
+	r.maxy = rng_range(r.y + 1, height + 1);
+
+	/* Bias towards tile aligned edges, which take different paths */
+	if (rng() & 1) r.x &= ~63;
+	if (rng() & 1) r.maxx = (r.maxx & ~63) ? (r.maxx & ~63) : r.maxx;
+
+	return r;
+}
+
+typedef void (*detile_fn)(void *tiled, void *linear,
+		unsigned width, unsigned bpp, unsigned linear_pitch,
+		unsigned sx, unsigned sy, unsigned smaxx, unsigned smaxy);
+
+static unsigned failures = 0;
+
+static void
+fail(const char *what, unsigned bpp, unsigned width, unsigned height, struct rect r)
+{
+	fprintf(stderr, "FAIL %s: %ubpp %ux%u, rect (%u, %u) - (%u, %u)\n",
+			what, bpp, width, height, r.x, r.y, r.maxx, r.maxy);
+	failures++;
+}
+
+/* Detile a random rect into a padded linear image, then check every texel:
+ * inside the rect against the reference, outside must be untouched */
+
+static void
+check_detile(const char *name, detile_fn fn, unsigned bpp)
+{
+	unsigned cpp = bpp / 8;
+	unsigned width = rng_range(1, 400), height = rng_range(1, 300);
+	unsigned pitch = width + rng_range(0, 8);
+	struct rect r = random_rect(width, height);
+
+	size_t tsize = tiled_size(width, height, cpp);
+	uint8_t *tiled = malloc(tsize);
+	uint8_t *linear = malloc((size_t) pitch * height * cpp);
+	fill_random(tiled, tsize);
+	memset(linear, 0xAB, (size_t) pitch * height * cpp);
+
+	fn(tiled, linear + ((size_t) r.y * pitch + r.x) * cpp,
+			width, bpp, pitch, r.x, r.y, r.maxx, r.maxy);
+
+	for (unsigned y = 0; y < height; ++y) {
+		for (unsigned x = 0; x < width; ++x) {
+			uint8_t *texel = linear + ((size_t) y * pitch + x) * cpp;
+			bool inside = x >= r.x && x < r.maxx && y >= r.y && y < r.maxy;
+
+			for (unsigned c = 0; c < cpp; ++c) {
+				uint8_t expected = inside ?
+					tiled[ref_offset(width, cpp, x, y) + c] : 0xAB;
+
+				if (texel[c] != expected) {
+					fail(name, bpp, width, height, r);
+					goto done;
+				}
+			}
+		}
+	}
+
+done:
+	free(tiled);
+	free(linear);
+}
+
+/* Tile a random rect, texels of the tiled image outside the rect must be
+ * untouched, and detiling must give back the input */
+
+static void
+check_tile(unsigned bpp)
+{
+	unsigned cpp = bpp / 8;
+	unsigned width = rng_range(1, 400), height = rng_range(1, 300);
+	struct rect r = random_rect(width, height);
+
+	size_t tsize = tiled_size(width, height, cpp);
+	size_t lsize = (size_t) width * height * cpp;
+	uint8_t *tiled = malloc(tsize), *orig = malloc(tsize);
+	uint8_t *linear = malloc(lsize), *back = malloc(lsize);
+	fill_random(tiled, tsize);
+	fill_random(linear, lsize);
+	memcpy(orig, tiled, tsize);
+
+	uint8_t *start = linear + ((size_t) r.y * width + r.x) * cpp;
+	ash_tile(tiled, start, width, bpp, width, r.x, r.y, r.maxx, r.maxy);
+
+	for (unsigned y = 0; y < (height + 63) / 64 * 64; ++y) {
+		for (unsigned x = 0; x < (width + 63) / 64 * 64; ++x) {
+			size_t offs = ref_offset(width, cpp, x, y);
+			bool inside = x >= r.x && x < r.maxx && y >= r.y && y < r.maxy;
+			uint8_t *expected = inside ?
+				linear + ((size_t) y * width + x) * cpp : orig + offs;
+
+			if (memcmp(tiled + offs, expected, cpp)) {
+				fail("ash_tile", bpp, width, height, r);
+				goto done;
+			}
+		}
+	}
+
+	memcpy(back, linear, lsize);
+	ash_detile(tiled, back + ((size_t) r.y * width + r.x) * cpp,
+			width, bpp, width, r.x, r.y, r.maxx, r.maxy);
+
+	if (memcmp(back, linear, lsize))
+		fail("ash_tile round trip", bpp, width, height, r);
+
+done:
+	free(tiled);
+	free(orig);
+	free(linear);
+	free(back);
+}
+
+static void
+check_copy(unsigned bpp)
+{
+	unsigned cpp = bpp / 8;
+	unsigned sw = rng_range(1, 300), sh = rng_range(1, 200);
+	unsigned dw = rng_range(1, 300), dh = rng_range(1, 200);
+	unsigned w = rng_range(1, MIN2(sw, dw) + 1), h = rng_range(1, MIN2(sh, dh) + 1);
+	unsigned sx = rng_range(0, sw - w + 1), sy = rng_range(0, sh - h + 1);
+	unsigned dx = rng_range(0, dw - w + 1), dy = rng_range(0, dh - h + 1);
+
+	/* Same position within the tile half the time, for the memcpy path */
+	if ((rng() & 1) && (sx & 63) + w <= dw && (sy & 63) + h <= dh) {
+		dx = sx & 63;
+		dy = sy & 63;
+	}
+
+	uint8_t *src = malloc(tiled_size(sw, sh, cpp));
+	uint8_t *dst = malloc(tiled_size(dw, dh, cpp));
+	uint8_t *orig = malloc(tiled_size(dw, dh, cpp));
+	fill_random(src, tiled_size(sw, sh, cpp));
+	fill_random(dst, tiled_size(dw, dh, cpp));
+	memcpy(orig, dst, tiled_size(dw, dh, cpp));
+
+	ash_copy_tiled(dst, dw, dx, dy, src, sw, sx, sy, w, h, bpp);
+
+	for (unsigned y = 0; y < dh; ++y) {
+		for (unsigned x = 0; x < dw; ++x) {
+			size_t offs = ref_offset(dw, cpp, x, y);
+			bool inside = x >= dx && x < dx + w && y >= dy && y < dy + h;
+			uint8_t *expected = inside ?
+				src + ref_offset(sw, cpp, sx + (x - dx), sy + (y - dy)) :
+				orig + offs;
+
+			if (memcmp(dst + offs, expected, cpp)) {
+				fail("ash_copy_tiled", bpp, dw, dh,
+						(struct rect) { dx, dy, dx + w, dy + h });
+				goto done;
+			}
+		}
+	}
+
+done:
+	free(src);
+	free(dst);
+	free(orig);
+}
+
+/* Reference conversions, one texel at a time from bytes in memory order */
+
+static unsigned
+ref_unorm8(uint16_t h)
+{
+	unsigned exp = (h >> 10) & 31, mantissa = h & 1023;
+
+	if ((h & 0x8000) || exp == 0 || (exp == 31 && mantissa))
+		return 0;
+	else if (exp >= 15)
+		return 255;
+
+	float f = (1024 + mantissa) / 1024.0f;
+	for (unsigned i = exp; i < 15; ++i)
+		f /= 2.0f;
+
+	return (unsigned) (f * 255.0f + 0.5f);
+}
+
+static void
+ref_convert(enum ash_conversion conversion, const uint8_t *in, uint8_t *out)
+{
+	switch (conversion) {
+	case ASH_CONVERT_SWAP_RB:
+		out[0] = in[2];
+		out[1] = in[1];
+		out[2] = in[0];
+		out[3] = in[3];
+		break;
+
+	case ASH_CONVERT_RGBA8_TO_RGB565: {
+		uint16_t v = ((in[0] >> 3) << 11) | ((in[1] >> 2) << 5) | (in[2] >> 3);
+		out[0] = v & 0xFF;
+		out[1] = v >> 8;
+		break;
+	}
+
+	case ASH_CONVERT_RGBA16F_TO_RGBA8:
+		for (unsigned c = 0; c < 4; ++c)
+			out[c] = ref_unorm8(in[2 * c] | (in[2 * c + 1] << 8));
+		break;
+
+	default:
+		abort();
+	}
+}
+
+static const struct {
+	const char *name;
+	unsigned tiled_cpp, linear_cpp;
+} conversions[ASH_NUM_CONVERSIONS] = {
+	[ASH_CONVERT_SWAP_RB] = { "swap_rb", 4, 4 },
+	[ASH_CONVERT_RGBA8_TO_RGB565] = { "rgba8_to_rgb565", 4, 2 },
+	[ASH_CONVERT_RGBA16F_TO_RGBA8] = { "rgba16f_to_rgba8", 8, 4 },
+};
+
+static void
+check_convert(enum ash_conversion conversion)
+{
+	unsigned tcpp = conversions[conversion].tiled_cpp;
+	unsigned cpp = conversions[conversion].linear_cpp;
+	unsigned width = rng_range(1, 400), height = rng_range(1, 300);
+	unsigned pitch = width + rng_range(0, 8);
+	struct rect r = random_rect(width, height);
+
+	size_t tsize = tiled_size(width, height, tcpp);
+	uint8_t *tiled = malloc(tsize);
+	uint8_t *linear = malloc((size_t) pitch * height * cpp);
+	fill_random(tiled, tsize);
+	memset(linear, 0xAB, (size_t) pitch * height * cpp);
+
+	ash_detile_convert(tiled, linear + ((size_t) r.y * pitch + r.x) * cpp,
+			width, conversion, pitch, r.x, r.y, r.maxx, r.maxy);
+
+	for (unsigned y = 0; y < height; ++y) {
+		for (unsigned x = 0; x < width; ++x) {
+			uint8_t *texel = linear + ((size_t) y * pitch + x) * cpp;
+			bool inside = x >= r.x && x < r.maxx && y >= r.y && y < r.maxy;
+			uint8_t expected[4] = { 0xAB, 0xAB, 0xAB, 0xAB };
+
+			if (inside) {
+				ref_convert(conversion,
+						tiled + ref_offset(width, tcpp, x, y),
+						expected);
+			}
+
+			if (memcmp(texel, expected, cpp)) {
+				fail(conversions[conversion].name, tcpp * 8,
+						width, height, r);
+				goto done;
+			}
+		}
+	}
+
+done:
+	free(tiled);
+	free(linear);
+}
+
+/* Tile random contents into every level and layer of a BO sized by the
+ * layout, then read them all back. Any overlap or overrun corrupts one. */
+
+static void
+check_layout(void)
+{
+	unsigned width = rng_range(1, 300), height = rng_range(1, 300);
+	unsigned bpp = bpps[rng_range(0, NR_BPPS)], cpp = bpp / 8;
+	unsigned levels = rng_range(1, ash_layout_max_levels(width, height) + 1);
+	unsigned layers = rng_range(1, 4);
+	struct ash_layout layout = ash_layout_create(true, width, height, bpp,
+			levels, layers);
+	struct rect r = { 0, 0, width, height };
+
+	uint8_t *bo = malloc(layout.size);
+	uint8_t **linear = calloc(levels * layers, sizeof(uint8_t *));
+	uint8_t *back = malloc((size_t) width * height * cpp);
+
+	for (unsigned i = 0; i < levels * layers; ++i) {
+		struct ash_level *l = &layout.level[i % levels];
+		size_t size = (size_t) l->width * l->height * cpp;
+
+		linear[i] = malloc(size);
+		fill_random(linear[i], size);
+		ash_tile_surface(&layout, bo, linear[i], l->width, i % levels, i / levels);
+	}
+
+	for (unsigned i = 0; i < levels * layers; ++i) {
+		struct ash_level *l = &layout.level[i % levels];
+		size_t size = (size_t) l->width * l->height * cpp;
+
+		ash_detile_surface(&layout, bo, back, l->width, i % levels, i / levels);
+
+		if (memcmp(back, linear[i], size))
+			fail("ash_layout", bpp, width, height, r);
+	}
+
+	if (layout.size & (ASH_BO_ALIGN - 1))
+		fail("ash_layout size", bpp, width, height, r);
+
+	for (unsigned i = 0; i < levels * layers; ++i)
+		free(linear[i]);
+
+	free(linear);
+	free(back);
+	free(bo);
+}
+
+static void
+check_dirty(void)
+{
+	unsigned width = rng_range(1, 5000), height = rng_range(1, 300);
+	unsigned tiles_x = (width + 63) / 64, tiles_y = (height + 63) / 64;
+	size_t lsize = (size_t) width * height * 4;
+
+	uint8_t *tiled = malloc(tiled_size(width, height, 4));
+	uint8_t *full = malloc(lsize), *linear = malloc(lsize);
+	bool *marked = calloc(tiles_x * tiles_y, sizeof(bool));
+	fill_random(tiled, tiled_size(width, height, 4));
+	memset(linear, 0, lsize);
+
+	ash_detile(tiled, full, width, 32, width, 0, 0, width, height);
+
+	struct ash_dirty dirty = ash_dirty_create(width, height);
+	struct rect r = { 0, 0, width, height };
+
+	for (unsigned i = rng_range(0, 5); i > 0; --i) {
+		r = random_rect(width, height);
+		ash_dirty_mark(&dirty, r.x, r.y, r.maxx, r.maxy);
+
+		for (unsigned ty = r.y / 64; ty <= (r.maxy - 1) / 64; ++ty) {
+			for (unsigned tx = r.x / 64; tx <= (r.maxx - 1) / 64; ++tx)
+				marked[ty * tiles_x + tx] = true;
+		}
+	}
+
+	ash_detile_dirty(&dirty, tiled, linear, 32, width);
+
+	for (unsigned y = 0; y < height; ++y) {
+		for (unsigned x = 0; x < width; ++x) {
+			uint32_t *got = (uint32_t *) linear + ((size_t) y * width + x);
+			uint32_t *ref = (uint32_t *) full + ((size_t) y * width + x);
+			uint32_t expected = marked[(y / 64) * tiles_x + (x / 64)] ? *ref : 0;
+
+			if (*got != expected) {
+				fail("ash_detile_dirty", 32, width, height, r);
+				goto done;
+			}
+		}
+	}
+
+	for (unsigned i = 0; i < dirty.words_per_row * dirty.tiles_y; ++i) {
+		if (dirty.bits[i]) {
+			fail("ash_detile_dirty clear", 32, width, height, r);
+			break;
+		}
+	}
+
+done:
+	ash_dirty_destroy(&dirty);
+	free(tiled);
+	free(full);
+	free(linear);
+	free(marked);
+}
+
+static int
+check(unsigned iterations)
+{
+	for (unsigned i = 0; i < iterations; ++i) {
+		unsigned bpp = bpps[i % NR_BPPS];
+
+		check_detile("ash_detile", ash_detile, bpp);
+		check_detile("ash_detile_parallel", ash_detile_parallel, bpp);
+		check_detile("ash_detile_streaming", ash_detile_streaming, bpp);
+		check_tile(bpp);
+		check_copy(bpp);
+		check_convert(i % ASH_NUM_CONVERSIONS);
+
+		if ((i % 8) == 0) {
+			check_dirty();
+			check_layout();
+		}
+	}
+
+	printf("%u iterations, %u failures\n", iterations, failures);
+	return failures ? 1 : 0;
+}
+
+/* Throughput, in GB/s of linear texels produced */
+
+static double
+time_detile(detile_fn fn, uint8_t *tiled, uint8_t *linear,
+		unsigned width, unsigned bpp, struct rect r)
+{
+	unsigned cpp = bpp / 8;
+	size_t bytes = (size_t) (r.maxx - r.x) * (r.maxy - r.y) * cpp;
+	uint8_t *start = linear + ((size_t) r.y * width + r.x) * cpp;
+	unsigned iterations = 0;
+
+	/* Warm up, then run for at least 100ms */
+	fn(tiled, start, width, bpp, width, r.x, r.y, r.maxx, r.maxy);
+
+	double begin = now(), elapsed;
+
+	do {
+		fn(tiled, start, width, bpp, width, r.x, r.y, r.maxx, r.maxy);
+		iterations++;
+		elapsed = now() - begin;
+	} while (elapsed < 0.1);
+
+	return (bytes * iterations) / elapsed / 1e9;
+}
+
+static int
+bench(void)
+{
+	static const struct { unsigned w, h; } sizes[] = {
+		{ 800, 600 },
+		{ 1920, 1080 },
+		{ 2560, 1440 },
+		{ 3840, 2160 },
+	};
+
+	static const struct { const char *name; detile_fn fn; } fns[] = {
+		{ "detile", ash_detile },
+		{ "tile", ash_tile },
+		{ "parallel", ash_detile_parallel },
+		{ "streaming", ash_detile_streaming },
+	};
+
+	printf("%-10s %4s %-10s %-10s %8s\n", "size", "bpp", "rect", "entry", "GB/s");
+
+	for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		unsigned width = sizes[s].w, height = sizes[s].h;
+
+		for (unsigned b = 0; b < NR_BPPS; ++b) {
+			unsigned bpp = bpps[b], cpp = bpp / 8;
+			uint8_t *tiled = malloc(tiled_size(width, height, cpp));
+			uint8_t *linear = aligned_alloc(64, (size_t) width * height * cpp);
+			fill_random(tiled, tiled_size(width, height, cpp));
+			memset(linear, 0, (size_t) width * height * cpp);
+
+			/* Whole surface, a tile aligned interior, and the same
+			 * interior off by a few texels on every side */
+			struct { const char *name; struct rect r; } rects[] = {
+				{ "full", { 0, 0, width, height } },
+				{ "aligned", { 64, 64, width - 128, height - 128 } },
+				{ "unaligned", { 67, 61, width - 125, height - 131 } },
+			};
+
+			for (unsigned r = 0; r < sizeof(rects) / sizeof(rects[0]); ++r) {
+				for (unsigned f = 0; f < sizeof(fns) / sizeof(fns[0]); ++f) {
+					char size[32];
+					snprintf(size, sizeof(size), "%ux%u", width, height);
+
+					printf("%-10s %4u %-10s %-10s %8.2f\n",
+							size, bpp, rects[r].name, fns[f].name,
+							time_detile(fns[f].fn, tiled, linear,
+								width, bpp, rects[r].r));
+				}
+			}
+
+			free(tiled);
+			free(linear);
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && !strcmp(argv[1], "check"))
+		return check(argc >= 3 ? strtoul(argv[2], NULL, 0) : 500);
+	else if (argc == 2 && !strcmp(argv[1], "bench"))
+		return bench();
+	else
+		errx(1, "usage: tiling-bench check [iterations] | bench");
+}
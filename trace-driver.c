@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "store.h"
+#include "io.h"
+
+/* Prints a binary trace from wrap as the text wrap used to print live. With
+ * -t, each record is prefixed by its thread and time since the first record.
+ *
+ * wrap writes each thread's records in batches, so they are put back in time
+ * order first, keeping file order for ties. */
+
+static int
+compare_records(const void *a, const void *b)
+{
+	const struct agx_trace_record *x = *(const struct agx_trace_record **) a;
+	const struct agx_trace_record *y = *(const struct agx_trace_record **) b;
+
+	if (x->timestamp != y->timestamp)
+		return x->timestamp < y->timestamp ? -1 : 1;
+	else
+		return (x > y) - (x < y);
+}
+
+/* Maps a trace and returns its records in time order, warning (and setting
+ * ret) if it ends in a bad record */
+
+static const struct agx_trace_record **
+load_trace(const char *path, size_t *count, int *ret)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0)
+		err(1, "%s", path);
+
+	size_t size = st.st_size;
+	const struct agx_trace_header *header =
+		size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	if (header == MAP_FAILED || size < sizeof(*header) ||
+	    memcmp(header->magic, AGX_TRACE_MAGIC, sizeof(header->magic)) ||
+	    header->version != AGX_TRACE_VERSION)
+		errx(1, "%s: not a version %u trace", path, AGX_TRACE_VERSION);
+
+	const struct agx_trace_record **records = NULL;
+	size_t capacity = 0;
+	size_t offset = header->header_size;
+	*count = 0;
+
+	while (offset < size) {
+		const struct agx_trace_record *r =
+			agx_trace_record_at(header, size, offset);
+
+		if (!r) {
+			warnx("%s: bad or truncated record at 0x%zx", path, offset);
+			*ret = 1;
+			break;
+		}
+
+		if (*count == capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			records = realloc(records, capacity * sizeof(*records));
+		}
+
+		records[(*count)++] = r;
+		offset += r->size;
+	}
+
+	qsort(records, *count, sizeof(*records), compare_records);
+	return records;
+}
+
+/* Extract mode: writes out the buffers of one snapshot, by default the last,
+ * from the archive as the per-buffer files wrap used to dump */
+
+static int
+extract(const char *archive, const struct agx_trace_record **records,
+		size_t count, const char *which)
+{
+	struct agx_store *store = agx_store_open(archive, false);
+	if (!store)
+		errx(1, "%s: can't open archive", archive);
+
+	const struct agx_trace_record *snapshot = NULL;
+	uint64_t submit = which ? strtoull(which, NULL, 0) : 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const struct agx_trace_record *r = records[i];
+
+		if (r->type == AGX_TRACE_SNAPSHOT && r->nr_scalars >= 1 &&
+		    (!which || agx_trace_scalars(r)[0] == submit))
+			snapshot = r;
+	}
+
+	if (!snapshot)
+		errx(1, "no such snapshot");
+
+	const struct agx_trace_bo *bos = (const void *) agx_trace_struct(snapshot);
+	unsigned nr_bos = snapshot->struct_size / sizeof(*bos), written = 0;
+	int ret = 0;
+
+	for (unsigned i = 0; i < nr_bos; ++i) {
+		const struct agx_trace_bo *bo = &bos[i];
+		size_t size;
+		void *data = agx_store_get_bo(store, bo->hash,
+				bo->flags & AGX_TRACE_BO_DELTA, &size);
+
+		char name[64];
+		snprintf(name, sizeof(name), "%s_%llx_%u.bin",
+				bo->type < AGX_NUM_ALLOC ? agx_alloc_types[bo->type] : "unk",
+				(unsigned long long) bo->gpu_va, bo->index);
+
+		FILE *fp = data ? fopen(name, "wb") : NULL;
+
+		if (fp && fwrite(data, 1, size, fp) == size && fclose(fp) == 0) {
+			++written;
+		} else {
+			warnx("%s: %s", name, data ? "can't write" : "missing from archive");
+			ret = 1;
+		}
+
+		free(data);
+	}
+
+	fprintf(stderr, "snapshot %llu: wrote %u of %u buffers\n",
+			(unsigned long long) agx_trace_scalars(snapshot)[0], written, nr_bos);
+
+	agx_store_close(store);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	bool timestamps = argc == 3 && !strcmp(argv[1], "-t");
+	bool extracting = (argc == 4 || argc == 5) && !strcmp(argv[1], "-x");
+
+	if (argc != 2 && !timestamps && !extracting) {
+		errx(1, "usage: trace-bin [-t] TRACE\n"
+			"       trace-bin -x ARCHIVE TRACE [SUBMIT]");
+	}
+
+	size_t count;
+	int ret = 0;
+	const struct agx_trace_record **records =
+		load_trace(extracting ? argv[3] : argv[argc - 1], &count, &ret);
+
+	if (extracting)
+		return extract(argv[2], records, count, argc == 5 ? argv[4] : NULL) | ret;
+
+	struct agx_emitter e = { .fp = stdout };
+
+	for (size_t i = 0; i < count; ++i) {
+		const struct agx_trace_record *r = records[i];
+
+		if (timestamps) {
+			agx_emit_char(&e, '[');
+			agx_emit_uint(&e, r->thread);
+			agx_emit_char(&e, ' ');
+			agx_emit_uint(&e, (r->timestamp - records[0]->timestamp) / 1000);
+			agx_emit_str(&e, "us] ");
+		}
+
+		agx_trace_print(&e, r);
+
+		/* Keep memory bounded on long traces */
+		if (e.size > (1 << 20))
+			agx_emit_flush(&e);
+	}
+
+	agx_emit_finish(&e);
+	free(records);
+	return ret;
+}
@@ -28,8 +28,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <dlfcn.h>
 #include <assert.h>
 
@@ -39,43 +45,540 @@
 #include "selectors.h"
 #include "cmdstream.h"
 #include "io.h"
+#include "emit.h"
+#include "trace.h"
+#include "ring.h"
+#include "store.h"
+
+/* Calls are traced as binary records (see lib/trace.h) to ASAHI_TRACE, by
+ * default trace.bin, for trace-bin to print later. Set ASAHI_TRACE_TEXT to
+ * print the same text directly on stdout instead.
+ *
+ * Tracing must not slow down the calls being traced, so each thread packs its
+ * records into its own ring (ASAHI_TRACE_RING KiB, 4 MiB by default) without
+ * ever blocking, and a writer thread drains the rings to the file. If a ring
+ * fills up, records are dropped, counted, and noted in the trace.
+ *
+ * Rings are allocated by the writer ahead of time, WRAP_SPARE_RINGS at a
+ * time, so a thread's first record only has to claim one. When the thread
+ * exits its ring is retired, and once drained it goes back to the pool. */
+
+#define WRAP_MAX_THREADS 256
+#define WRAP_SPARE_RINGS 4
+
+enum wrap_ring_state {
+	WRAP_RING_FREE,
+	WRAP_RING_USED,
+	WRAP_RING_RETIRED,
+};
+
+struct wrap_thread {
+	struct agx_ring ring;
+	_Atomic enum wrap_ring_state state;
+	_Atomic uint32_t id;
+
+	/* Drops already noted in the trace, for the writer */
+	uint64_t dropped, dropped_bytes;
+};
+
+static int trace_fd = -1;
+static bool trace_text = false;
+static size_t trace_ring_size = 4 << 20;
+
+/* Slots are filled by the writer and never emptied, so rings are never freed
+ * from under a thread looking for a free one */
+static struct wrap_thread *_Atomic trace_rings[WRAP_MAX_THREADS];
+static atomic_uint trace_threads;
+static _Atomic uint64_t trace_lost;
+static uint64_t trace_dropped;
+
+static pthread_t trace_writer;
+static pthread_key_t trace_key;
+static atomic_bool trace_stopping;
+
+static __thread struct wrap_thread *trace_self;
+static __thread uint32_t trace_thread;
+static __thread bool trace_exited;
+
+/* Writer side. Text has to be printed from whole records, so it is copied out
+ * of the ring first, but binary records go straight from the ring to the file */
+
+static struct agx_emitter drain, text;
+
+static void
+wrap_output(const struct iovec *iov, unsigned count)
+{
+	if (!trace_text) {
+		writev(trace_fd, iov, count);
+		return;
+	}
+
+	drain.size = 0;
+	for (unsigned i = 0; i < count; ++i)
+		agx_emit_mem(&drain, iov[i].iov_base, iov[i].iov_len);
+
+	const struct agx_trace_record *r;
+	for (size_t offset = 0; offset < drain.size; offset += r->size) {
+		r = agx_trace_record_at(drain.data, drain.size, offset);
+		assert(r != NULL);
+		agx_trace_print(&text, r);
+	}
+
+	agx_emit_flush(&text);
+}
+
+static bool
+wrap_drain(struct wrap_thread *t)
+{
+	struct iovec iov[2];
+	const uint8_t *first, *second;
+	size_t size = agx_ring_peek(&t->ring, &first, &iov[0].iov_len,
+			&second, &iov[1].iov_len);
+
+	iov[0].iov_base = (void *) first;
+	iov[1].iov_base = (void *) second;
+
+	if (size) {
+		wrap_output(iov, iov[1].iov_len ? 2 : 1);
+		agx_ring_consume(&t->ring, size);
+	}
+
+	uint64_t dropped = atomic_load_explicit(&t->ring.dropped, memory_order_relaxed);
+	uint64_t bytes = atomic_load_explicit(&t->ring.dropped_bytes, memory_order_relaxed);
+
+	if (dropped != t->dropped) {
+		uint64_t counts[] = { dropped - t->dropped, bytes - t->dropped_bytes };
+		static struct agx_emitter note;
+
+		note.size = 0;
+		agx_trace_pack(&note, (struct agx_trace_record) {
+			.type = AGX_TRACE_DROPPED,
+			.thread = t->id,
+			.nr_scalars = 2,
+		}, counts, NULL, NULL, NULL);
+
+		wrap_output(&(struct iovec) { note.data, note.size }, 1);
+		trace_dropped += dropped - t->dropped;
+		t->dropped = dropped;
+		t->dropped_bytes = bytes;
+	}
+
+	return size != 0;
+}
+
+static void
+wrap_spare_rings(unsigned spare)
+{
+	for (unsigned i = 0; i < WRAP_MAX_THREADS && spare < WRAP_SPARE_RINGS; ++i) {
+		if (atomic_load(&trace_rings[i]))
+			continue;
+
+		struct wrap_thread *t = calloc(1, sizeof(*t));
+		if (!t)
+			return;
+
+		agx_ring_init(&t->ring, trace_ring_size);
+		atomic_store(&trace_rings[i], t);
+		++spare;
+	}
+}
+
+static void *
+wrap_writer(void *data)
+{
+	(void) data;
+
+	for (;;) {
+		bool stopping = atomic_load(&trace_stopping);
+		bool busy = false;
+		unsigned spare = 0;
+
+		for (unsigned i = 0; i < WRAP_MAX_THREADS; ++i) {
+			struct wrap_thread *t = atomic_load(&trace_rings[i]);
+			if (!t)
+				continue;
+
+			/* A retired ring has had its last push, so after this drain
+			 * it is empty for good and can be handed out again */
+			enum wrap_ring_state state = atomic_load(&t->state);
+			if (state != WRAP_RING_FREE)
+				busy |= wrap_drain(t);
+
+			if (state == WRAP_RING_RETIRED)
+				atomic_store(&t->state, WRAP_RING_FREE);
+
+			spare += (state != WRAP_RING_USED);
+		}
+
+		wrap_spare_rings(spare);
+
+		/* One last pass after being told to stop, to catch everything */
+		if (stopping)
+			return NULL;
+		else if (!busy)
+			nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+	}
+}
+
+/* Called as the thread exits. Anything it traces after this is lost. */
+
+static void
+wrap_trace_exit(void *data)
+{
+	struct wrap_thread *t = data;
+
+	trace_self = NULL;
+	trace_exited = true;
+	atomic_store(&t->state, WRAP_RING_RETIRED);
+}
+
+__attribute__((constructor))
+static void
+wrap_init(void)
+{
+	trace_text = getenv("ASAHI_TRACE_TEXT") != NULL;
+
+	if (getenv("ASAHI_TRACE_RING"))
+		trace_ring_size = strtoull(getenv("ASAHI_TRACE_RING"), NULL, 0) << 10;
+
+	if (!trace_text) {
+		const char *path = getenv("ASAHI_TRACE") ?: "trace.bin";
+		trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+		if (trace_fd < 0) {
+			perror(path);
+			trace_text = true;
+		} else {
+			struct agx_trace_header header = {
+				.magic = AGX_TRACE_MAGIC,
+				.version = AGX_TRACE_VERSION,
+				.header_size = sizeof(header),
+			};
+
+			write(trace_fd, &header, sizeof(header));
+		}
+	}
+
+	text.fp = stdout;
+	wrap_spare_rings(0);
+	pthread_key_create(&trace_key, wrap_trace_exit);
+	pthread_create(&trace_writer, NULL, wrap_writer, NULL);
+}
+
+/* Called by dump_fini, which has to run first */
 
 static void
-hexdump(const uint8_t *hex, size_t cnt)
+wrap_fini(void)
 {
-	for (unsigned i = 0; i < cnt; ++i) {
-		printf("%02X ", hex[i]);
-		if (i && (i & 0xF) == 0xF) {
-			printf(" | ");
-			for (unsigned j = i & ~0xF; j <= i; ++j) {
-				uint8_t c = hex[j];
-				putchar((c < 32 || c > 128) ? '.' : c);
-			}
-			printf("\n");
+	atomic_store(&trace_stopping, true);
+	pthread_join(trace_writer, NULL);
+
+	uint64_t dropped = atomic_load(&trace_lost) + trace_dropped;
+	if (dropped)
+		fprintf(stderr, "wrap: dropped %llu trace records, try a larger ASAHI_TRACE_RING\n", dropped);
+}
+
+static uint64_t
+wrap_now(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (tp.tv_sec * 1000000000ull) + tp.tv_nsec;
+}
+
+/* A thread claims a free ring on its first record. If none is free, as while
+ * the writer catches up, the records are counted as lost until one is. */
+
+static void
+wrap_trace_claim(void)
+{
+	for (unsigned i = 0; i < WRAP_MAX_THREADS; ++i) {
+		struct wrap_thread *t = atomic_load(&trace_rings[i]);
+		enum wrap_ring_state state = WRAP_RING_FREE;
+
+		if (t && atomic_compare_exchange_strong(&t->state, &state, WRAP_RING_USED)) {
+			atomic_store(&t->id, trace_thread);
+			pthread_setspecific(trace_key, t);
+			trace_self = t;
+			return;
 		}
 	}
+}
+
+static uint32_t
+wrap_trace_id(void)
+{
+	if (!trace_thread)
+		trace_thread = atomic_fetch_add(&trace_threads, 1) + 1;
 
-	printf("\n");
+	return trace_thread;
+}
+
+/* Records traced on behalf of another thread, as snapshots are, come with
+ * their time and thread filled in */
+
+static void
+wrap_trace(struct agx_trace_record r, const uint64_t *scalars,
+		const uint64_t *references, const void *strct, const void *extra)
+{
+	uint32_t thread = wrap_trace_id();
+
+	if (!trace_self && !trace_exited)
+		wrap_trace_claim();
+
+	r.timestamp = r.timestamp ?: wrap_now();
+	r.thread = r.thread ?: thread;
+
+	/* The ring counts its own drops */
+	struct iovec iov[AGX_TRACE_MAX_IOV];
+	unsigned count = agx_trace_iov(&r, scalars, references, strct, extra, iov);
+
+	if (trace_self)
+		agx_ring_pushv(&trace_self->ring, iov, count);
+	else
+		atomic_fetch_add_explicit(&trace_lost, 1, memory_order_relaxed);
+}
+
+/* Outputs of a call, common to sync and async */
+
+static void
+wrap_trace_return(enum agx_trace_type type, uint32_t selector, kern_return_t ret,
+		const uint64_t *output, const uint32_t *outputCnt,
+		const void *outputStruct, const size_t *outputStructCntP)
+{
+	/* Dump linked buffer as well */
+	bool linked = outputStructCntP && selector == 2;
+
+	wrap_trace((struct agx_trace_record) {
+		.type = type,
+		.flags = (outputCnt ? AGX_TRACE_HAS_SCALARS : 0) |
+			(outputStructCntP ? AGX_TRACE_HAS_STRUCT : 0),
+		.selector = selector,
+		.ret = ret,
+		.nr_scalars = outputCnt ? *outputCnt : 0,
+		.struct_size = outputStructCntP ? *outputStructCntP : 0,
+		.extra_size = linked ? 64 : 0,
+	}, output, NULL, outputStruct, linked ? *(void **) outputStruct : NULL);
 }
 
 unsigned MAP_COUNT = 0;
 #define MAX_MAPPINGS 4096
 struct agx_allocation mappings[MAX_MAPPINGS];
 
+/* Mapped buffers are snapshotted before every submit. Each is stored in the
+ * compressed content-addressed archive ASAHI_DUMP (by default "dump.agx") only
+ * if its contents are new, and referenced by hash from a snapshot record in
+ * the trace. With ASAHI_DUMP_KEYFRAME set to N, only the pages that changed
+ * are stored, as deltas, with the whole buffer again after every N deltas.
+ *
+ * The submit itself only checksums pages and copies what changed; a dump
+ * thread hashes, compresses and writes the copies and then traces the
+ * snapshot, stamped with the submit's time and thread. Submits wait if more
+ * than ASAHI_DUMP_QUEUE MiB (256 by default) are queued.
+ *
+ * Any thread can submit, so the queue, and diffing, are serialized by
+ * dump_lock. The archive and the putting half of dump_state belong to the dump
+ * thread. */
+
+struct dump_job {
+	struct dump_job *next;
+	uint64_t timestamp, submit;
+	uint32_t thread;
+	size_t bytes;
+
+	/* The blob of each changed buffer, or NULL data */
+	unsigned count;
+	struct agx_trace_bo *bos;
+	struct agx_store_blob *blobs;
+};
+
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+static struct dump_job *dump_head, **dump_tail = &dump_head;
+static size_t dump_queued, dump_queue_limit = 256 << 20;
+static bool dump_stopping;
+
+static pthread_t dump_thread;
+static struct agx_store *dump_store;
+static struct agx_store_bo dump_state[MAX_MAPPINGS];
+static atomic_bool dump_rekey[MAX_MAPPINGS];
+static unsigned dump_keyframe;
+static uint64_t dump_submits;
+
 static void
-dump_mappings(void)
+dump_write(struct dump_job *job)
+{
+	uint64_t blobs = dump_store->stats.blobs;
+	uint64_t bytes = dump_store->stats.bytes;
+
+	for (unsigned i = 0; i < job->count; ++i) {
+		struct agx_trace_bo *bo = &job->bos[i];
+		struct agx_store_bo *state = &dump_state[bo->mapping];
+
+		/* The submit side has to start again from a keyframe */
+		if (job->blobs[i].data &&
+		    agx_store_put_blob(dump_store, state, &job->blobs[i]) == AGX_STORE_FAILED)
+			atomic_store(&dump_rekey[bo->mapping], true);
+
+		/* A zero hash reads back as missing */
+		bo->hash = state->failed ? (struct agx_hash128) { 0 } : state->hash;
+		bo->flags |= state->delta ? AGX_TRACE_BO_DELTA : 0;
+	}
+
+	uint64_t stats[] = {
+		job->submit,
+		dump_store->stats.blobs - blobs,
+		dump_store->stats.bytes - bytes,
+	};
+
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_SNAPSHOT,
+		.timestamp = job->timestamp,
+		.thread = job->thread,
+		.nr_scalars = 3,
+		.struct_size = job->count * sizeof(struct agx_trace_bo),
+	}, stats, NULL, job->bos, NULL);
+}
+
+static void *
+dump_writer(void *data)
+{
+	(void) data;
+	pthread_mutex_lock(&dump_lock);
+
+	for (;;) {
+		while (!dump_head && !dump_stopping)
+			pthread_cond_wait(&dump_cond, &dump_lock);
+
+		struct dump_job *job = dump_head;
+		if (!job)
+			break;
+
+		dump_head = job->next;
+		if (!dump_head)
+			dump_tail = &dump_head;
+
+		pthread_mutex_unlock(&dump_lock);
+		dump_write(job);
+		pthread_mutex_lock(&dump_lock);
+
+		dump_queued -= job->bytes;
+		pthread_cond_broadcast(&dump_cond);
+
+		free(job->bos);
+		free(job->blobs);
+		free(job);
+	}
+
+	pthread_mutex_unlock(&dump_lock);
+	return NULL;
+}
+
+static bool
+dump_open(void)
+{
+	const char *path = getenv("ASAHI_DUMP") ?: "dump.agx";
+	dump_store = agx_store_open(path, true);
+
+	if (!dump_store) {
+		perror(path);
+		return false;
+	}
+
+	if (getenv("ASAHI_DUMP_KEYFRAME"))
+		dump_keyframe = strtoul(getenv("ASAHI_DUMP_KEYFRAME"), NULL, 0);
+
+	if (getenv("ASAHI_DUMP_QUEUE"))
+		dump_queue_limit = strtoull(getenv("ASAHI_DUMP_QUEUE"), NULL, 0) << 20;
+
+	if (pthread_create(&dump_thread, NULL, dump_writer, NULL)) {
+		fprintf(stderr, "wrap: can't start the dump thread\n");
+		agx_store_close(dump_store);
+		dump_store = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static void
+dump_mappings_locked(void)
 {
+	/* Nothing more is written once exiting */
+	if (dump_stopping || (!dump_store && !dump_open()))
+		return;
+
+	while (dump_queued > dump_queue_limit)
+		pthread_cond_wait(&dump_cond, &dump_lock);
+
+	struct dump_job *job = calloc(1, sizeof(*job));
+	job->bos = calloc(MAP_COUNT ? MAP_COUNT : 1, sizeof(*job->bos));
+	job->blobs = calloc(MAP_COUNT ? MAP_COUNT : 1, sizeof(*job->blobs));
+	job->timestamp = wrap_now();
+	job->thread = wrap_trace_id();
+	job->submit = dump_submits++;
+
 	for (unsigned i = 0; i < MAP_COUNT; ++i) {
 		if (!mappings[i].map || !mappings[i].size)
 			continue;
 
-		char *name = NULL;
 		assert(mappings[i].type < AGX_NUM_ALLOC);
-		asprintf(&name, "%s_%llx_%u.bin", agx_alloc_types[mappings[i].type], mappings[i].gpu_va, mappings[i].index);
-		FILE *fp = fopen(name, "wb");
-		fwrite(mappings[i].map, 1, mappings[i].size, fp);
-		fclose(fp);
+		struct agx_store_bo *state = &dump_state[i];
+
+		if (atomic_exchange(&dump_rekey[i], false))
+			agx_store_bo_keyframe(state);
+
+		struct agx_store_blob *blob = &job->blobs[job->count];
+		bool changed = agx_store_diff_bo(state, mappings[i].map,
+				mappings[i].size, dump_keyframe, blob);
+
+		job->bytes += changed ? blob->size : 0;
+		job->bos[job->count++] = (struct agx_trace_bo) {
+			.gpu_va = mappings[i].gpu_va,
+			.size = mappings[i].size,
+			.mapping = i,
+			.index = mappings[i].index,
+			.type = mappings[i].type,
+			.flags = changed ? AGX_TRACE_BO_CHANGED : 0,
+		};
 	}
+
+	*dump_tail = job;
+	dump_tail = &job->next;
+	dump_queued += job->bytes;
+	pthread_cond_broadcast(&dump_cond);
+}
+
+static void
+dump_mappings(void)
+{
+	pthread_mutex_lock(&dump_lock);
+	dump_mappings_locked();
+	pthread_mutex_unlock(&dump_lock);
+}
+
+/* The archive's index is written on the way out, once everything queued is.
+ * Without it, as after a crash, readers find the buffers by walking the
+ * archive instead. This runs before the trace is finished, so the last
+ * snapshots make it in. */
+
+__attribute__((destructor))
+static void
+dump_fini(void)
+{
+	pthread_mutex_lock(&dump_lock);
+	bool started = dump_store != NULL;
+	dump_stopping = true;
+	pthread_cond_broadcast(&dump_cond);
+	pthread_mutex_unlock(&dump_lock);
+
+	if (started) {
+		pthread_join(dump_thread, NULL);
+		agx_store_close(dump_store);
+		dump_store = NULL;
+	}
+
+	wrap_fini();
 }
 
 /* Apple macro */
@@ -119,69 +622,34 @@ wrap_IOConnectCallMethod(
 	assert((output != NULL) == (outputCnt != 0));
 	assert((outputStruct != NULL) == (outputStructCntP != 0));
 
-	/* Dump inputs */
-	switch (selector) {
-	case AGX_SELECTOR_SET_API:
+	if (selector == AGX_SELECTOR_SET_API) {
 		assert(input == NULL && output == NULL && outputStruct == NULL);
 		assert(inputStruct != NULL && inputStructCnt == 16);
 		assert(((uint8_t *) inputStruct)[15] == 0x0);
-
-		printf("%X: SET_API(%s)\n", connection, (const char *) inputStruct);
-		break;
-
-	case AGX_SELECTOR_SUBMIT_COMMAND_BUFFERS:
+	} else if (selector == AGX_SELECTOR_SUBMIT_COMMAND_BUFFERS) {
 		assert(output == NULL && outputStruct == NULL);
 		assert(inputStructCnt == 40);
 		assert(inputCnt == 1);
-		
-		printf("%X: SUBMIT_COMMAND_BUFFERS command queue id:%llx %p\n", connection, input[0], inputStruct);
 
 		dump_mappings();
-
-		/* fallthrough */
-	default:
-		printf("%X: call %s (out %p, %zu)", connection, wrap_selector_name(selector), outputStructCntP, outputStructCntP ? *outputStructCntP : 0);
-
-		for (uint64_t u = 0; u < inputCnt; ++u)
-			printf(" %llx", input[u]);
-
-		if(inputStructCnt) {
-			printf(", struct:\n");
-			hexdump(inputStruct, inputStructCnt);
-		} else {
-			printf("\n");
-		}
-		
-		break;
 	}
 
+	/* Inputs, before the call in case it doesn't come back */
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_CALL,
+		.connection = connection,
+		.selector = selector,
+		.out_struct_size = outputStructCntP ? *outputStructCntP : 0,
+		.nr_scalars = inputCnt,
+		.struct_size = inputStructCnt,
+		.ptrs = { (uintptr_t) inputStruct, (uintptr_t) outputStructCntP },
+	}, input, NULL, inputStruct, NULL);
+
 	/* Invoke the real method */
 	kern_return_t ret = IOConnectCallMethod(connection, selector, input, inputCnt, inputStruct, inputStructCnt, output, outputCnt, outputStruct, outputStructCntP);
 
-	printf("return %u", ret);
-
-	/* Dump the outputs */
-	if(outputCnt) {
-		printf("%u scalars: ", *outputCnt);
-
-		for (uint64_t u = 0; u < *outputCnt; ++u)
-			printf("%llx ", output[u]);
-
-		printf("\n");
-	}
-
-	if(outputStructCntP) {
-		printf(" struct\n");
-		hexdump(outputStruct, *outputStructCntP);
-
-		if (selector == 2) {
-			/* Dump linked buffer as well */
-			void **o = outputStruct;
-			hexdump(*o, 64);
-		}
-	}
-
-	printf("\n");
+	wrap_trace_return(AGX_TRACE_RETURN, selector, ret, output, outputCnt,
+			outputStruct, outputStructCntP);
 
 	/* Track allocations for later analysis (dumping, disassembly, etc) */
 	switch (selector) {
@@ -218,12 +686,12 @@ wrap_IOConnectCallMethod(
 		uint64_t size = ptrs[4];
 		unsigned mapping = MAP_COUNT++;
 		uint32_t *iwords = (uint32_t *) inputStruct;
-		const char *type = agx_memory_type_name(iwords[20]);
-		printf("allocate gpu va %llx, cpu %llx, 0x%llx bytes (%u) ", gpu_va, cpu, size, mapping);
-		if (type)
-			printf(" %s\n", type);
-		else
-			printf(" unknown type %08X\n", iwords[20]);
+		uint64_t allocation[] = { gpu_va, cpu, size, mapping, iwords[20] };
+
+		wrap_trace((struct agx_trace_record) {
+			.type = AGX_TRACE_ALLOCATE,
+			.nr_scalars = 5,
+		}, allocation, NULL, NULL, NULL);
 
 		assert(mapping < MAX_MAPPINGS);
 		mappings[mapping] = (struct agx_allocation) {
@@ -264,48 +732,22 @@ wrap_IOConnectCallAsyncMethod(
 	assert((output != NULL) == (outputCnt != 0));
 	assert((outputStruct != NULL) == (outputStructCntP != 0));
 
-	printf("%X: call %X, wake port %X (out %p, %zu)", connection, selector, wakePort, outputStructCntP, outputStructCntP ? *outputStructCntP : 0);
-
-	for (uint64_t u = 0; u < inputCnt; ++u)
-		printf(" %llx", input[u]);
-
-	if(inputStructCnt) {
-		printf(", struct:\n");
-		hexdump(inputStruct, inputStructCnt);
-	} else {
-		printf("\n");
-	}
-
-	printf(", references: ");
-	for (unsigned i = 0; i < referenceCnt; ++i)
-		printf(" %llx", reference[i]);
-	printf("\n");
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_CALL_ASYNC,
+		.connection = connection,
+		.selector = selector,
+		.port = wakePort,
+		.out_struct_size = outputStructCntP ? *outputStructCntP : 0,
+		.nr_scalars = inputCnt,
+		.nr_references = referenceCnt,
+		.struct_size = inputStructCnt,
+		.ptrs = { (uintptr_t) inputStruct, (uintptr_t) outputStructCntP },
+	}, input, reference, inputStruct, NULL);
 
 	kern_return_t ret = IOConnectCallAsyncMethod(connection, selector, wakePort, reference, referenceCnt, input, inputCnt, inputStruct, inputStructCnt, output, outputCnt, outputStruct, outputStructCntP);
 
-	printf("return %u", ret);
-
- 	if(outputCnt) {
-		printf("%u scalars: ", *outputCnt);
-
-		for (uint64_t u = 0; u < *outputCnt; ++u)
-			printf("%llx ", output[u]);
-
-		printf("\n");
-	}
-
-	if(outputStructCntP) {
-		printf(" struct\n");
-		hexdump(outputStruct, *outputStructCntP);
-
-		if (selector == 2) {
-			/* Dump linked buffer as well */
-			void **o = outputStruct;
-			hexdump(*o, 64);
-		}
-	}
-
-	printf("\n");
+	wrap_trace_return(AGX_TRACE_RETURN_ASYNC, selector, ret, output, outputCnt,
+			outputStruct, outputStructCntP);
 	return ret;
 }
 
@@ -384,9 +826,18 @@ wrap_IOConnectSetNotificationPort(
 	mach_port_t	port,
 	uintptr_t	reference )
 {
-	printf("connect %X, type %X, to notification port %X, with reference %lx\n", connect, type, port, reference);
 	kern_return_t ret = IOConnectSetNotificationPort(connect, type, port, reference);
-	printf("return %u\n", ret);
+	uint64_t ref = reference;
+
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_SET_NOTIFICATION_PORT,
+		.connection = connect,
+		.selector = type,
+		.port = port,
+		.ret = ret,
+		.nr_scalars = 1,
+	}, &ref, NULL, NULL, NULL);
+
 	return ret;
 }
 
@@ -404,14 +855,23 @@ wrap_IONotificationPortCreate(
 	mach_port_t	masterPort )
 {
 	IONotificationPortRef ref = IONotificationPortCreate(masterPort);
-	printf("creating notification port from master %X --> %p\n", masterPort, ref);
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_NOTIFICATION_PORT_CREATE,
+		.port = masterPort,
+		.ptrs = { (uintptr_t) ref },
+	}, NULL, NULL, NULL, NULL);
+
 	return ref;
 }
 
 void
 wrap_IONotificationPortSetDispatchQueue(IONotificationPortRef notify, dispatch_queue_t queue)
 {
-	printf("set dispatch queue %p to queue %p\n", notify, queue);
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_SET_DISPATCH_QUEUE,
+		.ptrs = { (uintptr_t) notify, (uintptr_t) queue },
+	}, NULL, NULL, NULL, NULL);
+
 	IONotificationPortSetDispatchQueue(notify, queue);
 }
 
@@ -419,7 +879,11 @@ mach_port_t
 wrap_IODataQueueAllocateNotificationPort()
 {
 	mach_port_t ret = IODataQueueAllocateNotificationPort();
-	printf("data queue notif port %X\n", ret);
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_DATA_QUEUE_ALLOCATE_PORT,
+		.port = ret,
+	}, NULL, NULL, NULL, NULL);
+
 	return ret;
 }
 
@@ -427,7 +891,13 @@ IOReturn
 wrap_IODataQueueSetNotificationPort(IODataQueueMemory *dataQueue, mach_port_t notifyPort)
 {
 	IOReturn ret = IODataQueueSetNotificationPort(dataQueue, notifyPort);
-	printf("data queue %p set notif port %X -> %X\n", dataQueue, notifyPort, ret);
+	wrap_trace((struct agx_trace_record) {
+		.type = AGX_TRACE_DATA_QUEUE_SET_PORT,
+		.port = notifyPort,
+		.ret = ret,
+		.ptrs = { (uintptr_t) dataQueue },
+	}, NULL, NULL, NULL, NULL);
+
 	return ret;
 }
 